@@ -3,6 +3,7 @@ project "Ray Tracing in One Weekend"
 	language "C++"
 	cppdialect "C++20"
 	staticruntime "off"
+	vectorextensions "AVX2"
 
 	targetdir ("%{wks.location}/bin/" .. outputdir .. "/%{prj.name}")
 	objdir ("%{wks.location}/bin-int/" .. outputdir .. "/%{prj.name}")
@@ -41,27 +41,43 @@ public:
 		return X;
 	}
 
-	bool Hit(const Ray& ray, Interval rayT) const
+	glm::vec3 Centroid() const
 	{
-		for (int a = 0; a < 3; a++)
-		{
-			float invD = 1 / ray.Direction()[a];
-			float orig = ray.Origin()[a];
-
-			float t0 = (Axis(a).Min - orig) * invD;
-			float t1 = (Axis(a).Max - orig) * invD;
-
-			if (invD < 0)
-				std::swap(t0, t1);
+		return glm::vec3(X.Min + X.Max, Y.Min + Y.Max, Z.Min + Z.Max) * 0.5f;
+	}
 
-			if (t0 > rayT.Min) rayT.Min = t0;
-			if (t1 < rayT.Max) rayT.Max = t1;
+	float SurfaceArea() const
+	{
+		if (X.Size() < 0 || Y.Size() < 0 || Z.Size() < 0)
+			return 0.0f;
 
-			if (rayT.Max <= rayT.Min)
-				return false;
-		}
+		return 2.0f * (X.Size() * Y.Size() + Y.Size() * Z.Size() + Z.Size() * X.Size());
+	}
 
-		return true;
+	bool Hit(const Ray& ray, Interval rayT) const
+	{
+		const glm::vec3& origin = ray.Origin();
+		const glm::vec3& invD = ray.InverseDirection();
+
+		// Slabs are ordered by the ray's direction sign, so no swap is needed. When the origin lies on a slab of an
+		// axis-parallel ray t is 0 * inf = NaN, the comparisons below are then false and rayT is left as is
+		float tx0 = ((ray.Sign(0) ? X.Max : X.Min) - origin.x) * invD.x;
+		float tx1 = ((ray.Sign(0) ? X.Min : X.Max) - origin.x) * invD.x;
+		float ty0 = ((ray.Sign(1) ? Y.Max : Y.Min) - origin.y) * invD.y;
+		float ty1 = ((ray.Sign(1) ? Y.Min : Y.Max) - origin.y) * invD.y;
+		float tz0 = ((ray.Sign(2) ? Z.Max : Z.Min) - origin.z) * invD.z;
+		float tz1 = ((ray.Sign(2) ? Z.Min : Z.Max) - origin.z) * invD.z;
+
+		rayT.Min = tx0 > rayT.Min ? tx0 : rayT.Min;
+		rayT.Max = tx1 < rayT.Max ? tx1 : rayT.Max;
+		rayT.Min = ty0 > rayT.Min ? ty0 : rayT.Min;
+		rayT.Max = ty1 < rayT.Max ? ty1 : rayT.Max;
+		rayT.Min = tz0 > rayT.Min ? tz0 : rayT.Min;
+		rayT.Max = tz1 < rayT.Max ? tz1 : rayT.Max;
+
+		// The far distance is widened by the worst case rounding error of the slab distances (pbrt's 1 + 2 gamma(3)),
+		// otherwise rays can slip past the padded boxes of axis-aligned quads far from the origin
+		return rayT.Min <= rayT.Max * 1.00000036f;
 	}
 };
 
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string_view>
+
+#include "Utils.h"
+#include "HittableList.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "PrimitiveStore.h"
+
+// Acceleration structure built over the objects of a scene
+enum class AcceleratorType
+{
+	Store,	// PrimitiveStore, SIMD leaves over spheres, quads and boxes
+	Binary,	// BVHNode
+	BVH4,
+	BVH8
+};
+
+struct AcceleratorOptions
+{
+	AcceleratorType Type = AcceleratorType::Store;
+	BVHSplitMethod SplitMethod = BVHSplitMethod::SAH;
+
+	// Options for the BVHs of meshes and anything else built outside BuildAccelerator
+	BVHBuildOptions BuildOptions() const
+	{
+		BVHBuildOptions options;
+		options.SplitMethod = SplitMethod;
+
+		return options;
+	}
+};
+
+inline bool ParseAcceleratorType(std::string_view name, AcceleratorType& type)
+{
+	if (name == "store") type = AcceleratorType::Store;
+	else if (name == "binary") type = AcceleratorType::Binary;
+	else if (name == "bvh4") type = AcceleratorType::BVH4;
+	else if (name == "bvh8") type = AcceleratorType::BVH8;
+	else return false;
+
+	return true;
+}
+
+inline bool ParseSplitMethod(std::string_view name, BVHSplitMethod& method)
+{
+	if (name == "sah") method = BVHSplitMethod::SAH;
+	else if (name == "median") method = BVHSplitMethod::Median;
+	else if (name == "lbvh") method = BVHSplitMethod::LBVH;
+	else return false;
+
+	return true;
+}
+
+inline std::shared_ptr<Hittable> BuildAccelerator(const HittableList& list, const AcceleratorOptions& options)
+{
+	// The store keeps its own leaf size and costs, only the splitter is chosen
+	BVHBuildOptions build = options.Type == AcceleratorType::Store ? PrimitiveStore::DefaultBuildOptions() : BVHBuildOptions();
+	build.SplitMethod = options.SplitMethod;
+
+	switch (options.Type)
+	{
+		case AcceleratorType::Binary: return std::make_shared<BVHNode>(list, build);
+		case AcceleratorType::BVH4: return std::make_shared<BVH4>(list, build);
+		case AcceleratorType::BVH8: return std::make_shared<BVH8>(list, build);
+		default: return std::make_shared<PrimitiveStore>(list, build);
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "Utils.h"
+#include "Transform.h"
+
+// Transform at one point of an animation, kept decomposed so interpolating between keyframes never shears.
+// Applied as scale, then rotation, then translation
+struct Keyframe
+{
+	float Time = 0.0f;		// Seconds
+	glm::vec3 Translation = glm::vec3(0.0f);
+	float RotationY = 0.0f;	// Degrees, not wrapped so a key at 360 spins a full turn
+	glm::vec3 Scale = glm::vec3(1.0f);
+
+	Transform ToTransform() const
+	{
+		return Transform::Translate(Translation) * Transform::RotateY(RotationY) * Transform::Scale(Scale);
+	}
+};
+
+// Keyframes interpolated linearly, held at the first and last one outside their time range. They rotate and
+// scale around pivot
+class KeyframeTrack
+{
+public:
+	KeyframeTrack() = default;
+
+	KeyframeTrack(std::vector<Keyframe> keys, const glm::vec3& pivot = glm::vec3(0.0f)) : m_Keys(std::move(keys)), m_Pivot(pivot)
+	{
+		std::stable_sort(m_Keys.begin(), m_Keys.end(), [](const Keyframe& a, const Keyframe& b) { return a.Time < b.Time; });
+	}
+
+	void Add(const Keyframe& key)
+	{
+		auto it = std::upper_bound(m_Keys.begin(), m_Keys.end(), key.Time, [](float time, const Keyframe& k) { return time < k.Time; });
+		m_Keys.insert(it, key);
+	}
+
+	bool Empty() const { return m_Keys.empty(); }
+
+	Transform At(float time) const
+	{
+		return Transform::Translate(m_Pivot) * Sample(time).ToTransform() * Transform::Translate(-m_Pivot);
+	}
+
+	Keyframe Sample(float time) const
+	{
+		if (m_Keys.empty())
+			return Keyframe();
+
+		if (time <= m_Keys.front().Time)
+			return m_Keys.front();
+
+		if (time >= m_Keys.back().Time)
+			return m_Keys.back();
+
+		auto next = std::upper_bound(m_Keys.begin(), m_Keys.end(), time, [](float t, const Keyframe& k) { return t < k.Time; });
+		const Keyframe& a = *(next - 1);
+		const Keyframe& b = *next;
+		float s = (time - a.Time) / (b.Time - a.Time);
+
+		Keyframe key;
+		key.Time = time;
+		key.Translation = glm::mix(a.Translation, b.Translation, s);
+		key.RotationY = a.RotationY + s * (b.RotationY - a.RotationY);
+		key.Scale = glm::mix(a.Scale, b.Scale, s);
+
+		return key;
+	}
+
+	// One full turn around the vertical axis through pivot over the first period seconds
+	static KeyframeTrack Turntable(const glm::vec3& pivot, float period)
+	{
+		Keyframe end;
+		end.Time = period;
+		end.RotationY = 360.0f;
+
+		return KeyframeTrack({ Keyframe(), end }, pivot);
+	}
+
+private:
+	std::vector<Keyframe> m_Keys;
+	glm::vec3 m_Pivot = glm::vec3(0.0f);
+};
@@ -1,91 +1,1414 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+#include <typeinfo>
+#include <variant>
 
 #include "Utils.h"
 #include "Hittable.h"
 #include "HittableList.h"
+#include "ThreadPool.h"
+#include "Sphere.h"
+#include "Quad.h"
 
-class BVHNode : public Hittable
+enum class BVHSplitMethod
+{
+	Median,	// Object median along the widest centroid axis
+	SAH,	// Binned surface area heuristic
+	LBVH	// Morton code order, optionally restructured towards SAH quality afterwards
+};
+
+struct BVHBuildOptions
+{
+	BVHSplitMethod SplitMethod = BVHSplitMethod::SAH;
+	int BinCount = 16;
+	int MaxLeafSize = 4;
+	float TraversalCost = 1.0f;
+	float IntersectionCost = 1.0f;
+	uint32_t ThreadCount = 0;	// 0 uses every hardware thread, 1 builds on the calling thread. Small builds never spawn threads
+	int TreeletPasses = 0;		// LBVH only: treelet restructuring passes over the whole tree
+	float RebuildThreshold = 1.5f;	// Animated BVHs refit until that raises their SAH cost by this factor, then rebuild
+	float MotionThreshold = 0.8f;	// Moving primitives get boxes interpolated to the ray's time when that brings the SAH cost below this fraction
+};
+
+// Node of the flattened tree, stored depth first so the left child always directly follows its parent
+struct alignas(32) LinearBVHNode
+{
+	AABB Bbox;
+	uint32_t Offset;		// First primitive for leaves, right child for interior nodes
+	uint16_t PrimitiveCount;	// 0 for interior nodes
+	uint8_t Axis;
+	uint8_t Padding;
+
+	bool Hit(const Ray& ray, Interval rayT) const { return Bbox.Hit(ray, rayT); }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill exactly half a cache line");
+
+// Node of a tree over primitives that move during the shutter, with the same topology as the LinearBVHNode it was
+// fitted to. Holds the box at shutter open and how far each slab moves until close, so the box at a ray's time is one
+// multiply-add per slab instead of the box over the whole shutter
+struct alignas(64) LinearMotionBVHNode
+{
+	AABB Bbox;				// At time 0
+	glm::vec3 MinDelta;
+	glm::vec3 MaxDelta;
+	uint32_t Offset;
+	uint16_t PrimitiveCount;
+	uint8_t Axis;
+	uint8_t Padding;
+
+	AABB At(float time) const
+	{
+		return AABB(
+			Interval(Bbox.X.Min + time * MinDelta.x, Bbox.X.Max + time * MaxDelta.x),
+			Interval(Bbox.Y.Min + time * MinDelta.y, Bbox.Y.Max + time * MaxDelta.y),
+			Interval(Bbox.Z.Min + time * MinDelta.z, Bbox.Z.Max + time * MaxDelta.z));
+	}
+
+	bool Hit(const Ray& ray, Interval rayT) const { return At(ray.Time()).Hit(ray, rayT); }
+};
+
+static_assert(sizeof(LinearMotionBVHNode) == 64, "LinearMotionBVHNode should fill exactly one cache line");
+
+// Expected cost of tracing a ray through the tree that hits its root box, by the surface area heuristic
+inline float SAHCost(const std::vector<LinearBVHNode>& nodes, const BVHBuildOptions& options)
+{
+	if (nodes.empty() || nodes[0].Bbox.SurfaceArea() <= 0.0f)
+		return 0.0f;
+
+	float cost = 0.0f;
+
+	for (const LinearBVHNode& node : nodes)
+	{
+		float nodeCost = node.PrimitiveCount > 0 ? options.IntersectionCost * node.PrimitiveCount : options.TraversalCost;
+		cost += nodeCost * node.Bbox.SurfaceArea();
+	}
+
+	return cost / nodes[0].Bbox.SurfaceArea();
+}
+
+// Plain min / max corners used while building, growing them compiles to vector min / max where AABB's fmin calls do not inline
+struct BVHBuildBox
+{
+	glm::vec3 Min = glm::vec3(Infinity);
+	glm::vec3 Max = glm::vec3(-Infinity);
+
+	BVHBuildBox() = default;
+	BVHBuildBox(const AABB& box) : Min(box.X.Min, box.Y.Min, box.Z.Min), Max(box.X.Max, box.Y.Max, box.Z.Max) {}
+
+	void Grow(const glm::vec3& point)
+	{
+		Min = glm::min(Min, point);
+		Max = glm::max(Max, point);
+	}
+
+	void Grow(const BVHBuildBox& box)
+	{
+		Min = glm::min(Min, box.Min);
+		Max = glm::max(Max, box.Max);
+	}
+
+	glm::vec3 Centroid() const { return 0.5f * (Min + Max); }
+
+	float SurfaceArea() const
+	{
+		glm::vec3 size = Max - Min;
+
+		if (size.x < 0.0f || size.y < 0.0f || size.z < 0.0f)
+			return 0.0f;
+
+		return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+};
+
+// Linear BVH (Karras 2012): sorts the primitives along a Morton curve through their centroids and reads the tree off
+// the sorted codes, every internal node independently of the others. Much faster to build than binned SAH but
+// noticeably slower to trace, so optional treelet restructuring passes (Karras and Aila 2013) rebuild every treelet
+// of up to seven leaves in its SAH optimal topology afterwards. Produces the same node layout as BVHBuilder
+class LBVHBuilder
 {
 public:
-	BVHNode(const HittableList& list) : BVHNode(list.objects, 0, list.objects.size()) {}
+	LBVHBuilder(const std::vector<AABB>& bounds, const BVHBuildOptions& options = BVHBuildOptions())
+		: m_Bounds(bounds), m_Options(options) {}
+
+	std::vector<LinearBVHNode> Build(std::vector<uint32_t>& indices)
+	{
+		if (indices.empty())
+			return {};
+
+		std::unique_ptr<ThreadPool> pool;
+
+		if (indices.size() >= ParallelThreshold && m_Options.ThreadCount != 1)
+			pool = std::make_unique<ThreadPool>(m_Options.ThreadCount);
+
+		m_Pool = pool.get();
+		m_LeafStart = static_cast<uint32_t>(indices.size() - 1);
+		m_Sorted = indices;
+
+		// 30 bit codes separate a million primitives well, beyond that 63 bits keep neighbours from sharing a code
+		if (indices.size() <= (1u << 20))
+			EmitHierarchy(MortonCodes<uint32_t>());
+		else
+			EmitHierarchy(MortonCodes<uint64_t>());
+
+		Climb(false);
+
+		for (int pass = 0; pass < m_Options.TreeletPasses; pass++)
+			Climb(true);
+
+		std::vector<LinearBVHNode> nodes(m_Nodes[0].NodeCount);
+		Flatten(nodes, indices, 0, 0, 0);
+
+		if (m_Pool)
+			m_Pool->Wait();
+
+		m_Sorted = {};
+		m_Nodes = {};
+
+		return nodes;
+	}
+
+private:
+	static constexpr size_t ParallelThreshold = 4096;
+	static constexpr int TreeletSize = 7;
+
+	// Internal nodes come first, the leaf for the i-th sorted primitive is m_LeafStart + i
+	struct Node
+	{
+		BVHBuildBox Bounds;
+		uint32_t Left = 0;
+		uint32_t Right = 0;
+		uint32_t Parent = ~0u;
+		uint32_t PrimitiveCount = 1;
+		uint32_t NodeCount = 1;		// In the flattened tree, where collapsed subtrees are a single leaf
+		float Cost = 0.0f;			// SAH cost scaled by the node's surface area
+		bool Collapsed = false;		// Cheaper as one leaf over all primitives below it
+	};
+
+	const std::vector<AABB>& m_Bounds;
+	BVHBuildOptions m_Options;
+	ThreadPool* m_Pool = nullptr;
+	uint32_t m_LeafStart = 0;
+	std::vector<uint32_t> m_Sorted;
+	std::vector<Node> m_Nodes;
 
-	BVHNode(const std::vector<std::shared_ptr<Hittable>>& srcObjects, size_t start, size_t end)
+	bool IsLeaf(uint32_t node) const { return node >= m_LeafStart; }
+
+	// Codes of the centroids in their bounds, sorted together with m_Sorted
+	template<typename Code>
+	std::vector<Code> MortonCodes()
 	{
-		std::vector<std::shared_ptr<Hittable>> objects = srcObjects;
+		size_t count = m_Sorted.size();
+		std::vector<BVHBuildBox> chunkBounds(ParallelChunkCount(m_Pool, count));
+
+		ParallelFor(m_Pool, count, [&](uint32_t chunk, size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+					chunkBounds[chunk].Grow(BVHBuildBox(m_Bounds[m_Sorted[i]]).Centroid());
+			});
+
+		BVHBuildBox centroidBounds;
 
-		int axis = RandomInt(0, 2);
-		auto comparator = (axis == 0) ? BoxXCompare
-						: (axis == 1) ? BoxYCompare
-						: BoxZCompare;
+		for (const BVHBuildBox& box : chunkBounds)
+			centroidBounds.Grow(box);
 
-		size_t objectSpan = end - start;
+		constexpr int bits = sizeof(Code) == 4 ? 10 : 21;
+		constexpr float cells = static_cast<float>(1u << bits);
+		glm::vec3 extent = centroidBounds.Max - centroidBounds.Min;
+		glm::vec3 scale = glm::vec3(
+			extent.x > 0.0f ? cells / extent.x : 0.0f,
+			extent.y > 0.0f ? cells / extent.y : 0.0f,
+			extent.z > 0.0f ? cells / extent.z : 0.0f);
 
-		if (objectSpan == 1)
+		std::vector<Code> codes(count);
+
+		ParallelFor(m_Pool, count, [&](uint32_t, size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					glm::vec3 cell = (BVHBuildBox(m_Bounds[m_Sorted[i]]).Centroid() - centroidBounds.Min) * scale;
+					Code code = 0;
+
+					for (int axis = 0; axis < 3; axis++)
+					{
+						Code coordinate = static_cast<Code>(std::min(cell[axis], cells - 1.0f));
+						code |= SpreadBits(coordinate) << (2 - axis);
+					}
+
+					codes[i] = code;
+				}
+			});
+
+		RadixSort(codes);
+
+		return codes;
+	}
+
+	// Moves the low bits of value three places apart, so three of them interleave
+	static uint32_t SpreadBits(uint32_t value)
+	{
+		value = (value * 0x00010001u) & 0xFF0000FFu;
+		value = (value * 0x00000101u) & 0x0F00F00Fu;
+		value = (value * 0x00000011u) & 0xC30C30C3u;
+		value = (value * 0x00000005u) & 0x49249249u;
+		return value;
+	}
+
+	static uint64_t SpreadBits(uint64_t value)
+	{
+		value &= 0x1FFFFF;
+		value = (value | value << 32) & 0x1F00000000FFFFull;
+		value = (value | value << 16) & 0x1F0000FF0000FFull;
+		value = (value | value << 8) & 0x100F00F00F00F00Full;
+		value = (value | value << 4) & 0x10C30C30C30C30C3ull;
+		value = (value | value << 2) & 0x1249249249249249ull;
+		return value;
+	}
+
+	// Stable least significant digit radix sort on bytes. Every chunk counts its digits, the counts are summed digit
+	// major so each chunk scatters into its own ranges in order
+	template<typename Code>
+	void RadixSort(std::vector<Code>& codes)
+	{
+		size_t count = codes.size();
+		uint32_t chunkCount = ParallelChunkCount(m_Pool, count);
+		std::vector<uint32_t> offsets(256 * static_cast<size_t>(chunkCount));
+		std::vector<Code> codesTemp(count);
+		std::vector<uint32_t> sortedTemp(count);
+
+		for (int shift = 0; shift < 8 * static_cast<int>(sizeof(Code)); shift += 8)
 		{
-			m_Left = m_Right = objects[start];
+			ParallelFor(m_Pool, count, [&](uint32_t chunk, size_t begin, size_t end)
+				{
+					uint32_t* chunkOffsets = &offsets[256 * static_cast<size_t>(chunk)];
+					std::fill(chunkOffsets, chunkOffsets + 256, 0);
+
+					for (size_t i = begin; i < end; i++)
+						chunkOffsets[(codes[i] >> shift) & 0xFF]++;
+				});
+
+			uint32_t sum = 0;
+			bool allSame = false;
+
+			for (int digit = 0; digit < 256 && !allSame; digit++)
+			{
+				uint32_t digitCount = 0;
+
+				for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+				{
+					uint32_t& offset = offsets[256 * static_cast<size_t>(chunk) + digit];
+					uint32_t chunkDigits = offset;
+					offset = sum + digitCount;
+					digitCount += chunkDigits;
+				}
+
+				sum += digitCount;
+				allSame = digitCount == count;
+			}
+
+			// The high bytes of small codes and of tightly clustered scenes are often equal everywhere
+			if (allSame)
+				continue;
+
+			ParallelFor(m_Pool, count, [&](uint32_t chunk, size_t begin, size_t end)
+				{
+					uint32_t* chunkOffsets = &offsets[256 * static_cast<size_t>(chunk)];
+
+					for (size_t i = begin; i < end; i++)
+					{
+						uint32_t destination = chunkOffsets[(codes[i] >> shift) & 0xFF]++;
+						codesTemp[destination] = codes[i];
+						sortedTemp[destination] = m_Sorted[i];
+					}
+				});
+
+			codes.swap(codesTemp);
+			m_Sorted.swap(sortedTemp);
 		}
-		else if (objectSpan == 2)
+	}
+
+	// Every internal node finds the range of sorted keys it covers and where that range splits, from the length of
+	// the prefixes its keys share with their neighbours. Equal codes are told apart by their index
+	template<typename Code>
+	void EmitHierarchy(const std::vector<Code>& codes)
+	{
+		int64_t count = static_cast<int64_t>(codes.size());
+		m_Nodes.assign(2 * codes.size() - 1, Node());
+
+		auto commonPrefix = [&](int64_t i, int64_t j)
 		{
-			if (comparator(objects[start], objects[start + 1]))
+			if (j < 0 || j >= count)
+				return -1;
+
+			if (codes[i] == codes[j])
+				return static_cast<int>(8 * sizeof(Code)) + std::countl_zero(static_cast<uint64_t>(i ^ j));
+
+			return std::countl_zero(codes[i] ^ codes[j]);
+		};
+
+		ParallelFor(m_Pool, codes.size() - 1, [&](uint32_t, size_t begin, size_t end)
 			{
-				m_Left = objects[start];
-				m_Right = objects[start + 1];
+				for (int64_t i = static_cast<int64_t>(begin); i < static_cast<int64_t>(end); i++)
+				{
+					// The range extends towards the neighbour sharing the longer prefix
+					int64_t direction = commonPrefix(i, i + 1) > commonPrefix(i, i - 1) ? 1 : -1;
+					int minPrefix = commonPrefix(i, i - direction);
+
+					int64_t maxLength = 2;
+
+					while (commonPrefix(i, i + maxLength * direction) > minPrefix)
+						maxLength *= 2;
+
+					int64_t length = 0;
+
+					for (int64_t step = maxLength / 2; step > 0; step /= 2)
+					{
+						if (commonPrefix(i, i + (length + step) * direction) > minPrefix)
+							length += step;
+					}
+
+					int64_t j = i + length * direction;
+					int nodePrefix = commonPrefix(i, j);
+
+					// The split is the last key still sharing more than the whole range's prefix with i
+					int64_t split = 0;
+					int64_t step = length;
+
+					do
+					{
+						step = (step + 1) / 2;
+
+						if (commonPrefix(i, i + (split + step) * direction) > nodePrefix)
+							split += step;
+					} while (step > 1);
+
+					int64_t gamma = i + split * direction + std::min<int64_t>(direction, 0);
+
+					Node& node = m_Nodes[i];
+					node.Left = std::min(i, j) == gamma ? m_LeafStart + static_cast<uint32_t>(gamma) : static_cast<uint32_t>(gamma);
+					node.Right = std::max(i, j) == gamma + 1 ? m_LeafStart + static_cast<uint32_t>(gamma + 1) : static_cast<uint32_t>(gamma + 1);
+					m_Nodes[node.Left].Parent = static_cast<uint32_t>(i);
+					m_Nodes[node.Right].Parent = static_cast<uint32_t>(i);
+				}
+			});
+	}
+
+	// Walks up from every leaf in parallel. The second thread to reach a node finds both children done, updates the node
+	// and carries on upwards, the first one stops there
+	void Climb(bool restructure)
+	{
+		std::vector<std::atomic<uint32_t>> visits(m_LeafStart);
+
+		ParallelFor(m_Pool, m_Sorted.size(), [&](uint32_t, size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					uint32_t node = m_LeafStart + static_cast<uint32_t>(i);
+
+					if (!restructure)
+					{
+						Node& leaf = m_Nodes[node];
+						leaf.Bounds = BVHBuildBox(m_Bounds[m_Sorted[i]]);
+						leaf.Cost = m_Options.IntersectionCost * leaf.Bounds.SurfaceArea();
+					}
+
+					for (uint32_t parent = m_Nodes[node].Parent; parent != ~0u; parent = m_Nodes[parent].Parent)
+					{
+						if (visits[parent].fetch_add(1, std::memory_order_acq_rel) == 0)
+							break;
+
+						Update(parent);
+
+						if (restructure && m_Nodes[parent].PrimitiveCount >= TreeletSize)
+							RestructureTreelet(parent);
+					}
+				}
+			});
+	}
+
+	void Update(uint32_t index)
+	{
+		Node& node = m_Nodes[index];
+		const Node& left = m_Nodes[node.Left];
+		const Node& right = m_Nodes[node.Right];
+
+		node.Bounds = left.Bounds;
+		node.Bounds.Grow(right.Bounds);
+		node.PrimitiveCount = left.PrimitiveCount + right.PrimitiveCount;
+
+		float area = node.Bounds.SurfaceArea();
+		float interiorCost = m_Options.TraversalCost * area + left.Cost + right.Cost;
+		float leafCost = m_Options.IntersectionCost * area * node.PrimitiveCount;
+
+		node.Collapsed = node.PrimitiveCount <= MaxLeafSize() && leafCost <= interiorCost;
+		node.Cost = node.Collapsed ? leafCost : interiorCost;
+		node.NodeCount = node.Collapsed ? 1 : 1 + left.NodeCount + right.NodeCount;
+	}
+
+	// Grows a treelet below root by repeatedly opening its largest leaf, then finds the cheapest binary tree over
+	// its leaves with dynamic programming over all subsets of them, and rebuilds the treelet from its own internal nodes
+	void RestructureTreelet(uint32_t root)
+	{
+		uint32_t leaves[TreeletSize] = { m_Nodes[root].Left, m_Nodes[root].Right };
+		uint32_t internals[TreeletSize - 1] = { root };
+		int leafCount = 2;
+		int internalCount = 1;
+
+		while (leafCount < TreeletSize)
+		{
+			int largest = -1;
+			float largestArea = -1.0f;
+
+			for (int i = 0; i < leafCount; i++)
+			{
+				if (!IsLeaf(leaves[i]) && m_Nodes[leaves[i]].Bounds.SurfaceArea() > largestArea)
+				{
+					largest = i;
+					largestArea = m_Nodes[leaves[i]].Bounds.SurfaceArea();
+				}
 			}
-			else
+
+			if (largest == -1)
+				break;
+
+			uint32_t opened = leaves[largest];
+			internals[internalCount++] = opened;
+			leaves[largest] = m_Nodes[opened].Left;
+			leaves[leafCount++] = m_Nodes[opened].Right;
+		}
+
+		// Two leaves only have one topology
+		if (leafCount < 3)
+			return;
+
+		// Subsets are bit masks over the leaves, all proper subsets of a set are numerically smaller than it
+		constexpr int maxSubsets = 1 << TreeletSize;
+		BVHBuildBox bounds[maxSubsets];
+		uint32_t primitiveCounts[maxSubsets];
+		float costs[maxSubsets];
+		uint8_t splits[maxSubsets];
+
+		int fullSet = (1 << leafCount) - 1;
+		bounds[0] = BVHBuildBox();
+		primitiveCounts[0] = 0;
+
+		for (int set = 1; set <= fullSet; set++)
+		{
+			int lowest = std::countr_zero(static_cast<uint32_t>(set));
+			const Node& leaf = m_Nodes[leaves[lowest]];
+			int rest = set & (set - 1);
+
+			bounds[set] = bounds[rest];
+			bounds[set].Grow(leaf.Bounds);
+			primitiveCounts[set] = primitiveCounts[rest] + leaf.PrimitiveCount;
+
+			if (rest == 0)
+			{
+				costs[set] = leaf.Cost;
+				continue;
+			}
+
+			// Every partition once: the part holding the lowest leaf goes left
+			float bestCost = Infinity;
+			int bestSplit = 0;
+
+			for (int part = rest; part > 0; part = (part - 1) & rest)
 			{
-				m_Left = objects[start + 1];
-				m_Right = objects[start];
+				int left = set ^ part;
+				float cost = costs[left] + costs[part];
+
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestSplit = left;
+				}
 			}
+
+			float area = bounds[set].SurfaceArea();
+			float interiorCost = m_Options.TraversalCost * area + bestCost;
+			float leafCost = m_Options.IntersectionCost * area * primitiveCounts[set];
+
+			costs[set] = primitiveCounts[set] <= MaxLeafSize() ? std::min(interiorCost, leafCost) : interiorCost;
+			splits[set] = static_cast<uint8_t>(bestSplit);
 		}
+
+		if (costs[fullSet] >= m_Nodes[root].Cost)
+			return;
+
+		int nextInternal = 1;
+
+		auto rebuild = [&](auto& self, uint32_t index, int set) -> void
+		{
+			int parts[2] = { splits[set], set ^ splits[set] };
+			uint32_t children[2];
+
+			for (int c = 0; c < 2; c++)
+			{
+				if (std::popcount(static_cast<uint32_t>(parts[c])) == 1)
+				{
+					children[c] = leaves[std::countr_zero(static_cast<uint32_t>(parts[c]))];
+				}
+				else
+				{
+					children[c] = internals[nextInternal++];
+					self(self, children[c], parts[c]);
+				}
+
+				m_Nodes[children[c]].Parent = index;
+			}
+
+			m_Nodes[index].Left = children[0];
+			m_Nodes[index].Right = children[1];
+			Update(index);
+		};
+
+		rebuild(rebuild, root, fullSet);
+	}
+
+	// Writes the subtree into its slots, a subtree's node count says where its right sibling goes, so large right
+	// subtrees are flattened as tasks. Leaves take their primitives in tree order
+	void Flatten(std::vector<LinearBVHNode>& nodes, std::vector<uint32_t>& indices, uint32_t index, uint32_t slot, uint32_t primitiveOffset)
+	{
+		const Node& node = m_Nodes[index];
+		LinearBVHNode& linear = nodes[slot];
+		linear.Bbox = AABB(node.Bounds.Min, node.Bounds.Max);
+		linear.Axis = 0;
+		linear.Padding = 0;
+
+		if (IsLeaf(index) || node.Collapsed)
+		{
+			linear.Offset = primitiveOffset;
+			linear.PrimitiveCount = static_cast<uint16_t>(node.PrimitiveCount);
+			GatherPrimitives(indices, index, primitiveOffset);
+			return;
+		}
+
+		// Traversal orders children by the split axis, which is the axis their centroids are furthest apart on
+		uint32_t left = node.Left;
+		uint32_t right = node.Right;
+		glm::vec3 separation = m_Nodes[right].Bounds.Centroid() - m_Nodes[left].Bounds.Centroid();
+		glm::vec3 distance = glm::abs(separation);
+		int axis = distance.x >= distance.y && distance.x >= distance.z ? 0 : (distance.y >= distance.z ? 1 : 2);
+
+		if (separation[axis] < 0.0f)
+			std::swap(left, right);
+
+		uint32_t rightSlot = slot + 1 + m_Nodes[left].NodeCount;
+		uint32_t rightOffset = primitiveOffset + m_Nodes[left].PrimitiveCount;
+
+		linear.Offset = rightSlot;
+		linear.PrimitiveCount = 0;
+		linear.Axis = static_cast<uint8_t>(axis);
+
+		if (m_Pool && m_Nodes[right].PrimitiveCount >= ParallelThreshold)
+			m_Pool->Submit([this, &nodes, &indices, right, rightSlot, rightOffset]() { Flatten(nodes, indices, right, rightSlot, rightOffset); });
 		else
+			Flatten(nodes, indices, right, rightSlot, rightOffset);
+
+		Flatten(nodes, indices, left, slot + 1, primitiveOffset);
+	}
+
+	void GatherPrimitives(std::vector<uint32_t>& indices, uint32_t index, uint32_t& offset) const
+	{
+		if (IsLeaf(index))
 		{
-			std::sort(objects.begin() + start, objects.begin() + end, comparator);
+			indices[offset++] = m_Sorted[index - m_LeafStart];
+			return;
+		}
+
+		GatherPrimitives(indices, m_Nodes[index].Left, offset);
+		GatherPrimitives(indices, m_Nodes[index].Right, offset);
+	}
+
+	uint32_t MaxLeafSize() const { return static_cast<uint32_t>(std::clamp(m_Options.MaxLeafSize, 1, 0xFFFF)); }
+};
+
+// Binned SAH (or median) build over plain bounding boxes, for primitives that are not Hittables of their own (mesh
+// triangles). Partitions one array of references in place and writes the nodes into an arena sized for the worst case,
+// where a subtree over n primitives owns the 2n - 1 slots from its root on. Disjoint subtrees never share a slot, so
+// subtrees above a threshold are built as tasks. A final depth first copy squeezes out the slots multi-primitive leaves
+// left unused, giving the flattened order with the left child directly after its parent. Reorders indices so every
+// leaf references a contiguous range of it
+class BVHBuilder
+{
+public:
+	BVHBuilder(const std::vector<AABB>& bounds, const BVHBuildOptions& options = BVHBuildOptions())
+		: m_Bounds(bounds), m_Options(options) {}
+
+	std::vector<LinearBVHNode> Build(std::vector<uint32_t>& indices)
+	{
+		if (indices.empty())
+			return {};
+
+		if (m_Options.SplitMethod == BVHSplitMethod::LBVH)
+			return LBVHBuilder(m_Bounds, m_Options).Build(indices);
+
+		size_t count = indices.size();
+		std::unique_ptr<ThreadPool> pool;
+
+		if (count >= 2 * ParallelThreshold && m_Options.ThreadCount != 1)
+			pool = std::make_unique<ThreadPool>(m_Options.ThreadCount);
+
+		m_Pool = pool.get();
+
+		// Bounds and centroids are partitioned together with the indices, so every pass over a range reads memory
+		// in order instead of gathering through the indices
+		m_References.resize(count);
+
+		ParallelFor(m_Pool, count, [&](uint32_t, size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; i++)
+				{
+					Reference& reference = m_References[i];
+					reference.Bounds = BVHBuildBox(m_Bounds[indices[i]]);
+					reference.Centroid = reference.Bounds.Centroid();
+					reference.Index = indices[i];
+				}
+			});
+
+		m_Arena.resize(2 * count - 1);
+		m_NodeCount = 0;
+		Build(0, 0, count);
+
+		if (m_Pool)
+			m_Pool->Wait();
+
+		for (size_t i = 0; i < count; i++)
+			indices[i] = m_References[i].Index;
+
+		std::vector<LinearBVHNode> nodes;
+		nodes.reserve(m_NodeCount);
+		Compact(nodes, 0);
+
+		m_References = {};
+		m_Arena = {};
+
+		return nodes;
+	}
+
+private:
+	static constexpr size_t ParallelThreshold = 4096;
+
+	struct Reference
+	{
+		BVHBuildBox Bounds;
+		glm::vec3 Centroid;
+		uint32_t Index;
+	};
 
-			size_t mid = start + objectSpan / 2;
-			m_Left = std::make_shared<BVHNode>(objects, start, mid);
-			m_Right = std::make_shared<BVHNode>(objects, mid, end);
+	struct Bin
+	{
+		BVHBuildBox Bounds;
+		uint32_t Count = 0;
+	};
+
+	const std::vector<AABB>& m_Bounds;
+	BVHBuildOptions m_Options;
+	ThreadPool* m_Pool = nullptr;
+	std::vector<Reference> m_References;
+	std::vector<LinearBVHNode> m_Arena;
+	std::atomic<uint32_t> m_NodeCount = 0;
+
+	void Build(size_t slot, size_t start, size_t end)
+	{
+		m_NodeCount.fetch_add(1, std::memory_order_relaxed);
+
+		BVHBuildBox bounds;
+		BVHBuildBox centroidBounds;
+
+		for (size_t i = start; i < end; i++)
+		{
+			const Reference& reference = m_References[i];
+			bounds.Grow(reference.Bounds);
+			centroidBounds.Grow(reference.Centroid);
+		}
+
+		LinearBVHNode& node = m_Arena[slot];
+		node.Bbox = AABB(bounds.Min, bounds.Max);
+		node.Axis = 0;
+		node.Padding = 0;
+
+		size_t count = end - start;
+		size_t maxLeafSize = static_cast<size_t>(std::clamp(m_Options.MaxLeafSize, 1, 0xFFFF));
+		size_t mid = start + count / 2;
+
+		if (m_Options.SplitMethod == BVHSplitMethod::Median)
+		{
+			if (count <= maxLeafSize)
+			{
+				MakeLeaf(node, start, count);
+				return;
+			}
+
+			glm::vec3 extent = centroidBounds.Max - centroidBounds.Min;
+			int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+			std::nth_element(m_References.begin() + start, m_References.begin() + mid, m_References.begin() + end,
+				[axis](const Reference& a, const Reference& b) { return a.Centroid[axis] < b.Centroid[axis]; });
+
+			node.Axis = static_cast<uint8_t>(axis);
+			BuildChildren(node, slot, start, mid, end);
+			return;
+		}
+
+		int binCount = std::clamp(m_Options.BinCount, 2, 32);
+		Bin bins[3][32];
+		float costs[31];
+
+		int bestAxis = -1;
+		int bestSplit = 0;
+		float bestCost = Infinity;
+
+		glm::vec3 binScale;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float extent = centroidBounds.Max[axis] - centroidBounds.Min[axis];
+			binScale[axis] = extent > 0.0f ? binCount / extent : 0.0f;
 		}
 
-		m_Bbox = AABB(m_Left->BoundingBox(), m_Right->BoundingBox());
+		// One pass bins the range on all three axes
+		if (count > 1)
+		{
+			for (size_t i = start; i < end; i++)
+			{
+				const Reference& reference = m_References[i];
+
+				for (int axis = 0; axis < 3; axis++)
+				{
+					Bin& bin = bins[axis][BinIndex(reference.Centroid[axis], centroidBounds.Min[axis], binScale[axis], binCount)];
+					bin.Count++;
+					bin.Bounds.Grow(reference.Bounds);
+				}
+			}
+		}
+
+		for (int axis = 0; axis < 3 && count > 1; axis++)
+		{
+			if (centroidBounds.Max[axis] <= centroidBounds.Min[axis])
+				continue;
+
+			BVHBuildBox sideBounds;
+			uint32_t sideCount = 0;
+
+			for (int b = 0; b < binCount - 1; b++)
+			{
+				sideBounds.Grow(bins[axis][b].Bounds);
+				sideCount += bins[axis][b].Count;
+				costs[b] = sideCount * sideBounds.SurfaceArea();
+			}
+
+			sideBounds = BVHBuildBox();
+			sideCount = 0;
+
+			for (int b = binCount - 1; b > 0; b--)
+			{
+				sideBounds.Grow(bins[axis][b].Bounds);
+				sideCount += bins[axis][b].Count;
+				costs[b - 1] += sideCount * sideBounds.SurfaceArea();
+			}
+
+			for (int b = 0; b < binCount - 1; b++)
+			{
+				float cost = m_Options.TraversalCost + m_Options.IntersectionCost * costs[b] / bounds.SurfaceArea();
+
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+
+		float leafCost = m_Options.IntersectionCost * count;
+
+		if (count == 1 || (count <= maxLeafSize && (bestAxis == -1 || leafCost <= bestCost)))
+		{
+			MakeLeaf(node, start, count);
+			return;
+		}
+
+		if (bestAxis != -1)
+		{
+			float extentMin = centroidBounds.Min[bestAxis];
+			float scale = binScale[bestAxis];
+			mid = std::partition(m_References.begin() + start, m_References.begin() + end, [&](const Reference& reference)
+				{
+					return BinIndex(reference.Centroid[bestAxis], extentMin, scale, binCount) <= bestSplit;
+				}) - m_References.begin();
+
+			if (mid == start || mid == end)
+				mid = start + count / 2;
+
+			node.Axis = static_cast<uint8_t>(bestAxis);
+		}
+
+		BuildChildren(node, slot, start, mid, end);
+	}
+
+	static void MakeLeaf(LinearBVHNode& node, size_t start, size_t count)
+	{
+		node.Offset = static_cast<uint32_t>(start);
+		node.PrimitiveCount = static_cast<uint16_t>(count);
+	}
+
+	// The left subtree takes the 2 (mid - start) - 1 slots after the node, the right one follows them
+	void BuildChildren(LinearBVHNode& node, size_t slot, size_t start, size_t mid, size_t end)
+	{
+		size_t rightSlot = slot + 2 * (mid - start);
+		node.Offset = static_cast<uint32_t>(rightSlot);
+		node.PrimitiveCount = 0;
+
+		if (m_Pool && end - mid >= ParallelThreshold)
+			m_Pool->Submit([this, rightSlot, mid, end]() { Build(rightSlot, mid, end); });
+		else
+			Build(rightSlot, mid, end);
+
+		Build(slot + 1, start, mid);
+	}
+
+	uint32_t Compact(std::vector<LinearBVHNode>& nodes, uint32_t slot) const
+	{
+		uint32_t index = static_cast<uint32_t>(nodes.size());
+		nodes.push_back(m_Arena[slot]);
+
+		if (m_Arena[slot].PrimitiveCount == 0)
+		{
+			Compact(nodes, slot + 1);
+			nodes[index].Offset = Compact(nodes, m_Arena[slot].Offset);
+		}
+
+		return index;
+	}
+
+	static int BinIndex(float centroid, float extentMin, float scale, int binCount)
+	{
+		int b = static_cast<int>((centroid - extentMin) * scale);
+		return std::clamp(b, 0, binCount - 1);
+	}
+};
+
+// A leaf primitive the traversal calls without a virtual call. Spheres, quads and boxes, which most scenes are built
+// from, are copied in by value and called as their own type. Anything else (meshes, whose triangles their own BVH
+// already intersects directly, instances, media) is called through Hittable
+class LeafPrimitive
+{
+public:
+	LeafPrimitive(const Hittable& primitive)
+	{
+		const std::type_info& type = typeid(primitive);
+
+		if (type == typeid(Sphere))
+			m_Primitive = static_cast<const Sphere&>(primitive);
+		else if (type == typeid(Quad))
+			m_Primitive = static_cast<const Quad&>(primitive);
+		else if (type == typeid(BoxPrimitive))
+			m_Primitive = static_cast<const BoxPrimitive&>(primitive);
+		else
+			m_Primitive = &primitive;
+	}
+
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const
+	{
+		switch (m_Primitive.index())
+		{
+			case 1: return std::get<Sphere>(m_Primitive).Sphere::Hit(ray, rayT, hit);
+			case 2: return std::get<Quad>(m_Primitive).Quad::Hit(ray, rayT, hit);
+			case 3: return std::get<BoxPrimitive>(m_Primitive).BoxPrimitive::Hit(ray, rayT, hit);
+			default: return std::get<const Hittable*>(m_Primitive)->Hit(ray, rayT, hit);
+		}
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const
+	{
+		switch (m_Primitive.index())
+		{
+			case 1: return std::get<Sphere>(m_Primitive).Sphere::Occluded(ray, rayT);
+			case 2: return std::get<Quad>(m_Primitive).Quad::Occluded(ray, rayT);
+			case 3: return std::get<BoxPrimitive>(m_Primitive).BoxPrimitive::Occluded(ray, rayT);
+			default: return std::get<const Hittable*>(m_Primitive)->Occluded(ray, rayT);
+		}
+	}
+
+private:
+	std::variant<const Hittable*, Sphere, Quad, BoxPrimitive> m_Primitive;
+};
+
+class BVHNode : public Hittable
+{
+public:
+	BVHNode(const HittableList& list, const BVHBuildOptions& options = BVHBuildOptions())
+		: BVHNode(list.objects, 0, list.objects.size(), options) {}
+
+	BVHNode(const std::vector<std::shared_ptr<Hittable>>& srcObjects, size_t start, size_t end, const BVHBuildOptions& options = BVHBuildOptions())
+		: m_Primitives(srcObjects.begin() + start, srcObjects.begin() + end), m_Options(options)
+	{
+		Build();
 	}
 
 	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
 	{
-		if (!m_Bbox.Hit(ray, rayT))
+		if (m_Nodes.empty())
 			return false;
 
-		bool hitLeft = m_Left->Hit(ray, rayT, hit);
-		bool hitRight = m_Right->Hit(ray, Interval(rayT.Min, hitLeft ? hit.T : rayT.Max), hit);
+		return m_MotionNodes.empty() ? ClosestHit(m_Nodes, ray, rayT, hit) : ClosestHit(m_MotionNodes, ray, rayT, hit);
+	}
 
-		return hitLeft || hitRight;
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		if (m_Nodes.empty())
+			return false;
+
+		return m_MotionNodes.empty() ? AnyHit(m_Nodes, ray, rayT) : AnyHit(m_MotionNodes, ray, rayT);
+	}
+
+	uint32_t HitPacket(const RayPacket& packet, float tMin, float* tMax, HitRecord* hits) const override
+	{
+		if (m_Nodes.empty() || packet.ActiveMask == 0)
+			return 0;
+
+		return m_MotionNodes.empty() ? PacketHit(m_Nodes, packet, tMin, tMax, hits) : PacketHit(m_MotionNodes, packet, tMin, tMax, hits);
 	}
 
 	AABB BoundingBox() const override { return m_Bbox; }
 
+	MotionBounds ShutterBounds() const override
+	{
+		return m_MotionNodes.empty() ? MotionBounds(m_Bbox, m_Bbox) : MotionBounds(m_MotionNodes[0].At(0.0f), m_MotionNodes[0].At(1.0f));
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		for (const std::shared_ptr<Hittable>& primitive : m_Primitives)
+			primitive->GatherLights(lights);
+	}
+
+	// Refits the tree around the moved primitives, and rebuilds it once refitting has degraded it too far
+	bool Animate(float time) override
+	{
+		bool moved = false;
+
+		for (const std::shared_ptr<Hittable>& primitive : m_Primitives)
+			moved |= primitive->Animate(time);
+
+		if (!moved)
+			return false;
+
+		Refit();
+
+		if (SAHCost(m_Nodes, m_Options) > m_Options.RebuildThreshold * m_BuildCost)
+			Build();
+
+		return true;
+	}
+
+	const std::vector<LinearBVHNode>& Nodes() const { return m_Nodes; }
+	const std::vector<LinearMotionBVHNode>& MotionNodes() const { return m_MotionNodes; }
+	const std::vector<std::shared_ptr<Hittable>>& Primitives() const { return m_Primitives; }
+	const std::vector<LeafPrimitive>& LeafPrimitives() const { return m_LeafPrimitives; }
+
+	// Recomputes every box from the current primitive bounds, keeping the topology. Children always follow their
+	// parent, so a backwards pass sees them first
+	void Refit()
+	{
+		for (size_t i = m_Nodes.size(); i-- > 0;)
+		{
+			LinearBVHNode& node = m_Nodes[i];
+
+			if (node.PrimitiveCount > 0)
+			{
+				node.Bbox = AABB();
+
+				for (uint32_t k = node.Offset; k < node.Offset + node.PrimitiveCount; k++)
+					node.Bbox = AABB(node.Bbox, m_Primitives[k]->BoundingBox());
+			}
+			else
+			{
+				node.Bbox = AABB(m_Nodes[i + 1].Bbox, m_Nodes[node.Offset].Bbox);
+			}
+		}
+
+		if (!m_Nodes.empty())
+			m_Bbox = m_Nodes[0].Bbox;
+
+		FitMotionBounds();
+	}
+
 private:
-	std::shared_ptr<Hittable> m_Left;
-	std::shared_ptr<Hittable> m_Right;
+	// Bounds on the origins and inverse directions of a packet, used to cull whole nodes with interval arithmetic
+	struct PacketBounds
+	{
+		glm::vec3 OriginMin, OriginMax;
+		glm::vec3 InverseMin, InverseMax;
+		bool Coherent;
+	};
+
+	std::vector<LinearBVHNode> m_Nodes;
+	std::vector<LinearMotionBVHNode> m_MotionNodes;	// Traversed instead of m_Nodes when primitives move far enough during the shutter
+	std::vector<std::shared_ptr<Hittable>> m_Primitives; // Ordered so every leaf references a contiguous range
+	std::vector<LeafPrimitive> m_LeafPrimitives;		// Same order, what the traversal intersects
 	AABB m_Bbox;
+	BVHBuildOptions m_Options;
+	float m_BuildCost = 0.0f;
+
+	void Build()
+	{
+		if (m_Primitives.empty())
+			return;
+
+		std::vector<AABB> bounds(m_Primitives.size());
+		std::vector<uint32_t> order(m_Primitives.size());
 
-	static bool BoxCompare(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b, int axisIndex)
+		for (size_t i = 0; i < m_Primitives.size(); i++)
+		{
+			bounds[i] = m_Primitives[i]->BoundingBox();
+			order[i] = static_cast<uint32_t>(i);
+		}
+
+		m_Nodes = BVHBuilder(bounds, m_Options).Build(order);
+
+		std::vector<std::shared_ptr<Hittable>> primitives;
+		primitives.reserve(order.size());
+
+		for (uint32_t index : order)
+			primitives.push_back(std::move(m_Primitives[index]));
+
+		m_Primitives = std::move(primitives);
+		m_LeafPrimitives.clear();
+		m_LeafPrimitives.reserve(m_Primitives.size());
+
+		for (const std::shared_ptr<Hittable>& primitive : m_Primitives)
+			m_LeafPrimitives.emplace_back(*primitive);
+		m_Bbox = m_Nodes[0].Bbox;
+		m_BuildCost = SAHCost(m_Nodes, m_Options);
+
+		FitMotionBounds();
+	}
+
+	// The tree is built over the bounds of the whole shutter, when primitives move their boxes at shutter open and
+	// close are then propagated up the same topology like Refit does
+	void FitMotionBounds()
+	{
+		std::vector<MotionBounds> bounds(m_Primitives.size());
+		bool moving = false;
+
+		for (size_t i = 0; i < m_Primitives.size(); i++)
+		{
+			bounds[i] = m_Primitives[i]->ShutterBounds();
+			moving |= bounds[i].Moving();
+		}
+
+		if (!moving)
+		{
+			m_MotionNodes.clear();
+			return;
+		}
+
+		std::vector<MotionBounds> nodeBounds(m_Nodes.size());
+		m_MotionNodes.resize(m_Nodes.size());
+
+		for (size_t i = m_Nodes.size(); i-- > 0;)
+		{
+			const LinearBVHNode& node = m_Nodes[i];
+
+			if (node.PrimitiveCount > 0)
+			{
+				for (uint32_t k = node.Offset; k < node.Offset + node.PrimitiveCount; k++)
+					nodeBounds[i] = MotionBounds(nodeBounds[i], bounds[k]);
+			}
+			else
+			{
+				nodeBounds[i] = MotionBounds(nodeBounds[i + 1], nodeBounds[node.Offset]);
+			}
+
+			const AABB& start = nodeBounds[i].Start;
+			const AABB& end = nodeBounds[i].End;
+
+			LinearMotionBVHNode& motionNode = m_MotionNodes[i];
+			motionNode.Bbox = start;
+			motionNode.MinDelta = glm::vec3(end.X.Min - start.X.Min, end.Y.Min - start.Y.Min, end.Z.Min - start.Z.Min);
+			motionNode.MaxDelta = glm::vec3(end.X.Max - start.X.Max, end.Y.Max - start.Y.Max, end.Z.Max - start.Z.Max);
+			motionNode.Offset = node.Offset;
+			motionNode.PrimitiveCount = node.PrimitiveCount;
+			motionNode.Axis = node.Axis;
+			motionNode.Padding = 0;
+		}
+
+		// Interpolated nodes are twice the size and take a multiply-add per slab, so they have to be clearly tighter to
+		// pay off. Box area is quadratic in time, Simpson's rule gives its exact mean over the shutter
+		float sweptCost = 0.0f;
+		float motionCost = 0.0f;
+
+		for (size_t i = 0; i < m_Nodes.size(); i++)
+		{
+			const LinearMotionBVHNode& node = m_MotionNodes[i];
+			float nodeCost = node.PrimitiveCount > 0 ? m_Options.IntersectionCost * node.PrimitiveCount : m_Options.TraversalCost;
+			float meanArea = (node.At(0.0f).SurfaceArea() + 4.0f * node.At(0.5f).SurfaceArea() + node.At(1.0f).SurfaceArea()) / 6.0f;
+
+			sweptCost += nodeCost * m_Nodes[i].Bbox.SurfaceArea();
+			motionCost += nodeCost * meanArea;
+		}
+
+		if (motionCost > m_Options.MotionThreshold * sweptCost)
+			m_MotionNodes.clear();
+	}
+
+	template<typename NodeType>
+	bool ClosestHit(const std::vector<NodeType>& nodes, const Ray& ray, Interval rayT, HitRecord& hit) const
 	{
-		return a->BoundingBox().Axis(axisIndex).Min < b->BoundingBox().Axis(axisIndex).Min;
+		uint32_t stack[64];
+		int stackSize = 0;
+		uint32_t current = 0;
+		bool hitAnything = false;
+
+		while (true)
+		{
+			const NodeType& node = nodes[current];
+
+			if (node.Hit(ray, rayT))
+			{
+				if (node.PrimitiveCount > 0)
+				{
+					for (uint32_t i = 0; i < node.PrimitiveCount; i++)
+					{
+						if (m_LeafPrimitives[node.Offset + i].Hit(ray, rayT, hit))
+						{
+							hitAnything = true;
+							rayT.Max = hit.T;
+						}
+					}
+				}
+				else
+				{
+					// Visit the child on the near side of the split first, it is the more likely to shorten rayT
+					if (ray.Sign(node.Axis))
+					{
+						stack[stackSize++] = current + 1;
+						current = node.Offset;
+					}
+					else
+					{
+						stack[stackSize++] = node.Offset;
+						current = current + 1;
+					}
+
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+				break;
+
+			current = stack[--stackSize];
+		}
+
+		return hitAnything;
 	}
 
-	static bool BoxXCompare(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b)
+	template<typename NodeType>
+	bool AnyHit(const std::vector<NodeType>& nodes, const Ray& ray, Interval rayT) const
 	{
-		return BoxCompare(a, b, 0);
+		uint32_t stack[64];
+		int stackSize = 0;
+		uint32_t current = 0;
+
+		while (true)
+		{
+			const NodeType& node = nodes[current];
+
+			if (node.Hit(ray, rayT))
+			{
+				if (node.PrimitiveCount > 0)
+				{
+					for (uint32_t i = 0; i < node.PrimitiveCount; i++)
+					{
+						if (m_LeafPrimitives[node.Offset + i].Occluded(ray, rayT))
+							return true;
+					}
+				}
+				else
+				{
+					stack[stackSize++] = node.Offset;
+					current = current + 1;
+
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+				break;
+
+			current = stack[--stackSize];
+		}
+
+		return false;
+	}
+
+	template<typename NodeType>
+	uint32_t PacketHit(const std::vector<NodeType>& nodes, const RayPacket& packet, float tMin, float* tMax, HitRecord* hits) const
+	{
+		PacketBounds bounds = ComputePacketBounds(packet);
+
+		// Ranged traversal: every entry remembers the first lane known to reach the node, lanes before it
+		// already missed an ancestor and are never tested again below it
+		struct StackEntry
+		{
+			uint32_t Node;
+			int FirstLane;
+		};
+
+		StackEntry stack[64];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, NextActiveLane(packet, 0) };
+		uint32_t hitMask = 0;
+
+		while (stackSize > 0)
+		{
+			StackEntry entry = stack[--stackSize];
+			const NodeType& node = nodes[entry.Node];
+			int lane = entry.FirstLane;
+
+			// For a coherent packet the first lane usually hits, the other lanes are only tested when it does not. The
+			// packet test uses the bounds over the whole shutter, the lanes can have different times
+			if (!node.Hit(packet.Rays[lane], Interval(tMin, tMax[lane])))
+			{
+				if (bounds.Coherent && PacketMisses(m_Nodes[entry.Node].Bbox, bounds, tMin, tMax, packet.ActiveMask & ~((1u << lane) - 1)))
+					continue;
+
+				lane = NextActiveLane(packet, lane + 1);
+
+				while (lane < packet.Size && !node.Hit(packet.Rays[lane], Interval(tMin, tMax[lane])))
+					lane = NextActiveLane(packet, lane + 1);
+
+				if (lane >= packet.Size)
+					continue;
+			}
+
+			if (node.PrimitiveCount > 0)
+			{
+				for (int i = lane; i < packet.Size; i = NextActiveLane(packet, i + 1))
+				{
+					if (i != lane && !node.Hit(packet.Rays[i], Interval(tMin, tMax[i])))
+						continue;
+
+					LaneRandomScope random(packet, i);
+
+					for (uint32_t p = 0; p < node.PrimitiveCount; p++)
+					{
+						if (m_LeafPrimitives[node.Offset + p].Hit(packet.Rays[i], Interval(tMin, tMax[i]), hits[i]))
+						{
+							tMax[i] = hits[i].T;
+							hitMask |= 1u << i;
+						}
+					}
+				}
+
+				continue;
+			}
+
+			// Camera rays of a packet share their direction signs, so the first lane orders the children for all of them
+			if (packet.Rays[lane].Sign(node.Axis))
+			{
+				stack[stackSize++] = { entry.Node + 1, lane };
+				stack[stackSize++] = { node.Offset, lane };
+			}
+			else
+			{
+				stack[stackSize++] = { node.Offset, lane };
+				stack[stackSize++] = { entry.Node + 1, lane };
+			}
+		}
+
+		return hitMask;
+	}
+
+	static int NextActiveLane(const RayPacket& packet, int lane)
+	{
+		while (lane < packet.Size && !(packet.ActiveMask & (1u << lane)))
+			lane++;
+
+		return lane;
+	}
+
+	static PacketBounds ComputePacketBounds(const RayPacket& packet)
+	{
+		PacketBounds bounds;
+		bounds.OriginMin = glm::vec3(Infinity);
+		bounds.OriginMax = glm::vec3(-Infinity);
+		bounds.InverseMin = glm::vec3(Infinity);
+		bounds.InverseMax = glm::vec3(-Infinity);
+		bounds.Coherent = true;
+
+		int firstLane = -1;
+
+		for (int i = 0; i < packet.Size; i++)
+		{
+			if (!(packet.ActiveMask & (1u << i)))
+				continue;
+
+			const Ray& ray = packet.Rays[i];
+
+			if (firstLane == -1)
+				firstLane = i;
+
+			for (int a = 0; a < 3; a++)
+			{
+				bounds.OriginMin[a] = fmin(bounds.OriginMin[a], ray.Origin()[a]);
+				bounds.OriginMax[a] = fmax(bounds.OriginMax[a], ray.Origin()[a]);
+				bounds.InverseMin[a] = fmin(bounds.InverseMin[a], ray.InverseDirection()[a]);
+				bounds.InverseMax[a] = fmax(bounds.InverseMax[a], ray.InverseDirection()[a]);
+
+				// Interval arithmetic only holds when every lane points the same way on every axis
+				if (ray.Sign(a) != packet.Rays[firstLane].Sign(a) || std::isinf(ray.InverseDirection()[a]))
+					bounds.Coherent = false;
+			}
+		}
+
+		return bounds;
+	}
+
+	// True when no ray of the packet can enter the box: the latest possible entry distance over all rays is beyond
+	// the earliest possible exit, or outside the packet's range of t
+	static bool PacketMisses(const AABB& box, const PacketBounds& bounds, float tMin, const float* tMax, uint32_t laneMask)
+	{
+		float entry = tMin;
+		float exit = -Infinity;
+
+		for (int i = 0; i < RayPacket::MaxSize; i++)
+		{
+			if (laneMask & (1u << i))
+				exit = std::max(exit, tMax[i]);
+		}
+
+		for (int a = 0; a < 3; a++)
+		{
+			bool negative = bounds.InverseMin[a] < 0.0f;
+			float nearSlab = negative ? box.Axis(a).Max : box.Axis(a).Min;
+			float farSlab = negative ? box.Axis(a).Min : box.Axis(a).Max;
+
+			float nearLo = IntervalProductMin(nearSlab - bounds.OriginMax[a], nearSlab - bounds.OriginMin[a], bounds.InverseMin[a], bounds.InverseMax[a]);
+			float farHi = IntervalProductMax(farSlab - bounds.OriginMax[a], farSlab - bounds.OriginMin[a], bounds.InverseMin[a], bounds.InverseMax[a]);
+
+			entry = std::max(entry, nearLo);
+			exit = std::min(exit, farHi);
+		}
+
+		return entry > exit;
 	}
 
-	static bool BoxYCompare(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b)
+	static float IntervalProductMin(float aMin, float aMax, float bMin, float bMax)
 	{
-		return BoxCompare(a, b, 1);
+		return std::min(std::min(aMin * bMin, aMin * bMax), std::min(aMax * bMin, aMax * bMax));
 	}
 
-	static bool BoxZCompare(const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b)
+	static float IntervalProductMax(float aMin, float aMax, float bMin, float bMax)
 	{
-		return BoxCompare(a, b, 2);
+		return std::max(std::max(aMin * bMin, aMin * bMax), std::max(aMax * bMin, aMax * bMax));
 	}
 };
@@ -1,14 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <typeindex>
+#include <mutex>
+#include <string>
 #include <vector>
-#include <execution>
 
 #include "stb_image_write.h"
 
 #include "Utils.h"
 #include "Hittable.h"
 #include "Material.h"
+#include "ThreadPool.h"
+#include "Tile.h"
 
 class Camera
 {
@@ -28,48 +34,74 @@ public:
 	float DefocusAngle = 0;
 	float FocusDistance = 10;
 
-	void Render(const Hittable& world)
-	{
-		Initialize();
-#define MT 1
+	uint32_t Seed = 0;
+	uint32_t ThreadCount = 0; // 0 uses every hardware thread
+	int TileSize = 16;
+	TileOrder TileOrdering = TileOrder::Hilbert;
 
-		for (int j = 0; j < ImageHeight; j++)
-		{
-			std::cout << "\rScanlines remaining: " << (ImageHeight - j) << " (" << (floor((float)j / (float)ImageHeight * 100 * 100) / 100) << "%)          " << std::flush;
-
-#if MT
-		std::for_each(std::execution::par, m_HorizontalIter.begin(), m_HorizontalIter.end(),
-			[&](uint32_t i)
-#else
-			for (int i = 0; i < ImageWidth; i++)
-#endif
-			{
-				glm::vec4 pixelColor(0.0f, 0.0f, 0.0f, 1.0f);
+	// Adaptive sampling: pixels are sampled in batches until the relative standard error of their
+	// luminance drops below AdaptiveThreshold, SamplesPerPixel is used as the upper bound
+	bool AdaptiveSampling = false;
+	int MinSamplesPerPixel = 16;
+	int AdaptiveBatchSize = 16;
+	float AdaptiveThreshold = 0.01f;
 
-				for (int sample = 0; sample < SamplesPerPixel; sample++)
-				{
-					Ray ray = GetRay(i, j);
-					pixelColor += RayColor(ray, MaxBounces, world);
-				}
+	// Camera rays of neighbouring pixels are traced through the world together in packets of 4, 8 or 16,
+	// 0 or 1 traces every camera ray on its own. Secondary bounces are always traced one ray at a time
+	int PacketSize = 0;
 
-				uint32_t packedColor = PackColor(pixelColor, SamplesPerPixel);
-				m_Data[j * ImageWidth + i] = packedColor;
-#if MT
-			});
-#else
-			}
-#endif
+	// Wavefront mode traces batches of up to WavefrontBatchSize paths one bounce at a time and shades the hits
+	// of every bounce grouped by material, adaptive sampling and packets are not used in this mode
+	bool Wavefront = false;
+	int WavefrontBatchSize = 4096;
 
-		}
+	// Paths that reached this many bounces are continued with probability equal to their largest throughput
+	// channel and reweighted by its inverse, a negative value disables Russian roulette
+	int RussianRouletteDepth = 3;
 
-		stbi_write_png("C:/dev/VisualStudio/Ray Tracing in One Weekend/Ray Tracing in One Weekend/image.png",  ImageWidth, ImageHeight, 4, m_Data, ImageWidth * 4);
+	// Next event estimation: every diffuse vertex also samples a point on an emissive Quad or Sphere, and the two
+	// strategies are combined with multiple importance sampling (power heuristic)
+	bool LightSampling = true;
 
-		std::cout << "\rDone.                           \n";
+	std::string OutputPath = "C:/dev/VisualStudio/Ray Tracing in One Weekend/Ray Tracing in One Weekend/image.png";
+
+	// More than one frame renders an animation: before every frame the world is animated to frame / FrameRate
+	// seconds, which refits its BVHs instead of rebuilding them, and the frame number is added to OutputPath
+	int FrameCount = 1;
+	float FrameRate = 24.0f;
+
+	static bool IsPacketSize(int size)
+	{
+		return size == 0 || size == 1 || size == 4 || size == 8 || size == 16;
+	}
+
+	void Render(Hittable& world)
+	{
+		if (FrameCount <= 1)
+		{
+			RenderFrame(world, OutputPath);
+			return;
+		}
+
+		for (int frame = 0; frame < FrameCount; frame++)
+		{
+			std::cout << "Frame " << frame + 1 << " / " << FrameCount << "\n";
+			world.Animate(frame / FrameRate);
+			RenderFrame(world, FramePath(frame));
+		}
 	}
 
 private:
-	uint32_t* m_Data;
-	std::vector<uint32_t> m_HorizontalIter;
+	// Number of paths and of rays they traced, camera rays included, for the average path length
+	struct PathStatistics
+	{
+		uint64_t Paths = 0;
+		uint64_t Segments = 0;
+	};
+
+	std::vector<uint32_t> m_Data;
+	std::vector<int> m_SampleCounts;
+	std::vector<const Hittable*> m_Lights;
 
 	glm::vec3 m_CameraCenter = glm::vec3(0, 0, 0);
 	glm::vec3 m_Pixel00Location = glm::vec3(0, 0, 0);
@@ -79,6 +111,73 @@ private:
 	glm::vec3 m_DefocusDiskU;
 	glm::vec3 m_DefocusDiskV;
 
+	void RenderFrame(const Hittable& world, const std::string& outputPath)
+	{
+		Initialize();
+
+		m_Lights.clear();
+
+		if (LightSampling)
+			world.GatherLights(m_Lights);
+
+		std::vector<Tile> tiles = GenerateTiles(ImageWidth, ImageHeight, TileSize, TileOrdering);
+		std::atomic<size_t> tilesDone = 0;
+		std::mutex progressMutex;
+		PathStatistics totalStats;
+
+		{
+			ThreadPool pool(ThreadCount);
+
+			for (const Tile& tile : tiles)
+			{
+				pool.Submit([&, tile]()
+				{
+					PathStatistics stats = RenderTile(tile, world);
+
+					size_t done = ++tilesDone;
+					std::lock_guard<std::mutex> lock(progressMutex);
+					totalStats.Paths += stats.Paths;
+					totalStats.Segments += stats.Segments;
+					std::cout << "\rTiles remaining: " << (tiles.size() - done) << " (" << (floor((float)done / (float)tiles.size() * 100 * 100) / 100) << "%)          " << std::flush;
+				});
+			}
+
+			pool.Wait();
+		}
+
+		stbi_write_png(outputPath.c_str(), ImageWidth, ImageHeight, 4, m_Data.data(), ImageWidth * 4);
+
+		if (AdaptiveSampling)
+			WriteSampleCountAOV(outputPath);
+
+		if (totalStats.Paths > 0)
+			std::cout << "\rAverage path length: " << (double)totalStats.Segments / totalStats.Paths << "\n";
+
+		std::cout << "\rDone.                           \n";
+	}
+
+	// "image.png" becomes "image_0007.png"
+	std::string FramePath(int frame) const
+	{
+		char number[16];
+		snprintf(number, sizeof(number), "_%04d", frame);
+
+		return InsertSuffix(OutputPath, number);
+	}
+
+	// Inserts suffix before the file name's extension. A dot in a directory name ("out.v2/image") is not one
+	static std::string InsertSuffix(std::string path, const char* suffix)
+	{
+		size_t separator = path.find_last_of("/\\");
+		size_t extension = path.find_last_of('.');
+
+		if (extension == std::string::npos || (separator != std::string::npos && extension < separator))
+			extension = path.size();
+
+		path.insert(extension, suffix);
+		return path;
+	}
+
 	void Initialize()
 	{
 		m_CameraCenter = LookFrom;
@@ -105,14 +204,324 @@ private:
 		m_DefocusDiskU = m_U * defocusRadius;
 		m_DefocusDiskV = m_V * defocusRadius;
 
-		m_HorizontalIter.resize(ImageWidth);
+		m_Data.assign(ImageWidth * ImageHeight, 0);
+		m_SampleCounts.assign(ImageWidth * ImageHeight, 0);
+	}
 
-		m_Data = new uint32_t[ImageWidth * ImageHeight];
+	struct PixelAccumulator
+	{
+		glm::vec4 Color = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		float Mean = 0.0f;
+		float M2 = 0.0f; // Welford's running sum of squared luminance deviations
+		int Count = 0;
+		bool Done = false;
+	};
+
+	struct PathState
+	{
+		Ray CurrentRay;
+		glm::vec4 Throughput;
+		glm::vec4 Radiance;
+		PCG32 RNG;
+		int Pixel;			// Index inside the tile
+		int Bounces;
+		float ScatterPdf;	// Density of the direction of CurrentRay, 0 for camera rays and specular bounces
+	};
+
+	PathStatistics RenderTile(const Tile& tile, const Hittable& world)
+	{
+		// Tiles are rendered into their own buffer so workers never write to neighbouring cache lines of m_Data
+		std::vector<PixelAccumulator> tilePixels(tile.Width * tile.Height);
+		PathStatistics stats;
 
-		for (uint32_t i = 0; i < ImageWidth; i++)
+		if (Wavefront)
+			RenderTileWavefront(tile, world, tilePixels, stats);
+		else
+			RenderTileBlocks(tile, world, tilePixels, stats);
+
+
+		std::vector<uint32_t> tileData(tile.Width * tile.Height);
+		std::vector<int> tileSampleCounts(tile.Width * tile.Height);
+
+		for (size_t i = 0; i < tilePixels.size(); i++)
 		{
-			m_HorizontalIter[i] = i;
+			tileData[i] = PackColor(tilePixels[i].Color, tilePixels[i].Count);
+			tileSampleCounts[i] = tilePixels[i].Count;
 		}
+
+		for (int y = 0; y < tile.Height; y++)
+		{
+			std::copy_n(tileData.begin() + y * tile.Width, tile.Width, m_Data.begin() + (tile.Y + y) * ImageWidth + tile.X);
+			std::copy_n(tileSampleCounts.begin() + y * tile.Width, tile.Width, m_SampleCounts.begin() + (tile.Y + y) * ImageWidth + tile.X);
+		}
+
+		return stats;
+	}
+
+	void RenderTileBlocks(const Tile& tile, const Hittable& world, std::vector<PixelAccumulator>& tilePixels, PathStatistics& stats)
+	{
+		int blockWidth = PacketSize >= 16 ? 4 : PacketSize >= 4 ? 2 : 1;
+		int blockHeight = PacketSize >= 8 ? 4 : PacketSize >= 4 ? 2 : 1;
+		PixelAccumulator pixels[RayPacket::MaxSize];
+
+		for (int by = 0; by < tile.Height; by += blockHeight)
+		{
+			for (int bx = 0; bx < tile.Width; bx += blockWidth)
+			{
+				int width = std::min(blockWidth, tile.Width - bx);
+				int height = std::min(blockHeight, tile.Height - by);
+
+				std::fill(pixels, pixels + RayPacket::MaxSize, PixelAccumulator());
+				RenderBlock(tile.X + bx, tile.Y + by, width, height, world, pixels, stats);
+
+				for (int y = 0; y < height; y++)
+				{
+					for (int x = 0; x < width; x++)
+						tilePixels[(by + y) * tile.Width + bx + x] = pixels[y * width + x];
+				}
+			}
+		}
+	}
+
+	// Traces the tile's paths breadth first: every bounce runs the extension rays of all live paths, sorts the hits by
+	// material type so each Scatter / Texture::Value implementation runs over a whole bin at once, then drops dead paths.
+	// Every path keeps its own random sequence, so the image matches TracePath
+	void RenderTileWavefront(const Tile& tile, const Hittable& world, std::vector<PixelAccumulator>& tilePixels, PathStatistics& stats)
+	{
+		size_t pathCount = static_cast<size_t>(tile.Width) * tile.Height * SamplesPerPixel;
+		size_t batchSize = static_cast<size_t>(std::max(1, WavefrontBatchSize));
+
+		std::vector<PathState> paths;
+		std::vector<HitRecord> hits;
+		std::vector<uint32_t> active;
+		std::vector<uint32_t> shadeOrder;
+		std::vector<std::type_index> materialTypes;
+
+		paths.reserve(std::min(pathCount, batchSize));
+
+		for (size_t first = 0; first < pathCount; first += batchSize)
+		{
+			size_t last = std::min(pathCount, first + batchSize);
+
+			// Generate camera rays, pixel by pixel with all of a pixel's samples next to each other
+			paths.clear();
+			active.clear();
+
+			for (size_t p = first; p < last; p++)
+			{
+				int pixel = static_cast<int>(p / SamplesPerPixel);
+				int sample = static_cast<int>(p % SamplesPerPixel);
+				int i = tile.X + pixel % tile.Width;
+				int j = tile.Y + pixel / tile.Width;
+
+				SeedRandom(Seed, j * ImageWidth + i, sample);
+
+				PathState path;
+				path.CurrentRay = GetRay(i, j);
+				path.Throughput = glm::vec4(1.0f);
+				path.Radiance = glm::vec4(0.0f);
+				path.RNG = t_RNG;
+				path.Pixel = pixel;
+				path.Bounces = 0;
+				path.ScatterPdf = 0.0f;
+
+				if (MaxBounces > 0)
+					active.push_back(static_cast<uint32_t>(paths.size()));
+
+				paths.push_back(path);
+			}
+
+			stats.Paths += paths.size();
+
+			hits.resize(paths.size());
+			materialTypes.assign(paths.size(), std::type_index(typeid(void)));
+
+			while (!active.empty())
+			{
+				// Extension: closest hit of every live path, misses terminate here
+				shadeOrder.clear();
+				stats.Segments += active.size();
+
+				for (uint32_t index : active)
+				{
+					PathState& path = paths[index];
+
+					t_RNG = path.RNG;
+					bool hitAnything = world.Hit(path.CurrentRay, Interval(0.001f, Infinity), hits[index]);
+					path.RNG = t_RNG;
+
+					if (!hitAnything)
+					{
+						path.Radiance += path.Throughput * BackgroundColor;
+						continue;
+					}
+
+					materialTypes[index] = std::type_index(typeid(MaterialTable::Get(hits[index].MaterialID)));
+					shadeOrder.push_back(index);
+				}
+
+				// Sort by material type, then by material instance so hits sharing a texture are shaded together
+				std::sort(shadeOrder.begin(), shadeOrder.end(), [&](uint32_t a, uint32_t b)
+				{
+					if (materialTypes[a] != materialTypes[b])
+						return materialTypes[a] < materialTypes[b];
+
+					return hits[a].MaterialID < hits[b].MaterialID;
+				});
+
+				// Shade, then compact the surviving paths back into generation order
+				active.clear();
+
+				for (uint32_t index : shadeOrder)
+				{
+					PathState& path = paths[index];
+
+					t_RNG = path.RNG;
+
+					if (ShadeVertex(path, hits[index], world))
+						active.push_back(index);
+
+					path.RNG = t_RNG;
+				}
+
+				std::sort(active.begin(), active.end());
+			}
+
+			for (PathState& path : paths)
+			{
+				path.Radiance.a = 1.0f;
+				tilePixels[path.Pixel].Color += path.Radiance;
+				tilePixels[path.Pixel].Count++;
+			}
+		}
+	}
+
+	// Samples a width x height block of pixels starting at (x0, y0), as packets when it holds more than one pixel
+	void RenderBlock(int x0, int y0, int width, int height, const Hittable& world, PixelAccumulator* pixels, PathStatistics& stats)
+	{
+		int count = width * height;
+
+		for (int sample = 0; sample < SamplesPerPixel; sample++)
+		{
+			if (count == 1)
+			{
+				if (pixels[0].Done)
+					break;
+
+				SeedRandom(Seed, y0 * ImageWidth + x0, sample);
+
+				Ray ray = GetRay(x0, y0);
+				AddSample(pixels[0], TracePath(ray, world, stats));
+
+				continue;
+			}
+
+			RayPacket packet;
+			packet.Size = count;
+
+			// Every lane draws from its own random sequence while the packet is traced and continues it afterwards,
+			// so lanes stay independent and sample the same distribution as pixels traced one by one. The images only
+			// differ where media are crossed in a different order, which changes which numbers they draw
+			PCG32 laneRNG[RayPacket::MaxSize];
+			packet.LaneRNG = laneRNG;
+
+			for (int lane = 0; lane < count; lane++)
+			{
+				if (pixels[lane].Done)
+					continue;
+
+				int i = x0 + lane % width;
+				int j = y0 + lane / width;
+
+				SeedRandom(Seed, j * ImageWidth + i, sample);
+				packet.Rays[lane] = GetRay(i, j);
+				packet.ActiveMask |= 1u << lane;
+				laneRNG[lane] = t_RNG;
+			}
+
+			if (packet.ActiveMask == 0)
+				break;
+
+			HitRecord hits[RayPacket::MaxSize];
+			float tMax[RayPacket::MaxSize];
+			std::fill(tMax, tMax + RayPacket::MaxSize, Infinity);
+
+			uint32_t hitMask = MaxBounces > 0 ? world.HitPacket(packet, 0.001f, tMax, hits) : 0;
+
+			for (int lane = 0; lane < count; lane++)
+			{
+				if (!(packet.ActiveMask & (1u << lane)))
+					continue;
+
+				t_RNG = laneRNG[lane];
+
+				glm::vec4 sampleColor;
+
+				if (MaxBounces > 0 && !(hitMask & (1u << lane)))
+				{
+					stats.Paths++;
+					stats.Segments++;
+					sampleColor = BackgroundColor;
+				}
+				else
+				{
+					sampleColor = TracePath(packet.Rays[lane], world, stats, &hits[lane]);
+				}
+
+				AddSample(pixels[lane], sampleColor);
+			}
+		}
+	}
+
+	void AddSample(PixelAccumulator& pixel, const glm::vec4& sampleColor) const
+	{
+		pixel.Color += sampleColor;
+		pixel.Count++;
+
+		if (pixel.Count >= SamplesPerPixel)
+		{
+			pixel.Done = true;
+			return;
+		}
+
+		if (!AdaptiveSampling)
+			return;
+
+		float luminance = Luminance(sampleColor);
+		float delta = luminance - pixel.Mean;
+		pixel.Mean += delta / pixel.Count;
+		pixel.M2 += delta * (luminance - pixel.Mean);
+
+		// Convergence is only checked at the end of every batch
+		int n = pixel.Count;
+
+		if (n % std::max(1, AdaptiveBatchSize) == 0 && n >= MinSamplesPerPixel && n > 1)
+		{
+			float standardError = sqrt(pixel.M2 / (n - 1) / n);
+
+			if (standardError <= AdaptiveThreshold * fmax(pixel.Mean, 1e-3f))
+				pixel.Done = true;
+		}
+	}
+
+	void WriteSampleCountAOV(const std::string& outputPath) const
+	{
+		std::vector<uint32_t> aov(ImageWidth * ImageHeight);
+		long long totalSamples = 0;
+
+		for (size_t i = 0; i < aov.size(); i++)
+		{
+			totalSamples += m_SampleCounts[i];
+
+			uint8_t value = static_cast<uint8_t>(255.0f * m_SampleCounts[i] / SamplesPerPixel);
+			aov[i] = 0xFF000000 | (value << 16) | (value << 8) | value;
+		}
+
+		std::string path = InsertSuffix(outputPath, "_samples");
+
+		stbi_write_png(path.c_str(), ImageWidth, ImageHeight, 4, aov.data(), ImageWidth * 4);
+
+		std::cout << "\rAverage samples per pixel: " << (double)totalSamples / aov.size() << "\n";
 	}
 
 	Ray GetRay(int i, int j)
@@ -140,26 +549,155 @@ private:
 		return (px * m_PixelDeltaU) + (py * m_PixelDeltaV);
 	}
 
-	glm::vec4 RayColor(const Ray& ray, int depth, const Hittable& world) const
+	// Iterative path tracer carrying the path throughput. firstHit is the closest hit of the camera ray when that has
+	// already been traced as part of a packet
+	glm::vec4 TracePath(const Ray& cameraRay, const Hittable& world, PathStatistics& stats, const HitRecord* firstHit = nullptr) const
 	{
-		if (depth <= 0)
+		stats.Paths++;
+
+		if (MaxBounces <= 0)
 			return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
 
+		PathState path;
+		path.CurrentRay = cameraRay;
+		path.Throughput = glm::vec4(1.0f);
+		path.Radiance = glm::vec4(0.0f);
+		path.Bounces = 0;
+		path.ScatterPdf = 0.0f;
+
 		HitRecord hit;
 
-		if (!world.Hit(ray, Interval(0.001f, Infinity), hit))
-			return BackgroundColor;
+		while (true)
+		{
+			stats.Segments++;
+
+			bool hitAnything = true;
+
+			if (path.Bounces == 0 && firstHit)
+				hit = *firstHit;
+			else
+				hitAnything = world.Hit(path.CurrentRay, Interval(0.001f, Infinity), hit);
+
+			if (!hitAnything)
+			{
+				path.Radiance += path.Throughput * BackgroundColor;
+				break;
+			}
+
+			if (!ShadeVertex(path, hit, world))
+				break;
+		}
+
+		path.Radiance.a = 1.0f;
+		return path.Radiance;
+	}
+
+	// Adds the emission and the sampled direct light at hit to the path, then scatters it.
+	// Returns false when the path ends here
+	bool ShadeVertex(PathState& path, const HitRecord& hit, const Hittable& world) const
+	{
+		return MaterialTable::Visit(hit.MaterialID, [&](const auto& material) { return ShadeVertex(path, hit, world, material); });
+	}
+
+	// Shading instantiated for each built-in material type, which calls into the material directly
+	template<typename MaterialType>
+	bool ShadeVertex(PathState& path, const HitRecord& hit, const Hittable& world, const MaterialType& material) const
+	{
+		glm::vec4 emitted = material.Emitted(hit.U, hit.V, hit.Point);
+
+		// An emitter found by a diffuse bounce could also have been found by light sampling at the previous vertex
+		if (path.ScatterPdf > 0.0f && material.IsEmissive())
+		{
+			float lightPdf = LightsPdf(path.CurrentRay, hit);
+			emitted *= PowerHeuristic(path.ScatterPdf, lightPdf);
+		}
+
+		path.Radiance += path.Throughput * emitted;
+
+		// Light sampled here is found by BSDF sampling only if the path gets to make another bounce
+		if (!m_Lights.empty() && !material.IsSpecular() && path.Bounces + 1 < MaxBounces)
+			path.Radiance += path.Throughput * SampleDirectLight(path.CurrentRay, hit, world, material);
 
 		Ray scattered;
 		glm::vec4 attenuation;
-		glm::vec4 colorFromEmission = hit.Material->Emitted(hit.U, hit.V, hit.Point);
 
-		if (!hit.Material->Scatter(ray, hit, attenuation, scattered))
-			return colorFromEmission;
+		if (!material.Scatter(path.CurrentRay, hit, attenuation, scattered))
+			return false;
+
+		path.ScatterPdf = material.IsSpecular() ? 0.0f : material.ScatteringPdf(path.CurrentRay, hit, scattered.Direction());
+		path.Throughput *= attenuation;
+		path.CurrentRay = scattered;
+		path.Bounces++;
+
+		return path.Bounces < MaxBounces && SurvivesRoulette(path.Bounces, path.Throughput);
+	}
+
+	// Light arriving at hit from a point sampled on one of the lights, weighted for MIS with BSDF sampling
+	template<typename MaterialType>
+	glm::vec4 SampleDirectLight(const Ray& inRay, const HitRecord& hit, const Hittable& world, const MaterialType& material) const
+	{
+		size_t index = std::min(static_cast<size_t>(RandomFloat() * m_Lights.size()), m_Lights.size() - 1);
+		LightSample sample;
+
+		if (!m_Lights[index]->SampleLight(hit.Point, inRay.Time(), sample))
+			return glm::vec4(0.0f);
+
+		glm::vec4 bsdf = material.Evaluate(inRay, hit, sample.Direction);
+
+		if (bsdf.r <= 0.0f && bsdf.g <= 0.0f && bsdf.b <= 0.0f)
+			return glm::vec4(0.0f);
+
+		// The shadow ray is normalized so its offsets are distances, not fractions of the way to the light
+		float length = glm::length(sample.Direction);
 
-		glm::vec4 colorFromScatter = attenuation * RayColor(scattered, depth - 1, world);
+		if (world.Occluded(Ray(hit.Point, sample.Direction / length, inRay.Time()), Interval(0.001f, sample.Distance * length * 0.999f)))
+			return glm::vec4(0.0f);
 
-		return colorFromEmission + colorFromScatter;
+		float lightPdf = sample.Pdf / m_Lights.size();
+		float scatterPdf = material.ScatteringPdf(inRay, hit, sample.Direction);
+
+		return bsdf * sample.Emitted * (PowerHeuristic(lightPdf, scatterPdf) / lightPdf);
+	}
+
+	// Density of light sampling picking the point ray hit, the lights are chosen uniformly. Only the light that point
+	// is on counts: a sample on any light behind it is shadowed, just as SampleDirectLight only weighs the light it
+	// picked. That light is the one whose own first hit along ray is the same primitive at the same distance
+	float LightsPdf(const Ray& ray, const HitRecord& hit) const
+	{
+		for (const Hittable* light : m_Lights)
+		{
+			HitRecord lightHit;
+
+			if (light->Hit(ray, Interval(0.001f, hit.T * 1.0001f), lightHit) && lightHit.PrimitiveID == hit.PrimitiveID && lightHit.T >= hit.T * 0.9999f)
+				return light->LightPdf(ray.Origin(), ray.Direction(), ray.Time()) / m_Lights.size();
+		}
+
+		return 0.0f;
+	}
+
+	static float PowerHeuristic(float pdf, float otherPdf)
+	{
+		return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+	}
+
+	// Russian roulette with unbiased reweighting of the surviving paths
+	bool SurvivesRoulette(int bounces, glm::vec4& throughput) const
+	{
+		if (RussianRouletteDepth < 0 || bounces < RussianRouletteDepth)
+			return true;
+
+		float survival = std::min(1.0f, std::max({ throughput.r, throughput.g, throughput.b }));
+
+		if (survival <= 0.0f || RandomFloat() >= survival)
+			return false;
+
+		throughput /= survival;
+		return true;
+	}
+
+	static float Luminance(const glm::vec4& color)
+	{
+		return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
 	}
 
 	uint32_t PackColor(const glm::vec4& pixelColor, int samplesPerPixel)
@@ -8,41 +8,38 @@
 class ConstantMedium : public Hittable
 {
 public:
-	ConstantMedium(std::shared_ptr<Hittable> b, float d, std::shared_ptr<Texture> a) : m_Boundary(b), m_NegativeInverseDensity(-1 / d), m_PhaseFunction(std::make_shared<Isotropic>(a)) {}
-	ConstantMedium(std::shared_ptr<Hittable> b, float d, glm::vec4 c) : m_Boundary(b), m_NegativeInverseDensity(-1 / d), m_PhaseFunction(std::make_shared<Isotropic>(c)) {}
+	ConstantMedium(std::shared_ptr<Hittable> b, float d, std::shared_ptr<Texture> a) : m_Boundary(b), m_NegativeInverseDensity(-1 / d), m_PhaseFunctionID(MaterialTable::Add(std::make_shared<Isotropic>(a))), m_PrimitiveID(NewPrimitiveID()), m_ConvexBoundary(b->IsConvex()) {}
+	ConstantMedium(std::shared_ptr<Hittable> b, float d, glm::vec4 c) : m_Boundary(b), m_NegativeInverseDensity(-1 / d), m_PhaseFunctionID(MaterialTable::Add(std::make_shared<Isotropic>(c))), m_PrimitiveID(NewPrimitiveID()), m_ConvexBoundary(b->IsConvex()) {}
 
 	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
 	{
 		const bool enableDebug = false;
 		const bool debugging = enableDebug && RandomFloat() < 0.00001f;
 
-		HitRecord hit1, hit2;
+		Interval span;
 
-		if (!m_Boundary->Hit(ray, Interval::Universe, hit1))
-			return false;
-
-		if (!m_Boundary->Hit(ray, Interval(hit1.T + 0.0001f, Infinity), hit2))
+		if (!BoundarySpan(ray, span))
 			return false;
 
-		if (debugging) std::cout << "\nRayTMin=" << hit.T << ", RayTMax=" << hit2.T << "\n";
+		if (debugging) std::cout << "\nRayTMin=" << span.Min << ", RayTMax=" << span.Max << "\n";
 
-		if (hit1.T < rayT.Min) hit1.T = rayT.Min;
-		if (hit2.T > rayT.Max) hit2.T = rayT.Max;
+		if (span.Min < rayT.Min) span.Min = rayT.Min;
+		if (span.Max > rayT.Max) span.Max = rayT.Max;
 
-		if (hit1.T >= hit2.T)
+		if (span.Min >= span.Max)
 			return false;
 
-		if (hit1.T < 0)
-			hit1.T = 0;
+		if (span.Min < 0)
+			span.Min = 0;
 
 		float rayLength = glm::length(ray.Direction());
-		float distanceInsideBoundary = (hit2.T - hit1.T) * rayLength;
+		float distanceInsideBoundary = (span.Max - span.Min) * rayLength;
 		float hitDistance = m_NegativeInverseDensity * log(RandomFloat());
 
 		if (hitDistance > distanceInsideBoundary)
 			return false;
 
-		hit.T = hit1.T + hitDistance / rayLength;
+		hit.T = span.Min + hitDistance / rayLength;
 		hit.Point = ray.At(hit.T);
 
 		if (debugging)
@@ -54,15 +51,169 @@ public:
 
 		hit.Normal = glm::vec3(1.0f, 0.0f, 0.0f);
 		hit.FrontFace = true;
-		hit.Material = m_PhaseFunction;
+		hit.MaterialID = m_PhaseFunctionID;
+		hit.PrimitiveID = m_PrimitiveID;
 
 		return true;
 	}
 
+	// Same free-flight sampling as Hit, without filling in the scattering event
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		Interval span;
+
+		if (!BoundarySpan(ray, span))
+			return false;
+
+		float t1 = fmax(fmax(span.Min, rayT.Min), 0.0f);
+		float t2 = fmin(span.Max, rayT.Max);
+
+		if (t1 >= t2)
+			return false;
+
+		float distanceInsideBoundary = (t2 - t1) * glm::length(ray.Direction());
+
+		return m_NegativeInverseDensity * log(RandomFloat()) <= distanceInsideBoundary;
+	}
+
 	AABB BoundingBox() const override { return m_Boundary->BoundingBox(); }
 
+	MotionBounds ShutterBounds() const override { return m_Boundary->ShutterBounds(); }
+
+	bool Animate(float time) override { return m_Boundary->Animate(time); }
+
 private:
 	std::shared_ptr<Hittable> m_Boundary;
 	float m_NegativeInverseDensity;
-	std::shared_ptr<Material> m_PhaseFunction;
+	uint32_t m_PhaseFunctionID;
+	uint32_t m_PrimitiveID;
+	bool m_ConvexBoundary;
+
+	// Where the ray's line is inside the boundary. A convex boundary answers in one query, anything else is entered at
+	// its first hit along the whole line and left at the next one
+	bool BoundarySpan(const Ray& ray, Interval& span) const
+	{
+		if (m_ConvexBoundary)
+			return m_Boundary->ConvexSpan(ray, span);
+
+		HitRecord hit1, hit2;
+
+		if (!m_Boundary->Hit(ray, Interval::Universe, hit1))
+			return false;
+
+		if (!m_Boundary->Hit(ray, Interval(hit1.T + 0.0001f, Infinity), hit2))
+			return false;
+
+		span = Interval(hit1.T, hit2.T);
+
+		return true;
+	}
+};
+
+// Homogeneous medium around a whole scene, like fog the camera sits in. It wraps the scene instead of being one of its
+// objects, so no boundary is intersected: every ray samples a single free-flight distance and scatters there when the
+// scene has nothing closer. The fog fills a sphere, with an infinite radius it fills all of space and nothing is ever
+// seen or lit by the background
+class GlobalMedium : public Hittable
+{
+public:
+	GlobalMedium(std::shared_ptr<Hittable> scene, float density, const glm::vec4& albedo, const glm::vec3& center = glm::vec3(0.0f), float radius = Infinity)
+		: m_Scene(scene), m_NegativeInverseDensity(-1 / density), m_PhaseFunctionID(MaterialTable::Add(std::make_shared<Isotropic>(albedo))), m_PrimitiveID(NewPrimitiveID()),
+		m_Center(center), m_Radius(radius) {}
+
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		bool hitScene = m_Scene->Hit(ray, rayT, hit);
+		float t;
+
+		if (!FreeFlight(ray, hitScene ? Interval(rayT.Min, hit.T) : rayT, t))
+			return hitScene;
+
+		SetHit(ray, t, hit);
+
+		return true;
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		float t;
+		return FreeFlight(ray, rayT, t) || m_Scene->Occluded(ray, rayT);
+	}
+
+	uint32_t HitPacket(const RayPacket& packet, float tMin, float* tMax, HitRecord* hits) const override
+	{
+		uint32_t hitMask = m_Scene->HitPacket(packet, tMin, tMax, hits);
+
+		for (int i = 0; i < packet.Size; i++)
+		{
+			if (!(packet.ActiveMask & (1u << i)))
+				continue;
+
+			LaneRandomScope random(packet, i);
+			float t;
+
+			if (FreeFlight(packet.Rays[i], Interval(tMin, tMax[i]), t))
+			{
+				SetHit(packet.Rays[i], t, hits[i]);
+				tMax[i] = t;
+				hitMask |= 1u << i;
+			}
+		}
+
+		return hitMask;
+	}
+
+	AABB BoundingBox() const override { return m_Scene->BoundingBox(); }
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override { m_Scene->GatherLights(lights); }
+
+	bool Animate(float time) override { return m_Scene->Animate(time); }
+
+private:
+	std::shared_ptr<Hittable> m_Scene;
+	float m_NegativeInverseDensity;
+	uint32_t m_PhaseFunctionID;
+	uint32_t m_PrimitiveID;
+	glm::vec3 m_Center;
+	float m_Radius;
+
+	// Distance at which the ray scatters, if that is inside rayT and the fog. Like ConstantMedium the fog starts no
+	// earlier than the ray's origin
+	bool FreeFlight(const Ray& ray, Interval rayT, float& t) const
+	{
+		if (m_Radius < Infinity)
+		{
+			glm::vec3 oc = ray.Origin() - m_Center;
+			float a = glm::length2(ray.Direction());
+			float halfB = glm::dot(oc, ray.Direction());
+			float c = glm::length2(oc) - m_Radius * m_Radius;
+			float discriminant = halfB * halfB - a * c;
+
+			if (discriminant < 0)
+				return false;
+
+			float sqrtDiscriminant = sqrt(discriminant);
+			rayT.Min = fmax(rayT.Min, (-halfB - sqrtDiscriminant) / a);
+			rayT.Max = fmin(rayT.Max, (-halfB + sqrtDiscriminant) / a);
+		}
+
+		float start = fmax(rayT.Min, 0.0f);
+
+		if (start >= rayT.Max)
+			return false;
+
+		t = start + m_NegativeInverseDensity * log(RandomFloat()) / glm::length(ray.Direction());
+
+		return t < rayT.Max;
+	}
+
+	void SetHit(const Ray& ray, float t, HitRecord& hit) const
+	{
+		hit.T = t;
+		hit.Point = ray.At(t);
+		hit.Normal = glm::vec3(1.0f, 0.0f, 0.0f);
+		hit.FrontFace = true;
+		hit.MaterialID = m_PhaseFunctionID;
+		hit.PrimitiveID = m_PrimitiveID;
+	}
 };
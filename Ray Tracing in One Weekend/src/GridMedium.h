@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "Utils.h"
+#include "Hittable.h"
+#include "Material.h"
+#include "Texture.h"
+#include "Perlin.h"
+
+// Densities on a regular lattice of points spanning a box, interpolated trilinearly in between. Every block of
+// MajorantBlock lattice cells also stores its majorant, the largest density it can reach, which is all a medium
+// needs to cross empty and thin regions in large steps
+class DensityGrid
+{
+public:
+	static const int MajorantBlock = 8;
+
+	// resolution lattice points along the longest side of bounds, the other sides get about the same spacing
+	template<typename Function>
+	DensityGrid(const AABB& bounds, int resolution, const Function& density)
+	{
+		m_Min = glm::vec3(bounds.X.Min, bounds.Y.Min, bounds.Z.Min);
+		m_Max = glm::vec3(bounds.X.Max, bounds.Y.Max, bounds.Z.Max);
+
+		glm::vec3 extent = m_Max - m_Min;
+		float spacing = std::max({ extent.x, extent.y, extent.z }) / std::max(resolution - 1, 1);
+
+		for (int a = 0; a < 3; a++)
+		{
+			m_Count[a] = std::max(2, static_cast<int>(ceil(extent[a] / spacing)) + 1);
+			m_CellSize[a] = extent[a] / (m_Count[a] - 1);
+			m_InverseCellSize[a] = m_CellSize[a] > 0.0f ? 1.0f / m_CellSize[a] : 0.0f;
+			m_MajorantCount[a] = (m_Count[a] - 2) / MajorantBlock + 1;
+		}
+
+		m_Values.resize(static_cast<size_t>(m_Count[0]) * m_Count[1] * m_Count[2]);
+
+		for (int z = 0; z < m_Count[2]; z++)
+		{
+			for (int y = 0; y < m_Count[1]; y++)
+			{
+				for (int x = 0; x < m_Count[0]; x++)
+				{
+					glm::vec3 point = m_Min + glm::vec3(x, y, z) * m_CellSize;
+					m_Values[Index(x, y, z)] = std::max(0.0f, static_cast<float>(density(point)));
+				}
+			}
+		}
+
+		BuildMajorants();
+	}
+
+	// Perlin turbulence with features about 1 / noiseScale across, from empty up to maxDensity
+	static std::shared_ptr<DensityGrid> FromNoise(const AABB& bounds, int resolution, float noiseScale, float maxDensity)
+	{
+		Perlin noise;
+
+		return std::make_shared<DensityGrid>(bounds, resolution, [&](const glm::vec3& point)
+			{
+				return maxDensity * glm::clamp(2.0f * noise.Turbulence(noiseScale * point) - 0.25f, 0.0f, 1.0f);
+			});
+	}
+
+	const glm::vec3& Min() const { return m_Min; }
+	const glm::vec3& Max() const { return m_Max; }
+
+	AABB BoundingBox() const { return AABB(m_Min, m_Max).Pad(); }
+
+	float Density(const glm::vec3& point) const
+	{
+		glm::vec3 lattice = (point - m_Min) * m_InverseCellSize;
+		int cell[3];
+		float f[3];
+
+		for (int a = 0; a < 3; a++)
+		{
+			cell[a] = std::clamp(static_cast<int>(floor(lattice[a])), 0, m_Count[a] - 2);
+			f[a] = glm::clamp(lattice[a] - cell[a], 0.0f, 1.0f);
+		}
+
+		float density = 0.0f;
+
+		for (int k = 0; k < 2; k++)
+		{
+			for (int j = 0; j < 2; j++)
+			{
+				for (int i = 0; i < 2; i++)
+				{
+					float weight = (i ? f[0] : 1.0f - f[0]) * (j ? f[1] : 1.0f - f[1]) * (k ? f[2] : 1.0f - f[2]);
+					density += weight * m_Values[Index(cell[0] + i, cell[1] + j, cell[2] + k)];
+				}
+			}
+		}
+
+		return density;
+	}
+
+	const int* MajorantCount() const { return m_MajorantCount; }
+
+	// Size of a majorant block, the last one along an axis may reach past Max
+	glm::vec3 MajorantCellSize() const { return m_CellSize * static_cast<float>(MajorantBlock); }
+
+	float Majorant(int x, int y, int z) const
+	{
+		return m_Majorants[(static_cast<size_t>(z) * m_MajorantCount[1] + y) * m_MajorantCount[0] + x];
+	}
+
+private:
+	glm::vec3 m_Min, m_Max;
+	glm::vec3 m_CellSize;
+	glm::vec3 m_InverseCellSize;
+	int m_Count[3];
+	int m_MajorantCount[3];
+	std::vector<float> m_Values;
+	std::vector<float> m_Majorants;
+
+	size_t Index(int x, int y, int z) const
+	{
+		return (static_cast<size_t>(z) * m_Count[1] + y) * m_Count[0] + x;
+	}
+
+	// Trilinear interpolation never exceeds its corners, so a block's majorant is the largest of its lattice points
+	void BuildMajorants()
+	{
+		m_Majorants.assign(static_cast<size_t>(m_MajorantCount[0]) * m_MajorantCount[1] * m_MajorantCount[2], 0.0f);
+
+		for (int z = 0; z < m_Count[2]; z++)
+		{
+			for (int y = 0; y < m_Count[1]; y++)
+			{
+				for (int x = 0; x < m_Count[0]; x++)
+				{
+					float value = m_Values[Index(x, y, z)];
+
+					// Points on a block boundary belong to the blocks on both sides
+					for (int bz = std::max(0, (z - 1) / MajorantBlock); bz <= std::min(z / MajorantBlock, m_MajorantCount[2] - 1); bz++)
+					{
+						for (int by = std::max(0, (y - 1) / MajorantBlock); by <= std::min(y / MajorantBlock, m_MajorantCount[1] - 1); by++)
+						{
+							for (int bx = std::max(0, (x - 1) / MajorantBlock); bx <= std::min(x / MajorantBlock, m_MajorantCount[0] - 1); bx++)
+							{
+								float& majorant = m_Majorants[(static_cast<size_t>(bz) * m_MajorantCount[1] + by) * m_MajorantCount[0] + bx];
+								majorant = std::max(majorant, value);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+};
+
+// Medium whose density varies over a DensityGrid, bounded by the grid's box. Collisions are sampled by delta
+// tracking against the majorant of each block the ray crosses, which stays unbiased for any density below the
+// majorant and never marches fixed steps: blocks without density are skipped outright
+class GridMedium : public Hittable
+{
+public:
+	GridMedium(std::shared_ptr<DensityGrid> grid, std::shared_ptr<Texture> albedo) : m_Grid(grid), m_PhaseFunctionID(MaterialTable::Add(std::make_shared<Isotropic>(albedo))), m_PrimitiveID(NewPrimitiveID()) {}
+	GridMedium(std::shared_ptr<DensityGrid> grid, glm::vec4 albedo) : m_Grid(grid), m_PhaseFunctionID(MaterialTable::Add(std::make_shared<Isotropic>(albedo))), m_PrimitiveID(NewPrimitiveID()) {}
+
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		float t;
+
+		if (!SampleCollision(ray, rayT, t))
+			return false;
+
+		hit.T = t;
+		hit.Point = ray.At(t);
+		hit.Normal = glm::vec3(1.0f, 0.0f, 0.0f);
+		hit.FrontFace = true;
+		hit.MaterialID = m_PhaseFunctionID;
+		hit.PrimitiveID = m_PrimitiveID;
+
+		return true;
+	}
+
+	// A collision anywhere in rayT absorbs or scatters the shadow ray, so this is delta tracking too
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		float t;
+		return SampleCollision(ray, rayT, t);
+	}
+
+	AABB BoundingBox() const override { return m_Grid->BoundingBox(); }
+
+private:
+	std::shared_ptr<DensityGrid> m_Grid;
+	uint32_t m_PhaseFunctionID;
+	uint32_t m_PrimitiveID;
+
+	// Walks the majorant blocks along the ray with a 3D DDA. Within a block tentative collisions are exponentially
+	// distributed with the block's majorant and accepted with probability density / majorant. Free flight is
+	// memoryless, so every block starts afresh at its entry. Like ConstantMedium the medium starts no earlier than the
+	// ray's origin
+	bool SampleCollision(const Ray& ray, Interval rayT, float& t) const
+	{
+		const DensityGrid& grid = *m_Grid;
+		const glm::vec3& origin = ray.Origin();
+		const glm::vec3& invD = ray.InverseDirection();
+
+		for (int a = 0; a < 3; a++)
+		{
+			float t0 = ((ray.Sign(a) ? grid.Max()[a] : grid.Min()[a]) - origin[a]) * invD[a];
+			float t1 = ((ray.Sign(a) ? grid.Min()[a] : grid.Max()[a]) - origin[a]) * invD[a];
+
+			rayT.Min = t0 > rayT.Min ? t0 : rayT.Min;
+			rayT.Max = t1 < rayT.Max ? t1 : rayT.Max;
+		}
+
+		rayT.Min = std::max(rayT.Min, 0.0f);
+
+		if (!(rayT.Min < rayT.Max))
+			return false;
+
+		const int* count = grid.MajorantCount();
+		glm::vec3 blockSize = grid.MajorantCellSize();
+		glm::vec3 entry = ray.At(rayT.Min);
+		int block[3], step[3];
+		float tNext[3], tDelta[3];
+
+		for (int a = 0; a < 3; a++)
+		{
+			block[a] = std::clamp(static_cast<int>(floor((entry[a] - grid.Min()[a]) / blockSize[a])), 0, count[a] - 1);
+
+			if (std::isinf(invD[a]))
+			{
+				step[a] = 0;
+				tNext[a] = Infinity;
+				tDelta[a] = Infinity;
+				continue;
+			}
+
+			step[a] = ray.Sign(a) ? -1 : 1;
+			tNext[a] = (grid.Min()[a] + (block[a] + (ray.Sign(a) ? 0 : 1)) * blockSize[a] - origin[a]) * invD[a];
+			tDelta[a] = blockSize[a] * fabs(invD[a]);
+		}
+
+		float inverseRayLength = 1.0f / glm::length(ray.Direction());
+		float current = rayT.Min;
+
+		while (true)
+		{
+			int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+			float exit = std::min(tNext[axis], rayT.Max);
+			float majorant = grid.Majorant(block[0], block[1], block[2]);
+
+			if (majorant > 0.0f)
+			{
+				float inverseMajorant = 1.0f / majorant;
+
+				while (true)
+				{
+					current -= log(RandomFloat()) * inverseMajorant * inverseRayLength;
+
+					if (current >= exit)
+						break;
+
+					if (RandomFloat() * majorant < grid.Density(ray.At(current)))
+					{
+						t = current;
+						return true;
+					}
+				}
+			}
+
+			if (tNext[axis] >= rayT.Max)
+				return false;
+
+			block[axis] += step[axis];
+
+			if (block[axis] < 0 || block[axis] >= count[axis])
+				return false;
+
+			current = tNext[axis];
+			tNext[axis] += tDelta[axis];
+		}
+	}
+};
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <atomic>
+#include <vector>
+
 #include "Utils.h"
 #include "Ray.h"
 #include "AABB.h"
@@ -10,7 +13,8 @@ struct HitRecord
 {
 	glm::vec3 Point;
 	glm::vec3 Normal;
-	std::shared_ptr<Material> Material;
+	uint32_t MaterialID;	// Index into MaterialTable
+	uint32_t PrimitiveID;
 	float T;
 	float U;
 	float V;
@@ -23,6 +27,55 @@ struct HitRecord
 	}
 };
 
+// Unique ID for every primitive that can end up in a HitRecord, meshes reserve a consecutive range for their triangles
+inline uint32_t NewPrimitiveID(uint32_t count = 1)
+{
+	static std::atomic<uint32_t> nextID = 0;
+	return nextID.fetch_add(count);
+}
+
+struct LightSample
+{
+	glm::vec3 Direction;	// From the shading point, the sampled point is at t = Distance
+	float Distance;
+	glm::vec4 Emitted;
+	float Pdf;				// With respect to solid angle
+};
+
+// Bounds at shutter open and close of an object moving linearly in between, so the box interpolated to a ray's
+// time bounds the object at that time instead of over the whole shutter
+struct MotionBounds
+{
+	AABB Start;
+	AABB End;
+
+	MotionBounds() {}
+	MotionBounds(const AABB& start, const AABB& end) : Start(start), End(end) {}
+	MotionBounds(const MotionBounds& a, const MotionBounds& b) : Start(a.Start, b.Start), End(a.End, b.End) {}
+
+	bool Moving() const
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			if (Start.Axis(a).Min != End.Axis(a).Min || Start.Axis(a).Max != End.Axis(a).Max)
+				return true;
+		}
+
+		return false;
+	}
+
+	AABB At(float time) const
+	{
+		return AABB(Lerp(Start.X, End.X, time), Lerp(Start.Y, End.Y, time), Lerp(Start.Z, End.Z, time));
+	}
+
+private:
+	static Interval Lerp(const Interval& a, const Interval& b, float time)
+	{
+		return Interval(a.Min + time * (b.Min - a.Min), a.Max + time * (b.Max - a.Max));
+	}
+};
+
 class Hittable
 {
 public:
@@ -30,8 +83,79 @@ public:
 
 	virtual bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const = 0;
 	virtual AABB BoundingBox() const = 0;
+
+	// Bounds at ray times 0 and 1, BoundingBox is their union. Only objects that move during the shutter override it
+	virtual MotionBounds ShutterBounds() const { return MotionBounds(BoundingBox(), BoundingBox()); }
+
+	// Any-hit query for shadow rays: true as soon as anything is found inside rayT, no hit record is built
+	virtual bool Occluded(const Ray& ray, Interval rayT) const
+	{
+		HitRecord hit;
+		return Hit(ray, rayT, hit);
+	}
+
+	// Convex primitives report where the whole line through ray enters and leaves them in a single query, which is
+	// all a medium bounded by them needs. ConvexSpan is only called when IsConvex is true
+	virtual bool IsConvex() const { return false; }
+	virtual bool ConvexSpan(const Ray& ray, Interval& span) const { return false; }
+
+	// Closest hit for every active lane of the packet. tMax holds each lane's current closest distance and is
+	// shortened by hits, the returned mask has a bit set for every lane whose hit record was written
+	virtual uint32_t HitPacket(const RayPacket& packet, float tMin, float* tMax, HitRecord* hits) const
+	{
+		uint32_t hitMask = 0;
+
+		for (int i = 0; i < packet.Size; i++)
+		{
+			if (!(packet.ActiveMask & (1u << i)))
+				continue;
+
+			LaneRandomScope random(packet, i);
+
+			if (Hit(packet.Rays[i], Interval(tMin, tMax[i]), hits[i]))
+			{
+				tMax[i] = hits[i].T;
+				hitMask |= 1u << i;
+			}
+		}
+
+		return hitMask;
+	}
+
+	// Emissive primitives add themselves, aggregates forward to their children
+	virtual void GatherLights(std::vector<const Hittable*>& lights) const {}
+
+	// Samples a direction from origin towards this primitive, implemented by the primitives that can be lights
+	virtual bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const { return false; }
+
+	// Solid angle density of SampleLight returning direction
+	virtual float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const { return 0.0f; }
+
+	// Moves keyframed objects to an animation time in seconds, which is unrelated to the shutter time of rays.
+	// Returns true when the bounding box may have changed, aggregates forward it and refit their own bounds
+	virtual bool Animate(float time) { return false; }
 };
 
+// Light density of a group of lights sampled uniformly, from the first of them along ray: samples on the ones
+// behind it are shadowed. ray is in the lights' space, wrappers that do not transform rigidly scale the density
+inline float VisibleLightPdf(const std::vector<const Hittable*>& lights, const Ray& ray)
+{
+	const Hittable* visible = nullptr;
+	Interval rayT(0.001f, Infinity);
+	HitRecord hit;
+
+	for (const Hittable* light : lights)
+	{
+		if (light->Hit(ray, rayT, hit))
+		{
+			visible = light;
+			rayT.Max = hit.T;
+		}
+	}
+
+	return visible ? visible->LightPdf(ray.Origin(), ray.Direction(), ray.Time()) / lights.size() : 0.0f;
+}
+
 class Translate : public Hittable
 {
 public:
@@ -39,11 +163,12 @@ public:
 		: m_Object(p), m_Offset(displacement)
 	{
 		m_Bbox = m_Object->BoundingBox() + m_Offset;
+		m_Object->GatherLights(m_Lights);
 	}
 
 	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
 	{
-		Ray offsetR(ray.Origin() - m_Offset, ray.Direction(), ray.Time());
+		Ray offsetR = ray.WithOrigin(ray.Origin() - m_Offset);
 
 		if (!m_Object->Hit(offsetR, rayT, hit))
 			return false;
@@ -53,12 +178,66 @@ public:
 		return true;
 	}
 
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		return m_Object->Occluded(ray.WithOrigin(ray.Origin() - m_Offset), rayT);
+	}
+
+	bool IsConvex() const override { return m_Object->IsConvex(); }
+
+	bool ConvexSpan(const Ray& ray, Interval& span) const override
+	{
+		return m_Object->ConvexSpan(ray.WithOrigin(ray.Origin() - m_Offset), span);
+	}
+
 	AABB BoundingBox() const override { return m_Bbox; }
 
+	MotionBounds ShutterBounds() const override
+	{
+		MotionBounds bounds = m_Object->ShutterBounds();
+		return MotionBounds(bounds.Start + m_Offset, bounds.End + m_Offset);
+	}
+
+	bool Animate(float time) override
+	{
+		if (!m_Object->Animate(time))
+			return false;
+
+		m_Bbox = m_Object->BoundingBox() + m_Offset;
+
+		return true;
+	}
+
+	// The object's lights are sampled as one light, like Instance does
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		if (!m_Lights.empty())
+			lights.push_back(this);
+	}
+
+	bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const override
+	{
+		const Hittable* light = m_Lights[std::min(static_cast<size_t>(RandomFloat() * m_Lights.size()), m_Lights.size() - 1)];
+
+		if (!light->SampleLight(origin - m_Offset, time, sample))
+			return false;
+
+		if (m_Lights.size() > 1)
+			sample.Pdf = LightPdf(origin, sample.Direction, time);
+
+		return sample.Pdf > 0.0f;
+	}
+
+	float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const override
+	{
+		return VisibleLightPdf(m_Lights, Ray(origin - m_Offset, direction, time));
+	}
+
 private:
 	std::shared_ptr<Hittable> m_Object;
 	glm::vec3 m_Offset;
 	AABB m_Bbox;
+	std::vector<const Hittable*> m_Lights;
 };
 
 class RotateY : public Hittable
@@ -70,8 +249,106 @@ public:
 		float radians = glm::radians(angle);
 		m_SinTheta = sin(radians);
 		m_CosTheta = cos(radians);
-		m_Bbox = m_Object->BoundingBox();
+		m_Bbox = Rotated(m_Object->BoundingBox());
+		m_Object->GatherLights(m_Lights);
+	}
+
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		if (!m_Object->Hit(ToObjectSpace(ray), rayT, hit))
+			return false;
 
+		glm::vec3 point = hit.Point;
+		point.x = m_CosTheta * hit.Point.x + m_SinTheta * hit.Point.z;
+		point.z = -m_SinTheta * hit.Point.x + m_CosTheta * hit.Point.z;
+
+		glm::vec3 normal = hit.Normal;
+		normal.x = m_CosTheta * hit.Normal.x + m_SinTheta * hit.Normal.z;
+		normal.z = -m_SinTheta * hit.Normal.x + m_CosTheta * hit.Normal.z;
+
+		hit.Point = point;
+		hit.Normal = normal;
+
+		return true;
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		return m_Object->Occluded(ToObjectSpace(ray), rayT);
+	}
+
+	bool IsConvex() const override { return m_Object->IsConvex(); }
+
+	bool ConvexSpan(const Ray& ray, Interval& span) const override
+	{
+		return m_Object->ConvexSpan(ToObjectSpace(ray), span);
+	}
+
+	AABB BoundingBox() const override { return m_Bbox; }
+
+	// The rotated box's bounds are linear in the original's, so the interpolated bounds stay exact like Instance's
+	MotionBounds ShutterBounds() const override
+	{
+		MotionBounds bounds = m_Object->ShutterBounds();
+		return MotionBounds(Rotated(bounds.Start), Rotated(bounds.End));
+	}
+
+	bool Animate(float time) override
+	{
+		if (!m_Object->Animate(time))
+			return false;
+
+		m_Bbox = Rotated(m_Object->BoundingBox());
+
+		return true;
+	}
+
+	// The object's lights are sampled as one light, like Instance does
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		if (!m_Lights.empty())
+			lights.push_back(this);
+	}
+
+	bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const override
+	{
+		const Hittable* light = m_Lights[std::min(static_cast<size_t>(RandomFloat() * m_Lights.size()), m_Lights.size() - 1)];
+
+		if (!light->SampleLight(ToObject(origin), time, sample))
+			return false;
+
+		sample.Direction = ToWorld(sample.Direction);
+
+		if (m_Lights.size() > 1)
+			sample.Pdf = LightPdf(origin, sample.Direction, time);
+
+		return sample.Pdf > 0.0f;
+	}
+
+	float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const override
+	{
+		return VisibleLightPdf(m_Lights, Ray(ToObject(origin), ToObject(direction), time));
+	}
+
+private:
+	std::shared_ptr<Hittable> m_Object;
+	float m_SinTheta;
+	float m_CosTheta;
+	AABB m_Bbox;
+	std::vector<const Hittable*> m_Lights;
+
+	glm::vec3 ToObject(const glm::vec3& v) const
+	{
+		return glm::vec3(m_CosTheta * v.x - m_SinTheta * v.z, v.y, m_SinTheta * v.x + m_CosTheta * v.z);
+	}
+
+	glm::vec3 ToWorld(const glm::vec3& v) const
+	{
+		return glm::vec3(m_CosTheta * v.x + m_SinTheta * v.z, v.y, -m_SinTheta * v.x + m_CosTheta * v.z);
+	}
+
+	AABB Rotated(const AABB& box) const
+	{
 		glm::vec3 min(Infinity, Infinity, Infinity);
 		glm::vec3 max(-Infinity, -Infinity, -Infinity);
 
@@ -81,9 +358,9 @@ public:
 			{
 				for (int k = 0; k < 2; k++)
 				{
-					float x = i * m_Bbox.X.Max + (1 - i) * m_Bbox.X.Min;
-					float y = j * m_Bbox.Y.Max + (1 - j) * m_Bbox.Y.Min;
-					float z = k * m_Bbox.Z.Max + (1 - k) * m_Bbox.Z.Min;
+					float x = i * box.X.Max + (1 - i) * box.X.Min;
+					float y = j * box.Y.Max + (1 - j) * box.Y.Min;
+					float z = k * box.Z.Max + (1 - k) * box.Z.Min;
 
 					float newX = m_CosTheta * x + m_SinTheta * z;
 					float newZ = -m_SinTheta * x + m_CosTheta * z;
@@ -99,44 +376,11 @@ public:
 			}
 		}
 
-		m_Bbox = AABB(min, max);
+		return AABB(min, max);
 	}
 
-	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	Ray ToObjectSpace(const Ray& ray) const
 	{
-		glm::vec3 origin = ray.Origin();
-		glm::vec3 direction = ray.Direction();
-
-		origin.x = m_CosTheta * ray.Origin().x - m_SinTheta * ray.Origin().z;
-		origin.z = m_SinTheta * ray.Origin().x + m_CosTheta * ray.Origin().z;
-
-		direction.x = m_CosTheta * ray.Direction().x - m_SinTheta * ray.Direction().z;
-		direction.z = m_SinTheta * ray.Direction().x + m_CosTheta * ray.Direction().z;
-
-		Ray rotatedRay(origin, direction, ray.Time());
-
-		if (!m_Object->Hit(rotatedRay, rayT, hit))
-			return false;
-
-		glm::vec3 point = hit.Point;
-		point.x = m_CosTheta * hit.Point.x + m_SinTheta * hit.Point.z;
-		point.z = -m_SinTheta * hit.Point.x + m_CosTheta * hit.Point.z;
-
-		glm::vec3 normal = hit.Normal;
-		normal.x = m_CosTheta * hit.Normal.x + m_SinTheta * hit.Normal.z;
-		normal.z = -m_SinTheta * hit.Normal.x + m_CosTheta * hit.Normal.z;
-
-		hit.Point = point;
-		hit.Normal = normal;
-
-		return true;
+		return Ray(ToObject(ray.Origin()), ToObject(ray.Direction()), ray.Time());
 	}
-
-	AABB BoundingBox() const override { return m_Bbox; }
-
-private:
-	std::shared_ptr<Hittable> m_Object;
-	float m_SinTheta;
-	float m_CosTheta;
-	AABB m_Bbox;
 };
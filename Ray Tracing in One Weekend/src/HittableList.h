@@ -21,27 +21,80 @@ public:
 		m_Bbox = AABB(m_Bbox, object->BoundingBox());
 	}
 
+	// Objects only write the record when they report a hit, and every later hit is closer, so it is filled in place
 	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
 	{
-		HitRecord tempHit;
 		bool hitAnything = false;
-		float closestSoFar = rayT.Max;
 
 		for (const std::shared_ptr<Hittable>& object : objects)
 		{
-			if (object->Hit(ray, Interval(rayT.Min, closestSoFar), tempHit))
+			if (object->Hit(ray, rayT, hit))
 			{
 				hitAnything = true;
-				closestSoFar = tempHit.T;
-				hit = tempHit;
+				rayT.Max = hit.T;
 			}
 		}
 
 		return hitAnything;
 	}
 
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		for (const std::shared_ptr<Hittable>& object : objects)
+		{
+			if (object->Occluded(ray, rayT))
+				return true;
+		}
+
+		return false;
+	}
+
+	uint32_t HitPacket(const RayPacket& packet, float tMin, float* tMax, HitRecord* hits) const override
+	{
+		uint32_t hitMask = 0;
+
+		for (const std::shared_ptr<Hittable>& object : objects)
+			hitMask |= object->HitPacket(packet, tMin, tMax, hits);
+
+		return hitMask;
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		for (const std::shared_ptr<Hittable>& object : objects)
+			object->GatherLights(lights);
+	}
+
+	bool Animate(float time) override
+	{
+		bool moved = false;
+
+		for (const std::shared_ptr<Hittable>& object : objects)
+			moved |= object->Animate(time);
+
+		if (!moved)
+			return false;
+
+		m_Bbox = AABB();
+
+		for (const std::shared_ptr<Hittable>& object : objects)
+			m_Bbox = AABB(m_Bbox, object->BoundingBox());
+
+		return true;
+	}
+
 	AABB BoundingBox() const override { return m_Bbox; }
 
+	MotionBounds ShutterBounds() const override
+	{
+		MotionBounds bounds;
+
+		for (const std::shared_ptr<Hittable>& object : objects)
+			bounds = MotionBounds(bounds, object->ShutterBounds());
+
+		return bounds;
+	}
+
 private:
 	AABB m_Bbox;
 };
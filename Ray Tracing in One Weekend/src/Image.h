@@ -3,6 +3,7 @@
 #include <stb_image.h>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 
 class Image
 {
@@ -12,14 +13,20 @@ public:
 	Image(const char* filePath)
 	{
 		int n; // Not used
-		m_Data = stbi_load(filePath, &m_ImageWidth, &m_ImageHeight, &n, m_BytesPerPixel);
+		uint8_t* data = stbi_load(filePath, &m_ImageWidth, &m_ImageHeight, &n, m_BytesPerPixel);
+		m_Data = data;
+		m_Storage = std::shared_ptr<const void>(data, [](const void* pixels) { stbi_image_free(const_cast<void*>(pixels)); });
 		m_BytesPerScanline = m_ImageWidth * m_BytesPerPixel;
 	}
 
-	~Image() { stbi_image_free(m_Data); }
+	// RGBA pixels decoded before, storage keeps the memory they are in alive
+	Image(const uint8_t* data, int width, int height, std::shared_ptr<const void> storage)
+		: m_Data(data), m_Storage(std::move(storage)), m_ImageWidth(width), m_ImageHeight(height), m_BytesPerScanline(width * m_BytesPerPixel) {}
 
 	int Width() const { return m_Data == nullptr ? 0 : m_ImageWidth; }
 	int Height() const { return m_Data == nullptr ? 0 : m_ImageHeight; }
+	int BytesPerPixel() const { return m_BytesPerPixel; }
+	const uint8_t* Data() const { return m_Data; }
 
 	const uint8_t* PixelData(int x, int y) const
 	{
@@ -35,10 +42,11 @@ public:
 
 private:
 	const int m_BytesPerPixel = 4;
-	uint8_t* m_Data;
-	int m_ImageWidth;
-	int m_ImageHeight;
-	int m_BytesPerScanline;
+	const uint8_t* m_Data;
+	std::shared_ptr<const void> m_Storage;
+	int m_ImageWidth = 0;
+	int m_ImageHeight = 0;
+	int m_BytesPerScanline = 0;
 
 	static int Clamp(int x, int low, int high)
 	{
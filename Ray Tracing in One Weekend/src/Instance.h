@@ -0,0 +1,135 @@
+#pragma once
+
+#include <vector>
+
+#include "Utils.h"
+#include "Hittable.h"
+#include "Transform.h"
+#include "Animation.h"
+
+// Places shared geometry (the bottom level, usually a BVH built once) in the world with an affine transform.
+// A top-level BVH over instances makes memory scale with the unique geometry instead of the instance count.
+// With keyframes the instance moves between frames: its transform is the track's transform at the animation time
+// applied after objectToWorld
+class Instance : public Hittable
+{
+public:
+	Instance(std::shared_ptr<Hittable> object, const Transform& objectToWorld, const KeyframeTrack& animation = KeyframeTrack())
+		: m_Object(object), m_Placement(objectToWorld), m_Animation(animation)
+	{
+		SetTransform(m_Animation.At(0.0f) * m_Placement);
+		m_Object->GatherLights(m_Lights);
+	}
+
+	// The object space ray keeps the unnormalized direction, so its hit distances are the world space ones
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		if (!m_Object->Hit(ToObjectSpace(ray), rayT, hit))
+			return false;
+
+		hit.Point = ray.At(hit.T);
+		hit.Normal = glm::normalize(m_NormalMatrix * hit.Normal);
+
+		return true;
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		return m_Object->Occluded(ToObjectSpace(ray), rayT);
+	}
+
+	// Affine maps keep shapes convex and, like Hit, distances along the ray
+	bool IsConvex() const override { return m_Object->IsConvex(); }
+
+	bool ConvexSpan(const Ray& ray, Interval& span) const override
+	{
+		return m_Object->ConvexSpan(ToObjectSpace(ray), span);
+	}
+
+	AABB BoundingBox() const override { return m_Bbox; }
+
+	// Box corners map linearly under a fixed transform, so the object's interpolated bounds stay exact in world space
+	MotionBounds ShutterBounds() const override { return m_MotionBounds; }
+
+	bool Animate(float time) override
+	{
+		bool moved = m_Object->Animate(time);
+
+		if (m_Animation.Empty() && !moved)
+			return false;
+
+		SetTransform(m_Animation.At(time) * m_Placement);
+
+		return true;
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		if (!m_Lights.empty())
+			lights.push_back(this);
+	}
+
+	// Samples one of the object's lights in object space, the pdf is the same mixture as LightPdf
+	bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const override
+	{
+		size_t count = m_Lights.size();
+		const Hittable* light = m_Lights[std::min(static_cast<size_t>(RandomFloat() * count), count - 1)];
+		glm::vec3 objectOrigin = m_WorldToObject.Point(origin);
+
+		if (!light->SampleLight(objectOrigin, time, sample))
+			return false;
+
+		glm::vec3 objectDirection = sample.Direction;
+		sample.Direction = m_ObjectToWorld * objectDirection;
+
+		if (count == 1)
+			sample.Pdf *= DirectionJacobian(sample.Direction);
+		else
+			sample.Pdf = LightPdf(origin, sample.Direction, time);
+
+		return sample.Pdf > 0.0f;
+	}
+
+	float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const override
+	{
+		return VisibleLightPdf(m_Lights, ToObjectSpace(Ray(origin, direction, time))) * DirectionJacobian(direction);
+	}
+
+private:
+	std::shared_ptr<Hittable> m_Object;
+	Transform m_Placement;
+	KeyframeTrack m_Animation;
+	Transform m_WorldToObject;
+	glm::mat3 m_ObjectToWorld;
+	glm::mat3 m_NormalMatrix;
+	float m_InverseDeterminant;
+	AABB m_Bbox;
+	MotionBounds m_MotionBounds;
+	std::vector<const Hittable*> m_Lights;
+
+	void SetTransform(const Transform& objectToWorld)
+	{
+		m_WorldToObject = objectToWorld.Inverse();
+		m_ObjectToWorld = objectToWorld.Linear;
+		m_NormalMatrix = glm::transpose(m_WorldToObject.Linear);
+		m_Bbox = objectToWorld.Bounds(m_Object->BoundingBox());
+
+		MotionBounds bounds = m_Object->ShutterBounds();
+		m_MotionBounds = bounds.Moving() ? MotionBounds(objectToWorld.Bounds(bounds.Start), objectToWorld.Bounds(bounds.End)) : MotionBounds(m_Bbox, m_Bbox);
+
+		// Solid angle scales with the determinant, see DirectionJacobian
+		m_InverseDeterminant = fabs(glm::determinant(m_WorldToObject.Linear));
+	}
+
+	Ray ToObjectSpace(const Ray& ray) const
+	{
+		return Ray(m_WorldToObject.Point(ray.Origin()), m_WorldToObject.Vector(ray.Direction()), ray.Time());
+	}
+
+	// Object space solid angle per world space solid angle around direction, 1 for rigid and uniformly scaled transforms
+	float DirectionJacobian(const glm::vec3& direction) const
+	{
+		float length = glm::length(m_WorldToObject.Vector(glm::normalize(direction)));
+		return m_InverseDeterminant / (length * length * length);
+	}
+};
@@ -6,10 +6,15 @@
 #include "Quad.h"
 #include "Material.h"
 #include "BVH.h"
+#include "Accelerator.h"
+#include "Instance.h"
 #include "Texture.h"
 #include "ConstantMedium.h"
+#include "GridMedium.h"
+#include "MeshLoader.h"
+#include "SceneLoader.h"
 
-void RandomSpheres(Camera camera)
+void RandomSpheres(Camera camera, const AcceleratorOptions& accelerator)
 {
 	std::shared_ptr<Lambertian> groundMaterial = std::make_shared<Lambertian>(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
 
@@ -60,7 +65,7 @@ void RandomSpheres(Camera camera)
 	std::shared_ptr<Material> metal = std::make_shared<Metal>(glm::vec4(0.7f, 0.6f, 0.5f, 1.0f), 0);
 	world.Add(std::make_shared<Sphere>(glm::vec3(4.0f, 1.0f, 0.0f), 1.0f, metal));
 
-	world = HittableList(std::make_shared<BVHNode>(world));
+	world = HittableList(BuildAccelerator(world, accelerator));
 
 	camera.VerticalFOV = 20.0f;
 	camera.LookFrom = glm::vec3(13.0f, 2.0f, 3.0f);
@@ -111,7 +116,8 @@ void Earth(Camera camera)
 
 	camera.BackgroundColor = glm::vec4(0.7f, 0.8f, 1.0f, 1.0f);
 
-	camera.Render(HittableList(globe));
+	HittableList world(globe);
+	camera.Render(world);
 }
 
 void TwoPerlinSpheres(Camera camera)
@@ -202,13 +208,11 @@ void CornellBox(Camera camera)
 	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 555.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), white));
 
 	std::shared_ptr<Hittable> box1 = Box(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(165.0f, 330.0f, 165.0f), white);
-	box1 = std::make_shared<RotateY>(box1, 15.0f);
-	box1 = std::make_shared<Translate>(box1, glm::vec3(265.0f, 0.0f, 295.0f));
+	box1 = std::make_shared<Instance>(box1, Transform::Translate(glm::vec3(265.0f, 0.0f, 295.0f)) * Transform::RotateY(15.0f));
 	world.Add(box1);
 
 	std::shared_ptr<Hittable> box2 = Box(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(165.0f, 165.0f, 165.0f), white);
-	box2 = std::make_shared<RotateY>(box2, -18.0f);
-	box2 = std::make_shared<Translate>(box2, glm::vec3(130.0f, 0.0f, 65.0f));
+	box2 = std::make_shared<Instance>(box2, Transform::Translate(glm::vec3(130.0f, 0.0f, 65.0f)) * Transform::RotateY(-18.0f));
 	world.Add(box2);
 
 	camera.VerticalFOV = 40.0f;
@@ -240,12 +244,10 @@ void CornellSmoke(Camera camera)
 	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 555.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), white));
 
 	std::shared_ptr<Hittable> box1 = Box(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(165.0f, 330.0f, 165.0f), white);
-	box1 = std::make_shared<RotateY>(box1, 15.0f);
-	box1 = std::make_shared<Translate>(box1, glm::vec3(265.0f, 0.0f, 295.0f));
+	box1 = std::make_shared<Instance>(box1, Transform::Translate(glm::vec3(265.0f, 0.0f, 295.0f)) * Transform::RotateY(15.0f));
 
 	std::shared_ptr<Hittable> box2 = Box(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(165.0f, 165.0f, 165.0f), white);
-	box2 = std::make_shared<RotateY>(box2, -18.0f);
-	box2 = std::make_shared<Translate>(box2, glm::vec3(130.0f, 0.0f, 65.0f));
+	box2 = std::make_shared<Instance>(box2, Transform::Translate(glm::vec3(130.0f, 0.0f, 65.0f)) * Transform::RotateY(-18.0f));
 
 	world.Add(std::make_shared<ConstantMedium>(box1, 0.01f, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)));
 	world.Add(std::make_shared<ConstantMedium>(box2, 0.01f, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)));
@@ -262,7 +264,42 @@ void CornellSmoke(Camera camera)
 	camera.Render(world);
 }
 
-void FinalScene(Camera camera)
+// CornellSmoke with smoke that thins out and clumps, from turbulence sampled into a density grid
+void CornellNoiseSmoke(Camera camera)
+{
+	HittableList world;
+
+	std::shared_ptr<Material> red = std::make_shared<Lambertian>(glm::vec4(0.65f, 0.05f, 0.05f, 1.0f));
+	std::shared_ptr<Material> white = std::make_shared<Lambertian>(glm::vec4(0.73f, 0.73f, 0.73f, 1.0f));
+	std::shared_ptr<Material> green = std::make_shared<Lambertian>(glm::vec4(0.12f, 0.45f, 0.15f, 1.0f));
+	std::shared_ptr<Material> light = std::make_shared<DiffuseLight>(glm::vec4(7.0f, 7.0f, 7.0f, 1.0f));
+
+	world.Add(std::make_shared<Quad>(glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), green));
+	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), red));
+	world.Add(std::make_shared<Quad>(glm::vec3(113.0f, 554.0f, 127.0f), glm::vec3(330.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 305.0f), light));
+	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), white));
+	world.Add(std::make_shared<Quad>(glm::vec3(555.0f, 555.0f, 555.0f), glm::vec3(-555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -555.0f), white));
+	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 555.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), white));
+
+	std::shared_ptr<DensityGrid> grid1 = DensityGrid::FromNoise(AABB(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(165.0f, 330.0f, 165.0f)), 128, 0.02f, 0.05f);
+	std::shared_ptr<DensityGrid> grid2 = DensityGrid::FromNoise(AABB(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(165.0f, 165.0f, 165.0f)), 64, 0.03f, 0.05f);
+
+	world.Add(std::make_shared<Instance>(std::make_shared<GridMedium>(grid1, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)), Transform::Translate(glm::vec3(265.0f, 0.0f, 295.0f)) * Transform::RotateY(15.0f)));
+	world.Add(std::make_shared<Instance>(std::make_shared<GridMedium>(grid2, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)), Transform::Translate(glm::vec3(130.0f, 0.0f, 65.0f)) * Transform::RotateY(-18.0f)));
+
+	camera.VerticalFOV = 40.0f;
+	camera.LookFrom = glm::vec3(278.0f, 278.0f, -800.0f);
+	camera.LookAt = glm::vec3(278.0f, 278.0f, 0.0f);
+	camera.ViewUp = glm::vec3(0.0f, 1.0f, 0.0f);
+
+	camera.DefocusAngle = 0.0f;
+
+	camera.BackgroundColor = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+	camera.Render(world);
+}
+
+void FinalScene(Camera camera, const AcceleratorOptions& accelerator)
 {
 	HittableList boxes1;
 	std::shared_ptr<Material> ground = std::make_shared<Lambertian>(glm::vec4(0.48f, 0.83f, 0.53f, 1.0f));
@@ -286,29 +323,37 @@ void FinalScene(Camera camera)
 
 	HittableList world;
 
-	world.Add(std::make_shared<BVHNode>(boxes1));
+	world.Add(BuildAccelerator(boxes1, accelerator));
 
 	std::shared_ptr<Material> light = std::make_shared<DiffuseLight>(glm::vec4(7.0f, 7.0f, 7.0f, 1.0f));
 	world.Add(std::make_shared<Quad>(glm::vec3(123.0f, 554.0f, 147.0f), glm::vec3(300.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 265.0f), light));
 
+	// An animation turns everything but the ground, the light and the fog once around the middle of the scene,
+	// under a BVH that is refit every frame
+	KeyframeTrack turntable = KeyframeTrack::Turntable(glm::vec3(278.0f, 0.0f, 278.0f), camera.FrameCount / camera.FrameRate);
+	HittableList objects;
+
+	auto turn = [&](std::shared_ptr<Hittable> object) -> std::shared_ptr<Hittable>
+	{
+		return camera.FrameCount > 1 ? std::make_shared<Instance>(object, Transform(), turntable) : object;
+	};
+
 	glm::vec3 center1 = glm::vec3(400.0f, 400.0f, 200.0f);
 	glm::vec3 center2 = center1 + glm::vec3(30.0f, 0.0f, 0.0f);
 	std::shared_ptr<Material> sphereMaterial = std::make_shared<Lambertian>(glm::vec4(0.7f, 0.3f, 0.1f, 1.0f));
-	world.Add(std::make_shared<Sphere>(center1, center2, 50.0f, sphereMaterial));
+	objects.Add(turn(std::make_shared<Sphere>(center1, center2, 50.0f, sphereMaterial)));
 
-	world.Add(std::make_shared<Sphere>(glm::vec3(260.0f, 150.0f, 45.0f), 50.0f, std::make_shared<Dielectric>(1.5f)));
-	world.Add(std::make_shared<Sphere>(glm::vec3(0.0f, 150.0f, 145.0f), 50.0f, std::make_shared<Metal>(glm::vec4(0.8f, 0.8f, 0.9f, 1.0f), 1.0f)));
+	objects.Add(turn(std::make_shared<Sphere>(glm::vec3(260.0f, 150.0f, 45.0f), 50.0f, std::make_shared<Dielectric>(1.5f))));
+	objects.Add(turn(std::make_shared<Sphere>(glm::vec3(0.0f, 150.0f, 145.0f), 50.0f, std::make_shared<Metal>(glm::vec4(0.8f, 0.8f, 0.9f, 1.0f), 1.0f))));
 
-	std::shared_ptr<Hittable> boundary = std::make_shared<Sphere>(glm::vec3(360.0f, 150.0f, 145.0f), 70.0f, std::make_shared<Dielectric>(1.0f));
-	world.Add(boundary);
-	world.Add(std::make_shared<ConstantMedium>(boundary, 0.2f, glm::vec4(0.2f, 0.4f, 0.9f, 1.0f)));
-	boundary = std::make_shared<Sphere>(glm::vec3(0.0f, 0.0f, 0.0f), 5000.0f, std::make_shared<Dielectric>(1.5f));
-	world.Add(std::make_shared<ConstantMedium>(boundary, 0.0001f, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)));
+	std::shared_ptr<Hittable> boundary = turn(std::make_shared<Sphere>(glm::vec3(360.0f, 150.0f, 145.0f), 70.0f, std::make_shared<Dielectric>(1.0f)));
+	objects.Add(boundary);
+	objects.Add(std::make_shared<ConstantMedium>(boundary, 0.2f, glm::vec4(0.2f, 0.4f, 0.9f, 1.0f)));
 
 	std::shared_ptr<Material> emat = std::make_shared<Lambertian>(std::make_shared<ImageTexture>("assets/textures/earthmap.jpg"));
-	world.Add(std::make_shared<Sphere>(glm::vec3(400.0f, 200.0f, 400.0f), 100.0f, emat));
+	objects.Add(turn(std::make_shared<Sphere>(glm::vec3(400.0f, 200.0f, 400.0f), 100.0f, emat)));
 	std::shared_ptr<Texture> pertext = std::make_shared<NoiseTexture>(0.1f);
-	world.Add(std::make_shared<Sphere>(glm::vec3(220.0f, 280.0f, 300.0f), 80.0f, std::make_shared<Lambertian>(pertext)));
+	objects.Add(turn(std::make_shared<Sphere>(glm::vec3(220.0f, 280.0f, 300.0f), 80.0f, std::make_shared<Lambertian>(pertext))));
 
 	HittableList boxes2;
 	std::shared_ptr<Material> white = std::make_shared<Lambertian>(glm::vec4(0.73f, 0.73f, 0.73f, 1.0f));
@@ -319,7 +364,16 @@ void FinalScene(Camera camera)
 		boxes2.Add(std::make_shared<Sphere>(RandomVector(0.0f, 165.0f), 10.0f, white));
 	}
 
-	world.Add(std::make_shared<Translate>(std::make_shared<RotateY>(std::make_shared<BVHNode>(boxes2), 15.0f), glm::vec3(-100.0f, 270.0f, 395.0f)));
+	Transform placement = Transform::Translate(glm::vec3(-100.0f, 270.0f, 395.0f)) * Transform::RotateY(15.0f);
+	objects.Add(std::make_shared<Instance>(BuildAccelerator(boxes2, accelerator), placement, camera.FrameCount > 1 ? turntable : KeyframeTrack()));
+
+	if (camera.FrameCount > 1)
+		world.Add(std::make_shared<BVHNode>(objects));
+	else
+		world.Add(std::make_shared<HittableList>(objects));
+
+	// Thin fog in a sphere around everything
+	world = HittableList(std::make_shared<GlobalMedium>(std::make_shared<HittableList>(world), 0.0001f, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f), glm::vec3(0.0f), 5000.0f));
 
 	camera.VerticalFOV = 40.0f;
 	camera.LookFrom = glm::vec3(479.0f, 278.0f, -600.0f);
@@ -333,24 +387,164 @@ void FinalScene(Camera camera)
 	camera.Render(world);
 }
 
-int main()
+void CornellMesh(Camera camera, const char* filePath, const AcceleratorOptions& accelerator)
 {
-	Camera camera;
+	HittableList world;
+
+	std::shared_ptr<Material> red = std::make_shared<Lambertian>(glm::vec4(0.65f, 0.05f, 0.05f, 1.0f));
+	std::shared_ptr<Material> white = std::make_shared<Lambertian>(glm::vec4(0.73f, 0.73f, 0.73f, 1.0f));
+	std::shared_ptr<Material> green = std::make_shared<Lambertian>(glm::vec4(0.12f, 0.45f, 0.15f, 1.0f));
+	std::shared_ptr<Material> light = std::make_shared<DiffuseLight>(glm::vec4(15.0f, 15.0f, 15.0f, 1.0f));
+
+	world.Add(std::make_shared<Quad>(glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), green));
+	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), red));
+	world.Add(std::make_shared<Quad>(glm::vec3(343.0f, 554.0f, 332.0f), glm::vec3(-130.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 105.0f), light));
+	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), white));
+	world.Add(std::make_shared<Quad>(glm::vec3(555.0f, 555.0f, 555.0f), glm::vec3(-555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -555.0f), white));
+	world.Add(std::make_shared<Quad>(glm::vec3(0.0f, 0.0f, 555.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), white));
+
+	// The mesh is placed standing on the center of the floor, it is expected to be modelled at the box's scale
+	std::shared_ptr<TriangleMesh> mesh = LoadMesh(filePath, white, accelerator.BuildOptions());
+
+	if (mesh->TriangleCount() > 0)
+	{
+		AABB bbox = mesh->BoundingBox();
+		glm::vec3 offset(277.5f - 0.5f * (bbox.X.Min + bbox.X.Max), -bbox.Y.Min, 277.5f - 0.5f * (bbox.Z.Min + bbox.Z.Max));
+		world.Add(std::make_shared<Instance>(mesh, Transform::Translate(offset)));
+	}
+
+	camera.VerticalFOV = 40.0f;
+	camera.LookFrom = glm::vec3(278.0f, 278.0f, -800.0f);
+	camera.LookAt = glm::vec3(278.0f, 278.0f, 0.0f);
+	camera.ViewUp = glm::vec3(0.0f, 1.0f, 0.0f);
+
+	camera.DefocusAngle = 0.0f;
+
+	camera.BackgroundColor = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+	camera.Render(world);
+}
 
-#if 0 // High res toggle
-	camera.ImageWidth = 2000;
-	camera.ImageHeight = 2000;
-#else
+void PrintUsage()
+{
+	std::cout << "Usage: RayTracing [scene] [options]\n"
+		<< "  scene                   scene file, or the number of a built-in scene (1-11, default 9)\n"
+		<< "  -o, --output <path>     output PNG\n"
+		<< "  -r, --resolution <w> <h>\n"
+		<< "  -s, --spp <count>       samples per pixel\n"
+		<< "  -t, --threads <count>   worker threads, 0 uses every hardware thread\n"
+		<< "  -f, --frames <count>    render an animation, the frame number is added to the output path\n"
+		<< "      --fps <rate>        animation frames per second (default 24)\n"
+		<< "      --seed <value>\n"
+		<< "      --no-cache          rebuild meshes and textures instead of using <scene>.cache\n"
+		<< "      --bvh <type>        acceleration structure: store (default), binary, bvh4 or bvh8\n"
+		<< "      --split <method>    BVH construction: sah (default), median or lbvh\n"
+		<< "      --adaptive <threshold>\n"
+		<< "                          sample pixels until their relative error is below threshold, up to --spp\n"
+		<< "      --packets <size>    trace camera rays in packets of 4, 8 or 16, 0 traces them one by one\n"
+		<< "      --wavefront         trace paths in batches one bounce at a time\n";
+}
+
+int main(int argc, char** argv)
+{
+	Camera camera;
 	camera.ImageWidth = 400;
 	camera.ImageHeight = 400;
-#endif
-
-	camera.SamplesPerPixel = 100000;
+	camera.SamplesPerPixel = 2000;
 	camera.MaxBounces = 10;
 
-	switch (9)
+	// Command line settings override the scene file, so they are applied after it is loaded
+	const char* scene = "9";
+	const char* outputPath = nullptr;
+	int width = 0, height = 0, samplesPerPixel = 0, frameCount = 0;
+	float frameRate = 0.0f;
+	long long threadCount = -1, seed = -1;
+	int packetSize = -1;
+	float adaptiveThreshold = 0.0f;
+	bool wavefront = false;
+	bool useCache = true;
+	AcceleratorOptions accelerator;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string_view argument = argv[i];
+		bool hasValue = i + 1 < argc;
+		bool valid = true;
+
+		if ((argument == "-o" || argument == "--output") && hasValue)
+			outputPath = argv[++i];
+		else if ((argument == "-r" || argument == "--resolution") && i + 2 < argc)
+		{
+			width = atoi(argv[++i]);
+			height = atoi(argv[++i]);
+			valid = width > 0 && height > 0;
+		}
+		else if ((argument == "-s" || argument == "--spp") && hasValue)
+			valid = (samplesPerPixel = atoi(argv[++i])) > 0;
+		else if ((argument == "-t" || argument == "--threads") && hasValue)
+			valid = (threadCount = atoll(argv[++i])) >= 0;
+		else if ((argument == "-f" || argument == "--frames") && hasValue)
+			valid = (frameCount = atoi(argv[++i])) > 0;
+		else if (argument == "--fps" && hasValue)
+			valid = (frameRate = static_cast<float>(atof(argv[++i]))) > 0.0f;
+		else if (argument == "--seed" && hasValue)
+			valid = (seed = atoll(argv[++i])) >= 0;
+		else if (argument == "--no-cache")
+			useCache = false;
+		else if (argument == "--bvh" && hasValue)
+			valid = ParseAcceleratorType(argv[++i], accelerator.Type);
+		else if (argument == "--split" && hasValue)
+			valid = ParseSplitMethod(argv[++i], accelerator.SplitMethod);
+		else if (argument == "--adaptive" && hasValue)
+			valid = (adaptiveThreshold = static_cast<float>(atof(argv[++i]))) > 0.0f;
+		else if (argument == "--packets" && hasValue)
+			valid = Camera::IsPacketSize(packetSize = atoi(argv[++i]));
+		else if (argument == "--wavefront")
+			wavefront = true;
+		else if (!argument.empty() && argument[0] != '-')
+			scene = argv[i];
+		else
+			valid = false;
+
+		if (!valid)
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	HittableList world;
+	bool isSceneFile = std::string_view(scene).find_first_not_of("0123456789") != std::string_view::npos;
+
+	if (isSceneFile && !LoadScene(scene, camera, world, useCache, accelerator))
+		return 1;
+
+	if (outputPath) camera.OutputPath = outputPath;
+	if (width > 0) camera.ImageWidth = width;
+	if (height > 0) camera.ImageHeight = height;
+	if (samplesPerPixel > 0) camera.SamplesPerPixel = samplesPerPixel;
+	if (threadCount >= 0) camera.ThreadCount = static_cast<uint32_t>(threadCount);
+	if (seed >= 0) camera.Seed = static_cast<uint32_t>(seed);
+	if (frameCount > 0) camera.FrameCount = frameCount;
+	if (frameRate > 0.0f) camera.FrameRate = frameRate;
+	if (packetSize >= 0) camera.PacketSize = packetSize;
+	if (wavefront) camera.Wavefront = true;
+
+	if (adaptiveThreshold > 0.0f)
+	{
+		camera.AdaptiveSampling = true;
+		camera.AdaptiveThreshold = adaptiveThreshold;
+	}
+
+	if (isSceneFile)
+	{
+		camera.Render(world);
+		return 0;
+	}
+
+	switch (atoi(scene))
 	{
-		case 1: RandomSpheres(camera); break;
+		case 1: RandomSpheres(camera, accelerator); break;
 		case 2: TwoSpheres(camera); break;
 		case 3: Earth(camera); break;
 		case 4: TwoPerlinSpheres(camera); break;
@@ -358,6 +552,9 @@ int main()
 		case 6: SimpleLight(camera); break;
 		case 7: CornellBox(camera); break;
 		case 8: CornellSmoke(camera); break;
-		case 9: FinalScene(camera); break;
+		case 9: FinalScene(camera, accelerator); break;
+		case 10: CornellMesh(camera, "assets/models/mesh.obj", accelerator); break;
+		case 11: CornellNoiseSmoke(camera); break;
+		default: PrintUsage(); return 1;
 	}
 }
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
 #include "Hittable.h"
 #include "Utils.h"
 #include "Texture.h"
@@ -16,12 +22,23 @@ public:
 	virtual glm::vec4 Emitted(float u, float v, const glm::vec3& point) const {
 		return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
 	}
+
+	virtual bool IsEmissive() const { return false; }
+
+	// Materials without a ScatteringPdf are treated as specular and never sample lights directly
+	virtual bool IsSpecular() const { return true; }
+
+	// Solid angle density of Scatter returning direction
+	virtual float ScatteringPdf(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const { return 0.0f; }
+
+	// The attenuation Scatter returns for direction times ScatteringPdf, i.e. the BSDF times the cosine term
+	virtual glm::vec4 Evaluate(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const { return glm::vec4(0.0f); }
 };
 
-class Lambertian : public Material
+class Lambertian final : public Material
 {
 public:
-	Lambertian(const glm::vec4& albedo) : m_Albedo(std::make_shared<SolidColorTexture>(albedo)) {}
+	Lambertian(const glm::vec4& albedo) : m_Albedo(albedo) {}
 	Lambertian(std::shared_ptr<Texture> texture) : m_Albedo(texture) {}
 
 	bool Scatter(const Ray& inRay, const HitRecord& hit, glm::vec4& attenuation, Ray& scattered) const override
@@ -32,16 +49,29 @@ public:
 			scatterDirection = hit.Normal;
 
 		scattered = Ray(hit.Point, scatterDirection, inRay.Time());
-		attenuation = m_Albedo->Value(hit.U, hit.V, hit.Point);
+		attenuation = m_Albedo.Value(hit.U, hit.V, hit.Point);
 
 		return true;
 	}
 
+	bool IsSpecular() const override { return false; }
+
+	float ScatteringPdf(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const override
+	{
+		float cosine = glm::dot(hit.Normal, glm::normalize(direction));
+		return cosine > 0.0f ? cosine / Pi : 0.0f;
+	}
+
+	glm::vec4 Evaluate(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const override
+	{
+		return m_Albedo.Value(hit.U, hit.V, hit.Point) * ScatteringPdf(inRay, hit, direction);
+	}
+
 private:
-	std::shared_ptr<Texture> m_Albedo;
+	TextureHandle m_Albedo;
 };
 
-class Metal : public Material
+class Metal final : public Material
 {
 public:
 	Metal(const glm::vec4& albedo, float fuzz) : m_Albedo(albedo), m_Fuzz(fuzz) {}
@@ -55,12 +85,47 @@ public:
 		return glm::dot(scattered.Direction(), hit.Normal) > 0.0f;
 	}
 
+	bool IsSpecular() const override { return m_Fuzz <= 0.0f; }
+
+	// Scatter picks a point on the sphere of radius fuzz around the mirror direction, so the density of a direction
+	// sums t^2 / (4 pi fuzz^2 |cos|) over the points t where it crosses that sphere, with |cos| = sqrt(disc) / fuzz
+	float ScatteringPdf(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const override
+	{
+		glm::vec3 unitDirection = glm::normalize(direction);
+
+		if (m_Fuzz <= 0.0f || glm::dot(unitDirection, hit.Normal) <= 0.0f)
+			return 0.0f;
+
+		glm::vec3 reflected = glm::reflect(glm::normalize(inRay.Direction()), hit.Normal);
+		float b = glm::dot(unitDirection, reflected);
+		float discriminant = b * b - 1.0f + m_Fuzz * m_Fuzz;
+
+		if (discriminant <= 0.0f)
+			return 0.0f;
+
+		float sqrtDiscriminant = sqrt(discriminant);
+		float pdf = 0.0f;
+
+		for (float t : { b - sqrtDiscriminant, b + sqrtDiscriminant })
+		{
+			if (t > 0.0f)
+				pdf += t * t;
+		}
+
+		return pdf / (4.0f * Pi * m_Fuzz * sqrtDiscriminant);
+	}
+
+	glm::vec4 Evaluate(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const override
+	{
+		return m_Albedo * ScatteringPdf(inRay, hit, direction);
+	}
+
 private:
 	glm::vec4 m_Albedo;
 	float m_Fuzz;
 };
 
-class Dielectric : public Material
+class Dielectric final : public Material
 {
 public:
 	Dielectric(float indexOfRefraction) : m_IOR(indexOfRefraction) {}
@@ -99,11 +164,11 @@ private:
 	}
 };
 
-class DiffuseLight : public Material
+class DiffuseLight final : public Material
 {
 public:
 	DiffuseLight(std::shared_ptr<Texture> a) : m_Emit(a) {}
-	DiffuseLight(glm::vec4 color) : m_Emit(std::make_shared<SolidColorTexture>(color)) {}
+	DiffuseLight(glm::vec4 color) : m_Emit(color) {}
 
 	bool Scatter(const Ray& inRay, const HitRecord& hit, glm::vec4& attenuation, Ray& scattered) const override
 	{
@@ -112,27 +177,104 @@ public:
 
 	glm::vec4 Emitted(float u, float v, const glm::vec3& point) const override
 	{
-		return m_Emit->Value(u, v, point);
+		return m_Emit.Value(u, v, point);
 	}
 
+	bool IsEmissive() const override { return true; }
+
 private:
-	std::shared_ptr<Texture> m_Emit;
+	TextureHandle m_Emit;
 };
 
-class Isotropic : public Material
+class Isotropic final : public Material
 {
 public:
-	Isotropic(glm::vec4 color) : m_Albedo(std::make_shared<SolidColorTexture>(color)) {}
+	Isotropic(glm::vec4 color) : m_Albedo(color) {}
 	Isotropic(std::shared_ptr<Texture> texture) : m_Albedo(texture) {}
 
 	bool Scatter(const Ray& inRay, const HitRecord& hit, glm::vec4& attenuation, Ray& scattered) const override
 	{
 		scattered = Ray(hit.Point, RandomUnitVector(), inRay.Time());
-		attenuation = m_Albedo->Value(hit.U, hit.V, hit.Point);
+		attenuation = m_Albedo.Value(hit.U, hit.V, hit.Point);
 
 		return true;
 	}
 
+	bool IsSpecular() const override { return false; }
+
+	float ScatteringPdf(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const override
+	{
+		return 1.0f / (4.0f * Pi);
+	}
+
+	glm::vec4 Evaluate(const Ray& inRay, const HitRecord& hit, const glm::vec3& direction) const override
+	{
+		return m_Albedo.Value(hit.U, hit.V, hit.Point) * ScatteringPdf(inRay, hit, direction);
+	}
+
+private:
+	TextureHandle m_Albedo;
+};
+
+// Owns every material referenced by a primitive. Primitives register their material once when they are built and
+// keep its index, so hits carry a plain integer instead of copying a shared_ptr
+class MaterialTable
+{
+public:
+	static uint32_t Add(const std::shared_ptr<Material>& material)
+	{
+		std::lock_guard<std::mutex> lock(s_Mutex);
+
+		auto it = s_Indices.find(material.get());
+
+		if (it != s_Indices.end())
+			return it->second;
+
+		uint32_t id = static_cast<uint32_t>(s_Materials.size());
+		s_Materials.push_back(material);
+		s_Compiled.push_back(Compile(*material));
+		s_Indices.emplace(material.get(), id);
+
+		return id;
+	}
+
+	// Not synchronized with Add, materials must not be added while rendering
+	static const Material& Get(uint32_t id) { return *s_Materials[id]; }
+
+	// Calls visitor with the material as its own type, so everything visitor calls on it can be inlined
+	template<typename Visitor>
+	static decltype(auto) Visit(uint32_t id, Visitor&& visitor)
+	{
+		return std::visit([&](const auto& material) -> decltype(auto)
+			{
+				if constexpr (std::is_pointer_v<std::decay_t<decltype(material)>>)
+					return visitor(*material);
+				else
+					return visitor(material);
+			}, s_Compiled[id]);
+	}
+
+	static size_t Size() { return s_Materials.size(); }
+
 private:
-	std::shared_ptr<Texture> m_Albedo;
+	// The materials built into the renderer are copied in by value, any other one is reached through its virtual functions
+	using CompiledMaterial = std::variant<Lambertian, Metal, Dielectric, DiffuseLight, Isotropic, const Material*>;
+
+	inline static std::vector<std::shared_ptr<Material>> s_Materials;
+	inline static std::vector<CompiledMaterial> s_Compiled;
+	inline static std::unordered_map<const Material*, uint32_t> s_Indices;
+	inline static std::mutex s_Mutex;
+
+	static CompiledMaterial Compile(const Material& material)
+	{
+		const std::type_info& type = typeid(material);
+
+		if (type == typeid(Lambertian)) return static_cast<const Lambertian&>(material);
+		if (type == typeid(Metal)) return static_cast<const Metal&>(material);
+		if (type == typeid(Dielectric)) return static_cast<const Dielectric&>(material);
+		if (type == typeid(DiffuseLight)) return static_cast<const DiffuseLight&>(material);
+		if (type == typeid(Isotropic)) return static_cast<const Isotropic&>(material);
+
+		return &material;
+	}
 };
@@ -0,0 +1,633 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#include "TriangleMesh.h"
+
+// Reads a file in large blocks and hands out lines or bytes straight from the block, so parsing allocates
+// nothing per line
+class FileReader
+{
+public:
+	FileReader(const char* filePath) : m_File(fopen(filePath, "rb")), m_Buffer(1 << 20) {}
+	~FileReader() { if (m_File) fclose(m_File); }
+
+	FileReader(const FileReader&) = delete;
+	FileReader& operator=(const FileReader&) = delete;
+
+	bool IsOpen() const { return m_File != nullptr; }
+
+	// The line stays valid until the next call, the newline is not included
+	bool NextLine(std::string_view& line)
+	{
+		while (true)
+		{
+			const char* begin = m_Buffer.data() + m_Begin;
+			const char* newline = static_cast<const char*>(memchr(begin, '\n', m_End - m_Begin));
+
+			if (newline)
+			{
+				line = std::string_view(begin, newline - begin);
+				m_Begin += line.size() + 1;
+				return true;
+			}
+
+			if (!Refill())
+			{
+				if (m_Begin == m_End)
+					return false;
+
+				line = std::string_view(m_Buffer.data() + m_Begin, m_End - m_Begin);
+				m_Begin = m_End;
+				return true;
+			}
+		}
+	}
+
+	bool Read(void* destination, size_t size)
+	{
+		while (m_End - m_Begin < size)
+		{
+			if (!Refill())
+				return false;
+		}
+
+		memcpy(destination, m_Buffer.data() + m_Begin, size);
+		m_Begin += size;
+
+		return true;
+	}
+
+private:
+	FILE* m_File;
+	std::vector<char> m_Buffer;
+	size_t m_Begin = 0;
+	size_t m_End = 0;
+
+	// Moves the unread tail to the front and reads behind it, growing the buffer only for a line longer than it
+	bool Refill()
+	{
+		if (!m_File)
+			return false;
+
+		size_t remaining = m_End - m_Begin;
+		memmove(m_Buffer.data(), m_Buffer.data() + m_Begin, remaining);
+		m_Begin = 0;
+		m_End = remaining;
+
+		if (m_End == m_Buffer.size())
+			m_Buffer.resize(2 * m_Buffer.size());
+
+		size_t read = fread(m_Buffer.data() + m_End, 1, m_Buffer.size() - m_End, m_File);
+		m_End += read;
+
+		return read > 0;
+	}
+};
+
+namespace MeshParsing
+{
+	inline void SkipSpaces(const char*& p, const char* end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+	}
+
+	inline bool ParseFloat(const char*& p, const char* end, float& value)
+	{
+		SkipSpaces(p, end);
+
+		// from_chars does not accept the leading plus some exporters write
+		if (p < end && *p == '+')
+			p++;
+
+		std::from_chars_result result = std::from_chars(p, end, value);
+		p = result.ptr;
+
+		return result.ec == std::errc();
+	}
+
+	inline bool ParseInt(const char*& p, const char* end, long long& value)
+	{
+		std::from_chars_result result = std::from_chars(p, end, value);
+		p = result.ptr;
+
+		return result.ec == std::errc();
+	}
+
+	inline std::string_view NextToken(const char*& p, const char* end)
+	{
+		SkipSpaces(p, end);
+		const char* begin = p;
+
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+			p++;
+
+		return std::string_view(begin, p - begin);
+	}
+}
+
+// Wavefront OBJ: positions, texture coordinates, normals and polygonal faces, which are triangulated as fans.
+// Corners that combine the same attribute indices are merged into one vertex of the shared buffers
+inline bool LoadOBJ(const char* filePath, MeshData& mesh)
+{
+	using namespace MeshParsing;
+
+	struct Corner
+	{
+		int32_t Position, UV, Normal;
+	};
+
+	FileReader reader(filePath);
+
+	if (!reader.IsOpen())
+		return false;
+
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec2> uvs;
+	std::vector<glm::vec3> normals;
+	std::vector<Corner> corners;	// Three per triangle
+	bool allUVs = true;
+	bool allNormals = true;
+
+	// OBJ indices are 1-based, negative ones count back from the last element read so far
+	auto resolve = [](long long index, size_t count) -> int32_t
+		{
+			if (index > 0 && static_cast<size_t>(index) <= count)
+				return static_cast<int32_t>(index - 1);
+
+			if (index < 0 && static_cast<size_t>(-index) <= count)
+				return static_cast<int32_t>(count + index);
+
+			return -2;
+		};
+
+	std::string_view line;
+
+	while (reader.NextLine(line))
+	{
+		const char* p = line.data();
+		const char* end = p + line.size();
+		std::string_view keyword = NextToken(p, end);
+
+		if (keyword == "v")
+		{
+			glm::vec3 position;
+
+			if (!ParseFloat(p, end, position.x) || !ParseFloat(p, end, position.y) || !ParseFloat(p, end, position.z))
+				return false;
+
+			positions.push_back(position);
+		}
+		else if (keyword == "vt")
+		{
+			glm::vec2 uv;
+
+			if (!ParseFloat(p, end, uv.x))
+				return false;
+
+			if (!ParseFloat(p, end, uv.y))
+				uv.y = 0.0f;
+
+			uvs.push_back(uv);
+		}
+		else if (keyword == "vn")
+		{
+			glm::vec3 normal;
+
+			if (!ParseFloat(p, end, normal.x) || !ParseFloat(p, end, normal.y) || !ParseFloat(p, end, normal.z))
+				return false;
+
+			normals.push_back(normal);
+		}
+		else if (keyword == "f")
+		{
+			Corner first, previous;
+			int count = 0;
+
+			while (true)
+			{
+				SkipSpaces(p, end);
+
+				if (p >= end)
+					break;
+
+				// v, v/vt, v//vn or v/vt/vn
+				Corner corner = { -2, -1, -1 };
+				long long index;
+
+				if (ParseInt(p, end, index))
+					corner.Position = resolve(index, positions.size());
+
+				if (p < end && *p == '/')
+				{
+					p++;
+
+					if (p < end && *p != '/' && ParseInt(p, end, index))
+						corner.UV = resolve(index, uvs.size());
+
+					if (p < end && *p == '/')
+					{
+						p++;
+
+						if (ParseInt(p, end, index))
+							corner.Normal = resolve(index, normals.size());
+					}
+				}
+
+				if (corner.Position < 0 || corner.UV == -2 || corner.Normal == -2)
+					return false;
+
+				allUVs &= corner.UV >= 0;
+				allNormals &= corner.Normal >= 0;
+
+				if (count >= 2)
+				{
+					corners.push_back(first);
+					corners.push_back(previous);
+					corners.push_back(corner);
+				}
+				else if (count == 0)
+				{
+					first = corner;
+				}
+
+				previous = corner;
+				count++;
+			}
+		}
+	}
+
+	allUVs &= !uvs.empty();
+	allNormals &= !normals.empty();
+
+	mesh = MeshData();
+	mesh.Indices.reserve(corners.size());
+
+	if (!allUVs && !allNormals)
+	{
+		mesh.Positions = std::move(positions);
+
+		for (const Corner& corner : corners)
+			mesh.Indices.push_back(corner.Position);
+
+		return true;
+	}
+
+	// Open addressing table from corner to merged vertex, a slot holds the vertex index + 1 and 0 when empty
+	size_t capacity = 16;
+	while (capacity < 2 * corners.size())
+		capacity *= 2;
+
+	std::vector<uint32_t> slots(capacity, 0);
+	std::vector<Corner> unique;
+
+	for (Corner corner : corners)
+	{
+		if (!allUVs)
+			corner.UV = -1;
+
+		if (!allNormals)
+			corner.Normal = -1;
+
+		uint64_t hash = HashCombine(HashCombine(static_cast<uint64_t>(corner.Position), static_cast<uint64_t>(corner.UV)), static_cast<uint64_t>(corner.Normal));
+		size_t slot = hash & (capacity - 1);
+
+		while (slots[slot] != 0)
+		{
+			const Corner& other = unique[slots[slot] - 1];
+
+			if (other.Position == corner.Position && other.UV == corner.UV && other.Normal == corner.Normal)
+				break;
+
+			slot = (slot + 1) & (capacity - 1);
+		}
+
+		if (slots[slot] == 0)
+		{
+			unique.push_back(corner);
+			slots[slot] = static_cast<uint32_t>(unique.size());
+		}
+
+		mesh.Indices.push_back(slots[slot] - 1);
+	}
+
+	mesh.Positions.reserve(unique.size());
+
+	for (const Corner& corner : unique)
+	{
+		mesh.Positions.push_back(positions[corner.Position]);
+
+		if (allUVs)
+			mesh.UVs.push_back(uvs[corner.UV]);
+
+		if (allNormals)
+			mesh.Normals.push_back(normals[corner.Normal]);
+	}
+
+	return true;
+}
+
+// Binary (little or big endian) PLY with x/y/z, optional nx/ny/nz and u/v (or s/t) vertex properties and a
+// vertex_indices face list. Polygons are triangulated as fans, other elements and properties are skipped
+inline bool LoadPLY(const char* filePath, MeshData& mesh)
+{
+	using namespace MeshParsing;
+
+	enum class Type : uint8_t { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+	struct Property
+	{
+		std::string_view Name;
+		Type ValueType;
+		Type CountType;		// Invalid unless the property is a list
+		int Target;			// Vertex attribute slot or -1
+	};
+
+	struct Element
+	{
+		std::string_view Name;
+		size_t Count;
+		int FirstProperty, PropertyCount;
+	};
+
+	auto parseType = [](std::string_view name) -> Type
+		{
+			if (name == "char" || name == "int8") return Type::Int8;
+			if (name == "uchar" || name == "uint8") return Type::UInt8;
+			if (name == "short" || name == "int16") return Type::Int16;
+			if (name == "ushort" || name == "uint16") return Type::UInt16;
+			if (name == "int" || name == "int32") return Type::Int32;
+			if (name == "uint" || name == "uint32") return Type::UInt32;
+			if (name == "float" || name == "float32") return Type::Float32;
+			if (name == "double" || name == "float64") return Type::Float64;
+			return Type::Invalid;
+		};
+
+	auto vertexTarget = [](std::string_view name) -> int
+		{
+			constexpr std::string_view names[] = { "x", "y", "z", "nx", "ny", "nz", "u", "v", "s", "t", "texture_u", "texture_v" };
+			constexpr int targets[] = { 0, 1, 2, 3, 4, 5, 6, 7, 6, 7, 6, 7 };
+
+			for (int i = 0; i < 12; i++)
+			{
+				if (name == names[i])
+					return targets[i];
+			}
+
+			return -1;
+		};
+
+	FileReader reader(filePath);
+
+	if (!reader.IsOpen())
+		return false;
+
+	// Names point into a copy of the header, the reader's lines do not outlive the next one
+	std::vector<char> header;
+	std::string_view line;
+
+	while (reader.NextLine(line))
+	{
+		header.insert(header.end(), line.begin(), line.end());
+		header.push_back('\n');
+
+		if (line.substr(0, 10) == "end_header")
+			break;
+	}
+
+	std::vector<Element> elements;
+	std::vector<Property> properties;
+	bool bigEndian = false;
+	bool valid = false;
+
+	const char* p = header.data();
+	const char* headerEnd = p + header.size();
+
+	if (std::string_view(p, std::min<size_t>(3, header.size())) != "ply")
+		return false;
+
+	while (p < headerEnd)
+	{
+		const char* end = static_cast<const char*>(memchr(p, '\n', headerEnd - p));
+		const char* next = end + 1;
+		std::string_view keyword = NextToken(p, end);
+
+		if (keyword == "format")
+		{
+			std::string_view format = NextToken(p, end);
+			bigEndian = format == "binary_big_endian";
+			valid = bigEndian || format == "binary_little_endian";
+		}
+		else if (keyword == "element")
+		{
+			Element element;
+			element.Name = NextToken(p, end);
+			element.Count = 0;
+			SkipSpaces(p, end);
+			std::from_chars(p, end, element.Count);
+			element.FirstProperty = static_cast<int>(properties.size());
+			element.PropertyCount = 0;
+			elements.push_back(element);
+		}
+		else if (keyword == "property" && !elements.empty())
+		{
+			Property property;
+			std::string_view type = NextToken(p, end);
+			property.CountType = Type::Invalid;
+
+			if (type == "list")
+			{
+				property.CountType = parseType(NextToken(p, end));
+				type = NextToken(p, end);
+
+				if (property.CountType == Type::Invalid)
+					return false;
+			}
+
+			property.ValueType = parseType(type);
+			property.Name = NextToken(p, end);
+			property.Target = -1;
+
+			if (property.ValueType == Type::Invalid)
+				return false;
+
+			if (elements.back().Name == "vertex" && property.CountType == Type::Invalid)
+				property.Target = vertexTarget(property.Name);
+			else if (elements.back().Name == "face" && (property.Name == "vertex_indices" || property.Name == "vertex_index"))
+				property.Target = 0;
+
+			properties.push_back(property);
+			elements.back().PropertyCount++;
+		}
+
+		p = next;
+	}
+
+	if (!valid)
+		return false;
+
+	constexpr size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+	bool swap = bigEndian != (std::endian::native == std::endian::big);
+
+	auto readValue = [&](Type type, double& value) -> bool
+		{
+			uint8_t bytes[8];
+			size_t size = sizes[static_cast<int>(type)];
+
+			if (!reader.Read(bytes, size))
+				return false;
+
+			if (swap)
+				std::reverse(bytes, bytes + size);
+
+			switch (type)
+			{
+				case Type::Int8:	{ int8_t x; memcpy(&x, bytes, 1); value = x; break; }
+				case Type::UInt8:	{ uint8_t x; memcpy(&x, bytes, 1); value = x; break; }
+				case Type::Int16:	{ int16_t x; memcpy(&x, bytes, 2); value = x; break; }
+				case Type::UInt16:	{ uint16_t x; memcpy(&x, bytes, 2); value = x; break; }
+				case Type::Int32:	{ int32_t x; memcpy(&x, bytes, 4); value = x; break; }
+				case Type::UInt32:	{ uint32_t x; memcpy(&x, bytes, 4); value = x; break; }
+				case Type::Float32:	{ float x; memcpy(&x, bytes, 4); value = x; break; }
+				case Type::Float64:	{ memcpy(&value, bytes, 8); break; }
+				default: return false;
+			}
+
+			return true;
+		};
+
+	mesh = MeshData();
+	bool hasNormals = false;
+	bool hasUVs = false;
+
+	for (const Element& element : elements)
+	{
+		bool isVertex = element.Name == "vertex";
+		bool isFace = element.Name == "face";
+
+		if (isVertex)
+		{
+			for (int i = 0; i < element.PropertyCount; i++)
+			{
+				int target = properties[element.FirstProperty + i].Target;
+				hasNormals |= target >= 3 && target <= 5;
+				hasUVs |= target >= 6;
+			}
+
+			mesh.Positions.resize(element.Count);
+
+			if (hasNormals)
+				mesh.Normals.resize(element.Count);
+
+			if (hasUVs)
+				mesh.UVs.resize(element.Count);
+		}
+
+		if (isFace)
+			mesh.Indices.reserve(element.Count * 3);
+
+		for (size_t e = 0; e < element.Count; e++)
+		{
+			float attributes[8] = {};
+
+			for (int i = 0; i < element.PropertyCount; i++)
+			{
+				const Property& property = properties[element.FirstProperty + i];
+				double value;
+
+				if (property.CountType == Type::Invalid)
+				{
+					if (!readValue(property.ValueType, value))
+						return false;
+
+					if (isVertex && property.Target >= 0)
+						attributes[property.Target] = static_cast<float>(value);
+
+					continue;
+				}
+
+				double count;
+
+				if (!readValue(property.CountType, count))
+					return false;
+
+				uint32_t first = 0, previous = 0;
+
+				for (uint32_t k = 0; k < static_cast<uint32_t>(count); k++)
+				{
+					if (!readValue(property.ValueType, value))
+						return false;
+
+					if (!isFace || property.Target != 0)
+						continue;
+
+					uint32_t index = static_cast<uint32_t>(value);
+
+					if (k >= 2)
+					{
+						mesh.Indices.push_back(first);
+						mesh.Indices.push_back(previous);
+						mesh.Indices.push_back(index);
+					}
+					else if (k == 0)
+					{
+						first = index;
+					}
+
+					previous = index;
+				}
+			}
+
+			if (isVertex)
+			{
+				mesh.Positions[e] = glm::vec3(attributes[0], attributes[1], attributes[2]);
+
+				if (hasNormals)
+					mesh.Normals[e] = glm::vec3(attributes[3], attributes[4], attributes[5]);
+
+				if (hasUVs)
+					mesh.UVs[e] = glm::vec2(attributes[6], attributes[7]);
+			}
+		}
+	}
+
+	for (uint32_t index : mesh.Indices)
+	{
+		if (index >= mesh.Positions.size())
+			return false;
+	}
+
+	return true;
+}
+
+// Loads an .obj or .ply file by extension. A file that cannot be read gives an empty mesh, like a missing texture
+// gives a magenta one
+inline std::shared_ptr<TriangleMesh> LoadMesh(const char* filePath, std::shared_ptr<Material> material, const BVHBuildOptions& options = BVHBuildOptions())
+{
+	std::string_view path(filePath);
+	std::string_view extension = path.substr(path.find_last_of('.') == std::string_view::npos ? path.size() : path.find_last_of('.'));
+
+	MeshData mesh;
+	bool loaded = false;
+
+	if (extension == ".obj" || extension == ".OBJ")
+		loaded = LoadOBJ(filePath, mesh);
+	else if (extension == ".ply" || extension == ".PLY")
+		loaded = LoadPLY(filePath, mesh);
+
+	if (!loaded)
+	{
+		std::cout << "Failed to load mesh " << filePath << std::endl;
+		mesh = MeshData();
+	}
+
+	return std::make_shared<TriangleMesh>(std::move(mesh), material, options);
+}
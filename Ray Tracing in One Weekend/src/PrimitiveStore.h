@@ -0,0 +1,606 @@
+#pragma once
+
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+#include "Utils.h"
+#include "Simd.h"
+#include "Hittable.h"
+#include "HittableList.h"
+#include "BVH.h"
+#include "Sphere.h"
+#include "Quad.h"
+
+// Spheres, quads and boxes copied out of their objects into structure of arrays, under a BVH whose leaves reference
+// ranges of those arrays, so a leaf is intersected SimdFloat::Width primitives per instruction instead of one per
+// virtual call. Anything else in the list (including Quad subclasses with their own IsInterior) is kept as an object
+// under a BVH of its own, which is also what refits when those objects are animated
+class PrimitiveStore : public Hittable
+{
+public:
+	PrimitiveStore(const HittableList& list, const BVHBuildOptions& options = DefaultBuildOptions())
+	{
+		HittableList supported;
+		HittableList others;
+		Collect(list, supported, others);
+
+		m_Others = std::make_shared<BVHNode>(others);
+		m_Bbox = m_Others->BoundingBox();
+
+		if (supported.objects.empty())
+			return;
+
+		BVHNode bvh(supported, options);
+		m_Nodes = bvh.Nodes();
+		m_MotionNodes = bvh.MotionNodes();
+		m_Sources = bvh.Primitives();
+		m_Leaves.resize(m_Nodes.size());
+		m_Bbox = AABB(m_Bbox, bvh.BoundingBox());
+
+		// Within every leaf each primitive type gets its own contiguous range
+		for (size_t i = 0; i < m_Nodes.size(); i++)
+		{
+			const LinearBVHNode& node = m_Nodes[i];
+
+			if (node.PrimitiveCount == 0)
+				continue;
+
+			LeafRange& leaf = m_Leaves[i];
+			leaf.SphereOffset = static_cast<uint32_t>(m_Spheres.Radius.size());
+			leaf.QuadOffset = static_cast<uint32_t>(m_Quads.D.size());
+			leaf.BoxOffset = static_cast<uint32_t>(m_Boxes.MinX.size());
+
+			for (uint32_t k = node.Offset; k < node.Offset + node.PrimitiveCount; k++)
+			{
+				const std::type_info& type = typeid(*m_Sources[k]);
+
+				if (type == typeid(Sphere))
+					m_Spheres.Add(static_cast<const Sphere&>(*m_Sources[k]));
+				else if (type == typeid(Quad))
+					m_Quads.Add(static_cast<const Quad&>(*m_Sources[k]));
+				else
+					m_Boxes.Add(static_cast<const BoxPrimitive&>(*m_Sources[k]));
+			}
+
+			leaf.SphereCount = static_cast<uint32_t>(m_Spheres.Radius.size()) - leaf.SphereOffset;
+			leaf.QuadCount = static_cast<uint32_t>(m_Quads.D.size()) - leaf.QuadOffset;
+			leaf.BoxCount = static_cast<uint32_t>(m_Boxes.MinX.size()) - leaf.BoxOffset;
+		}
+
+		m_Spheres.Pad();
+		m_Quads.Pad();
+		m_Boxes.Pad();
+	}
+
+	static BVHBuildOptions DefaultBuildOptions()
+	{
+		// A SIMD batch costs about as much as a single scalar primitive did, so leaves hold two batches
+		BVHBuildOptions options;
+		options.MaxLeafSize = 2 * SimdFloat::Width;
+		options.IntersectionCost = 0.125f;
+
+		return options;
+	}
+
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		bool hitAnything = m_Others->Hit(ray, rayT, hit);
+
+		if (hitAnything)
+			rayT.Max = hit.T;
+
+		if (m_Nodes.empty())
+			return hitAnything;
+
+		Candidate closest;
+		Traverse(ray, rayT, closest, false);
+
+		if (closest.Index == ~0u)
+			return hitAnything;
+
+		if (closest.Kind == PrimitiveKind::Sphere)
+			FinishSphereHit(closest.Index, ray, rayT.Max, hit);
+		else if (closest.Kind == PrimitiveKind::Quad)
+			FinishQuadHit(closest.Index, ray, rayT.Max, hit);
+		else
+			FinishBoxHit(closest.Index, ray, rayT.Max, hit);
+
+		return true;
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		if (m_Others->Occluded(ray, rayT))
+			return true;
+
+		if (m_Nodes.empty())
+			return false;
+
+		Candidate any;
+		return Traverse(ray, rayT, any, true);
+	}
+
+	AABB BoundingBox() const override { return m_Bbox; }
+
+	MotionBounds ShutterBounds() const override
+	{
+		MotionBounds bounds = m_Others->ShutterBounds();
+
+		if (!m_MotionNodes.empty())
+			return MotionBounds(bounds, MotionBounds(m_MotionNodes[0].At(0.0f), m_MotionNodes[0].At(1.0f)));
+
+		if (!m_Nodes.empty())
+			return MotionBounds(bounds, MotionBounds(m_Nodes[0].Bbox, m_Nodes[0].Bbox));
+
+		return bounds;
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		for (const std::shared_ptr<Hittable>& source : m_Sources)
+			source->GatherLights(lights);
+
+		m_Others->GatherLights(lights);
+	}
+
+	// The structure of arrays copies are static, only the other objects move
+	bool Animate(float time) override
+	{
+		if (!m_Others->Animate(time))
+			return false;
+
+		m_Bbox = m_Others->BoundingBox();
+
+		if (!m_Nodes.empty())
+			m_Bbox = AABB(m_Bbox, m_Nodes[0].Bbox);
+
+		return true;
+	}
+
+private:
+	struct SphereArrays
+	{
+		std::vector<float> CenterX, CenterY, CenterZ;
+		std::vector<float> MoveX, MoveY, MoveZ;		// Zero for spheres that do not move
+		std::vector<float> Radius;
+		std::vector<uint32_t> MaterialID, PrimitiveID;
+
+		void Add(const Sphere& sphere)
+		{
+			glm::vec3 move = sphere.m_IsMoving ? sphere.m_MoveVector : glm::vec3(0.0f);
+
+			CenterX.push_back(sphere.m_Center.x);
+			CenterY.push_back(sphere.m_Center.y);
+			CenterZ.push_back(sphere.m_Center.z);
+			MoveX.push_back(move.x);
+			MoveY.push_back(move.y);
+			MoveZ.push_back(move.z);
+			Radius.push_back(sphere.m_Radius);
+			MaterialID.push_back(sphere.m_MaterialID);
+			PrimitiveID.push_back(sphere.m_PrimitiveID);
+		}
+
+		// The last batch of a leaf may read past the end of the arrays, its extra lanes are masked off
+		void Pad()
+		{
+			for (std::vector<float>* array : { &CenterX, &CenterY, &CenterZ, &MoveX, &MoveY, &MoveZ, &Radius })
+				array->resize(array->size() + SimdFloat::Width, 0.0f);
+		}
+	};
+
+	struct QuadArrays
+	{
+		std::vector<float> NormalX, NormalY, NormalZ, D;
+		std::vector<float> QX, QY, QZ;
+		std::vector<float> UX, UY, UZ;
+		std::vector<float> VX, VY, VZ;
+		std::vector<float> WX, WY, WZ;
+		std::vector<uint32_t> MaterialID, PrimitiveID;
+
+		void Add(const Quad& quad)
+		{
+			NormalX.push_back(quad.m_Normal.x);
+			NormalY.push_back(quad.m_Normal.y);
+			NormalZ.push_back(quad.m_Normal.z);
+			D.push_back(quad.m_D);
+			QX.push_back(quad.m_Q.x);
+			QY.push_back(quad.m_Q.y);
+			QZ.push_back(quad.m_Q.z);
+			UX.push_back(quad.m_U.x);
+			UY.push_back(quad.m_U.y);
+			UZ.push_back(quad.m_U.z);
+			VX.push_back(quad.m_V.x);
+			VY.push_back(quad.m_V.y);
+			VZ.push_back(quad.m_V.z);
+			WX.push_back(quad.m_W.x);
+			WY.push_back(quad.m_W.y);
+			WZ.push_back(quad.m_W.z);
+			MaterialID.push_back(quad.m_MaterialID);
+			PrimitiveID.push_back(quad.m_PrimitiveID);
+		}
+
+		void Pad()
+		{
+			for (std::vector<float>* array : { &NormalX, &NormalY, &NormalZ, &D, &QX, &QY, &QZ, &UX, &UY, &UZ, &VX, &VY, &VZ, &WX, &WY, &WZ })
+				array->resize(array->size() + SimdFloat::Width, 0.0f);
+		}
+	};
+
+	struct BoxArrays
+	{
+		std::vector<float> MinX, MinY, MinZ;
+		std::vector<float> MaxX, MaxY, MaxZ;
+		std::vector<uint32_t> MaterialID, PrimitiveID;
+
+		void Add(const BoxPrimitive& box)
+		{
+			MinX.push_back(box.m_Min.x);
+			MinY.push_back(box.m_Min.y);
+			MinZ.push_back(box.m_Min.z);
+			MaxX.push_back(box.m_Max.x);
+			MaxY.push_back(box.m_Max.y);
+			MaxZ.push_back(box.m_Max.z);
+			MaterialID.push_back(box.m_MaterialID);
+			PrimitiveID.push_back(box.m_PrimitiveID);
+		}
+
+		void Pad()
+		{
+			for (std::vector<float>* array : { &MinX, &MinY, &MinZ, &MaxX, &MaxY, &MaxZ })
+				array->resize(array->size() + SimdFloat::Width, 0.0f);
+		}
+	};
+
+	struct LeafRange
+	{
+		uint32_t SphereOffset = 0;
+		uint32_t SphereCount = 0;
+		uint32_t QuadOffset = 0;
+		uint32_t QuadCount = 0;
+		uint32_t BoxOffset = 0;
+		uint32_t BoxCount = 0;
+	};
+
+	enum class PrimitiveKind : uint8_t
+	{
+		Sphere,
+		Quad,
+		Box
+	};
+
+	struct Candidate
+	{
+		uint32_t Index = ~0u;
+		PrimitiveKind Kind = PrimitiveKind::Sphere;
+	};
+
+	std::vector<LinearBVHNode> m_Nodes;
+	std::vector<LeafRange> m_Leaves;				// Indexed like m_Nodes, only set for leaves
+	std::vector<LinearMotionBVHNode> m_MotionNodes;	// The BVH's, traversed instead of m_Nodes when it has them
+	std::vector<std::shared_ptr<Hittable>> m_Sources;	// The original objects, kept for light sampling
+	SphereArrays m_Spheres;
+	QuadArrays m_Quads;
+	BoxArrays m_Boxes;
+	std::shared_ptr<BVHNode> m_Others;
+	AABB m_Bbox;
+
+	void Collect(const HittableList& list, HittableList& supported, HittableList& others)
+	{
+		for (const std::shared_ptr<Hittable>& object : list.objects)
+		{
+			const std::type_info& type = typeid(*object);
+
+			if (type == typeid(Sphere) || type == typeid(Quad) || type == typeid(BoxPrimitive))
+				supported.Add(object);
+			else if (type == typeid(HittableList))
+				Collect(static_cast<const HittableList&>(*object), supported, others);
+			else
+				others.Add(object);
+		}
+	}
+
+	// Closest hit (shrinking rayT) or, with anyHit, the first hit. Returns whether anything was hit
+	bool Traverse(const Ray& ray, Interval& rayT, Candidate& closest, bool anyHit) const
+	{
+		return m_MotionNodes.empty() ? Traverse(m_Nodes, ray, rayT, closest, anyHit) : Traverse(m_MotionNodes, ray, rayT, closest, anyHit);
+	}
+
+	template<typename NodeType>
+	bool Traverse(const std::vector<NodeType>& nodes, const Ray& ray, Interval& rayT, Candidate& closest, bool anyHit) const
+	{
+		uint32_t stack[64];
+		int stackSize = 0;
+		uint32_t current = 0;
+		bool hitAnything = false;
+
+		while (true)
+		{
+			const NodeType& node = nodes[current];
+
+			if (node.Hit(ray, rayT))
+			{
+				if (node.PrimitiveCount > 0)
+				{
+					const LeafRange& leaf = m_Leaves[current];
+
+					if (leaf.SphereCount > 0 && IntersectSpheres(leaf.SphereOffset, leaf.SphereCount, ray, rayT, closest, anyHit))
+					{
+						hitAnything = true;
+
+						if (anyHit)
+							return true;
+					}
+
+					if (leaf.QuadCount > 0 && IntersectQuads(leaf.QuadOffset, leaf.QuadCount, ray, rayT, closest, anyHit))
+					{
+						hitAnything = true;
+
+						if (anyHit)
+							return true;
+					}
+
+					if (leaf.BoxCount > 0 && IntersectBoxes(leaf.BoxOffset, leaf.BoxCount, ray, rayT, closest, anyHit))
+					{
+						hitAnything = true;
+
+						if (anyHit)
+							return true;
+					}
+				}
+				else
+				{
+					if (ray.Sign(node.Axis))
+					{
+						stack[stackSize++] = current + 1;
+						current = node.Offset;
+					}
+					else
+					{
+						stack[stackSize++] = node.Offset;
+						current = current + 1;
+					}
+
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+				break;
+
+			current = stack[--stackSize];
+		}
+
+		return hitAnything;
+	}
+
+	// Same math as Sphere::Hit, one lane per sphere
+	bool IntersectSpheres(uint32_t offset, uint32_t count, const Ray& ray, Interval& rayT, Candidate& closest, bool anyHit) const
+	{
+		const glm::vec3& o = ray.Origin();
+		const glm::vec3& d = ray.Direction();
+		SimdFloat time(ray.Time());
+		SimdFloat dx(d.x), dy(d.y), dz(d.z);
+		SimdFloat a(glm::length2(d));
+		bool hitAnything = false;
+
+		for (uint32_t i = 0; i < count; i += SimdFloat::Width)
+		{
+			uint32_t base = offset + i;
+
+			SimdFloat ocx = SimdFloat(o.x) - (SimdFloat::Load(&m_Spheres.CenterX[base]) + time * SimdFloat::Load(&m_Spheres.MoveX[base]));
+			SimdFloat ocy = SimdFloat(o.y) - (SimdFloat::Load(&m_Spheres.CenterY[base]) + time * SimdFloat::Load(&m_Spheres.MoveY[base]));
+			SimdFloat ocz = SimdFloat(o.z) - (SimdFloat::Load(&m_Spheres.CenterZ[base]) + time * SimdFloat::Load(&m_Spheres.MoveZ[base]));
+			SimdFloat radius = SimdFloat::Load(&m_Spheres.Radius[base]);
+
+			SimdFloat halfB = ocx * dx + ocy * dy + ocz * dz;
+			SimdFloat c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+			SimdFloat discriminant = halfB * halfB - a * c;
+			SimdFloat sqrtDiscriminant = Sqrt(Max(discriminant, SimdFloat(0.0f)));
+
+			SimdFloat tMin(rayT.Min), tMax(rayT.Max);
+			SimdFloat nearRoot = (SimdFloat(0.0f) - halfB - sqrtDiscriminant) / a;
+			SimdFloat farRoot = (sqrtDiscriminant - halfB) / a;
+			SimdFloat nearValid = (nearRoot > tMin) & (nearRoot < tMax);
+			SimdFloat farValid = (farRoot > tMin) & (farRoot < tMax);
+
+			uint32_t mask = MoveMask((nearValid | farValid) & (discriminant >= SimdFloat(0.0f))) & LaneMask(count - i);
+
+			if (mask == 0)
+				continue;
+
+			if (anyHit)
+				return true;
+
+			alignas(32) float t[SimdFloat::Width];
+			Select(nearValid, nearRoot, farRoot).Store(t);
+
+			for (; mask; mask &= mask - 1)
+			{
+				int lane = LowestLane(mask);
+
+				if (t[lane] < rayT.Max)
+				{
+					rayT.Max = t[lane];
+					closest = { base + lane, PrimitiveKind::Sphere };
+					hitAnything = true;
+				}
+			}
+		}
+
+		return hitAnything;
+	}
+
+	// Same math as Quad::Hit, one lane per quad
+	bool IntersectQuads(uint32_t offset, uint32_t count, const Ray& ray, Interval& rayT, Candidate& closest, bool anyHit) const
+	{
+		const glm::vec3& o = ray.Origin();
+		const glm::vec3& d = ray.Direction();
+		SimdFloat ox(o.x), oy(o.y), oz(o.z);
+		SimdFloat dx(d.x), dy(d.y), dz(d.z);
+		SimdFloat zero(0.0f), one(1.0f);
+		bool hitAnything = false;
+
+		for (uint32_t i = 0; i < count; i += SimdFloat::Width)
+		{
+			uint32_t base = offset + i;
+
+			SimdFloat nx = SimdFloat::Load(&m_Quads.NormalX[base]);
+			SimdFloat ny = SimdFloat::Load(&m_Quads.NormalY[base]);
+			SimdFloat nz = SimdFloat::Load(&m_Quads.NormalZ[base]);
+
+			SimdFloat denominator = nx * dx + ny * dy + nz * dz;
+			SimdFloat t = (SimdFloat::Load(&m_Quads.D[base]) - (nx * ox + ny * oy + nz * oz)) / denominator;
+			SimdFloat valid = (Abs(denominator) >= SimdFloat(1e-8f)) & (t >= SimdFloat(rayT.Min)) & (t <= SimdFloat(rayT.Max));
+
+			if (MoveMask(valid) == 0)
+				continue;
+
+			SimdFloat px = ox + t * dx - SimdFloat::Load(&m_Quads.QX[base]);
+			SimdFloat py = oy + t * dy - SimdFloat::Load(&m_Quads.QY[base]);
+			SimdFloat pz = oz + t * dz - SimdFloat::Load(&m_Quads.QZ[base]);
+
+			SimdFloat ux = SimdFloat::Load(&m_Quads.UX[base]);
+			SimdFloat uy = SimdFloat::Load(&m_Quads.UY[base]);
+			SimdFloat uz = SimdFloat::Load(&m_Quads.UZ[base]);
+			SimdFloat vx = SimdFloat::Load(&m_Quads.VX[base]);
+			SimdFloat vy = SimdFloat::Load(&m_Quads.VY[base]);
+			SimdFloat vz = SimdFloat::Load(&m_Quads.VZ[base]);
+			SimdFloat wx = SimdFloat::Load(&m_Quads.WX[base]);
+			SimdFloat wy = SimdFloat::Load(&m_Quads.WY[base]);
+			SimdFloat wz = SimdFloat::Load(&m_Quads.WZ[base]);
+
+			// alpha = w . (p x v), beta = w . (u x p)
+			SimdFloat alpha = wx * (py * vz - pz * vy) + wy * (pz * vx - px * vz) + wz * (px * vy - py * vx);
+			SimdFloat beta = wx * (uy * pz - uz * py) + wy * (uz * px - ux * pz) + wz * (ux * py - uy * px);
+
+			valid = valid & (alpha >= zero) & (alpha <= one) & (beta >= zero) & (beta <= one);
+			uint32_t mask = MoveMask(valid) & LaneMask(count - i);
+
+			if (mask == 0)
+				continue;
+
+			if (anyHit)
+				return true;
+
+			alignas(32) float ts[SimdFloat::Width];
+			t.Store(ts);
+
+			for (; mask; mask &= mask - 1)
+			{
+				int lane = LowestLane(mask);
+
+				if (ts[lane] < rayT.Max)
+				{
+					rayT.Max = ts[lane];
+					closest = { base + lane, PrimitiveKind::Quad };
+					hitAnything = true;
+				}
+			}
+		}
+
+		return hitAnything;
+	}
+
+	// Same slab test as BoxPrimitive, one lane per box. The running near / far distances are the second operand of
+	// Max / Min so a NaN slab distance leaves them unchanged
+	bool IntersectBoxes(uint32_t offset, uint32_t count, const Ray& ray, Interval& rayT, Candidate& closest, bool anyHit) const
+	{
+		const float* nearSlabs[3] = { ray.Sign(0) ? m_Boxes.MaxX.data() : m_Boxes.MinX.data(), ray.Sign(1) ? m_Boxes.MaxY.data() : m_Boxes.MinY.data(), ray.Sign(2) ? m_Boxes.MaxZ.data() : m_Boxes.MinZ.data() };
+		const float* farSlabs[3] = { ray.Sign(0) ? m_Boxes.MinX.data() : m_Boxes.MaxX.data(), ray.Sign(1) ? m_Boxes.MinY.data() : m_Boxes.MaxY.data(), ray.Sign(2) ? m_Boxes.MinZ.data() : m_Boxes.MaxZ.data() };
+		bool hitAnything = false;
+
+		for (uint32_t i = 0; i < count; i += SimdFloat::Width)
+		{
+			uint32_t base = offset + i;
+			SimdFloat tNear(-Infinity), tFar(Infinity);
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				SimdFloat origin(ray.Origin()[axis]);
+				SimdFloat inverse(ray.InverseDirection()[axis]);
+
+				tNear = Max((SimdFloat::Load(nearSlabs[axis] + base) - origin) * inverse, tNear);
+				tFar = Min((SimdFloat::Load(farSlabs[axis] + base) - origin) * inverse, tFar);
+			}
+
+			SimdFloat tMin(rayT.Min), tMax(rayT.Max);
+			SimdFloat nearValid = (tNear >= tMin) & (tNear <= tMax);
+			SimdFloat farValid = (tFar >= tMin) & (tFar <= tMax);
+			uint32_t mask = MoveMask((nearValid | farValid) & (tNear <= tFar)) & LaneMask(count - i);
+
+			if (mask == 0)
+				continue;
+
+			if (anyHit)
+				return true;
+
+			alignas(32) float t[SimdFloat::Width];
+			Select(nearValid, tNear, tFar).Store(t);
+
+			for (; mask; mask &= mask - 1)
+			{
+				int lane = LowestLane(mask);
+
+				if (t[lane] < rayT.Max)
+				{
+					rayT.Max = t[lane];
+					closest = { base + lane, PrimitiveKind::Box };
+					hitAnything = true;
+				}
+			}
+		}
+
+		return hitAnything;
+	}
+
+	void FinishSphereHit(uint32_t index, const Ray& ray, float t, HitRecord& hit) const
+	{
+		glm::vec3 center(m_Spheres.CenterX[index], m_Spheres.CenterY[index], m_Spheres.CenterZ[index]);
+		center += ray.Time() * glm::vec3(m_Spheres.MoveX[index], m_Spheres.MoveY[index], m_Spheres.MoveZ[index]);
+		float radius = m_Spheres.Radius[index];
+
+		hit.T = t;
+		hit.Point = ray.At(t);
+		hit.MaterialID = m_Spheres.MaterialID[index];
+		hit.PrimitiveID = m_Spheres.PrimitiveID[index];
+
+		glm::vec3 outwardNormal = (hit.Point - center) / radius;
+		hit.SetFaceNormal(ray, outwardNormal);
+		Sphere::GetSphereUV(outwardNormal, hit.U, hit.V);
+	}
+
+	void FinishQuadHit(uint32_t index, const Ray& ray, float t, HitRecord& hit) const
+	{
+		glm::vec3 q(m_Quads.QX[index], m_Quads.QY[index], m_Quads.QZ[index]);
+		glm::vec3 u(m_Quads.UX[index], m_Quads.UY[index], m_Quads.UZ[index]);
+		glm::vec3 v(m_Quads.VX[index], m_Quads.VY[index], m_Quads.VZ[index]);
+		glm::vec3 w(m_Quads.WX[index], m_Quads.WY[index], m_Quads.WZ[index]);
+
+		hit.T = t;
+		hit.Point = ray.At(t);
+
+		glm::vec3 planarHitpointVector = hit.Point - q;
+		hit.U = glm::dot(w, glm::cross(planarHitpointVector, v));
+		hit.V = glm::dot(w, glm::cross(u, planarHitpointVector));
+		hit.MaterialID = m_Quads.MaterialID[index];
+		hit.PrimitiveID = m_Quads.PrimitiveID[index];
+		hit.SetFaceNormal(ray, glm::vec3(m_Quads.NormalX[index], m_Quads.NormalY[index], m_Quads.NormalZ[index]));
+	}
+
+	// The face is the one of the scalar slab test whose distance matches t
+	void FinishBoxHit(uint32_t index, const Ray& ray, float t, HitRecord& hit) const
+	{
+		glm::vec3 min(m_Boxes.MinX[index], m_Boxes.MinY[index], m_Boxes.MinZ[index]);
+		glm::vec3 max(m_Boxes.MaxX[index], m_Boxes.MaxY[index], m_Boxes.MaxZ[index]);
+		BoxPrimitive::SlabHit slabs = BoxPrimitive::Slabs(min, max, ray);
+
+		if (slabs.NearAxis >= 0 && (slabs.FarAxis < 0 || fabs(slabs.Near - t) <= fabs(slabs.Far - t)))
+			BoxPrimitive::SetHit(min, max, slabs.NearAxis, ray.Sign(slabs.NearAxis), ray, t, hit);
+		else
+			BoxPrimitive::SetHit(min, max, std::max(slabs.FarAxis, 0), !ray.Sign(std::max(slabs.FarAxis, 0)), ray, t, hit);
+
+		hit.MaterialID = m_Boxes.MaterialID[index];
+		hit.PrimitiveID = m_Boxes.PrimitiveID[index];
+	}
+};
@@ -5,24 +5,27 @@
 #include "Utils.h"
 #include "Hittable.h"
 #include "HittableList.h"
+#include "Material.h"
 
 class Quad : public Hittable
 {
 public:
 	Quad(const glm::vec3& q, const glm::vec3& u, const glm::vec3& v, std::shared_ptr<Material> material)
-		: m_Q(q), m_U(u), m_V(v), m_Material(material)
+		: m_Q(q), m_U(u), m_V(v), m_MaterialID(MaterialTable::Add(material)), m_PrimitiveID(NewPrimitiveID())
 	{
 		glm::vec3 n = glm::cross(m_U, m_V);
 		m_Normal = glm::normalize(n);
 		m_D = glm::dot(m_Normal, m_Q);
 		m_W = n / glm::dot(n, n);
+		m_Area = glm::length(n);
 
 		SetBoundingBox();
 	}
 
+	// Both diagonals, one alone misses the other two corners when U and V are not axis aligned
 	virtual void SetBoundingBox()
 	{
-		m_Bbox = AABB(m_Q, m_Q + m_V + m_V).Pad();
+		m_Bbox = AABB(AABB(m_Q, m_Q + m_U + m_V), AABB(m_Q + m_U, m_Q + m_V)).Pad();
 	}
 
 	AABB BoundingBox() const override { return m_Bbox; }
@@ -49,12 +52,73 @@ public:
 
 		hit.T = t;
 		hit.Point = intersection;
-		hit.Material = m_Material;
+		hit.MaterialID = m_MaterialID;
+		hit.PrimitiveID = m_PrimitiveID;
 		hit.SetFaceNormal(ray, m_Normal);
 
 		return true;
 	}
 
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		float denominator = glm::dot(m_Normal, ray.Direction());
+
+		if (fabs(denominator) < 1e-8)
+			return false;
+
+		float t = (m_D - glm::dot(m_Normal, ray.Origin())) / denominator;
+
+		if (!rayT.Constains(t))
+			return false;
+
+		glm::vec3 planarHitpointVector = ray.At(t) - m_Q;
+		float alpha = glm::dot(m_W, glm::cross(planarHitpointVector, m_V));
+		float beta = glm::dot(m_W, glm::cross(m_U, planarHitpointVector));
+
+		HitRecord uv;
+		return IsInterior(alpha, beta, uv);
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		if (MaterialTable::Get(m_MaterialID).IsEmissive())
+			lights.push_back(this);
+	}
+
+	bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const override
+	{
+		float alpha = RandomFloat();
+		float beta = RandomFloat();
+		glm::vec3 point = m_Q + alpha * m_U + beta * m_V;
+		glm::vec3 direction = point - origin;
+
+		float distanceSquared = glm::length2(direction);
+		float cosine = fabs(glm::dot(direction, m_Normal)) / sqrt(distanceSquared);
+
+		if (cosine < 1e-6f)
+			return false;
+
+		sample.Direction = direction;
+		sample.Distance = 1.0f;
+		sample.Emitted = MaterialTable::Get(m_MaterialID).Emitted(alpha, beta, point);
+		sample.Pdf = distanceSquared / (cosine * m_Area);
+
+		return true;
+	}
+
+	float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const override
+	{
+		HitRecord hit;
+
+		if (!Hit(Ray(origin, direction, time), Interval(0.001f, Infinity), hit))
+			return 0.0f;
+
+		float distanceSquared = hit.T * hit.T * glm::length2(direction);
+		float cosine = fabs(glm::dot(direction, m_Normal)) / glm::length(direction);
+
+		return distanceSquared / (cosine * m_Area);
+	}
+
 	virtual bool IsInterior(float alpha, float beta, HitRecord& hit) const
 	{
 		if (alpha < 0 || 1 < alpha || beta < 0 || 1 < beta)
@@ -67,32 +131,214 @@ public:
 	}
 
 private:
+	// Copies the geometry into its structure of arrays
+	friend class PrimitiveStore;
+
 	glm::vec3 m_Q;
 	glm::vec3 m_U, m_V;
-	std::shared_ptr<Material> m_Material;
+	uint32_t m_MaterialID;
+	uint32_t m_PrimitiveID;
 	AABB m_Bbox;
 	glm::vec3 m_Normal;
 	float m_D;
 	glm::vec3 m_W;
+	float m_Area;
 };
 
-inline std::shared_ptr<Hittable> Box(const glm::vec3& a, const glm::vec3& b, std::shared_ptr<Material> material)
+// Axis-aligned box intersected with a single slab test. Reports the same normals and UVs as the six quads Box() used
+// to be made of: +-z are the front and back, +-x the right and left, +-y the top and bottom
+class BoxPrimitive : public Hittable
 {
-	std::shared_ptr<HittableList> sides = std::make_shared<HittableList>();
+public:
+	BoxPrimitive(const glm::vec3& a, const glm::vec3& b, std::shared_ptr<Material> material)
+		: m_Min(glm::min(a, b)), m_Max(glm::max(a, b)), m_MaterialID(MaterialTable::Add(material)), m_PrimitiveID(NewPrimitiveID())
+	{
+		m_Bbox = AABB(m_Min, m_Max).Pad();
+
+		glm::vec3 size = m_Max - m_Min;
+		m_Area = 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+	}
+
+	AABB BoundingBox() const override { return m_Bbox; }
 
-	glm::vec3 min = glm::vec3(fmin(a.x, b.x), fmin(a.y, b.y), fmin(a.z, b.z));
-	glm::vec3 max = glm::vec3(fmax(a.x, b.x), fmax(a.y, b.y), fmax(a.z, b.z));
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		SlabHit slabs = Slabs(m_Min, m_Max, ray);
+
+		// Entry face first, the exit face when the entry is outside rayT (rays starting inside the box)
+		if (slabs.NearAxis >= 0 && rayT.Constains(slabs.Near))
+			SetHit(m_Min, m_Max, slabs.NearAxis, ray.Sign(slabs.NearAxis), ray, slabs.Near, hit);
+		else if (slabs.FarAxis >= 0 && rayT.Constains(slabs.Far))
+			SetHit(m_Min, m_Max, slabs.FarAxis, !ray.Sign(slabs.FarAxis), ray, slabs.Far, hit);
+		else
+			return false;
 
-	glm::vec3 dx = glm::vec3(max.x - min.x, 0.0f, 0.0f);
-	glm::vec3 dy = glm::vec3(0.0f, max.y - min.y, 0.0f);
-	glm::vec3 dz = glm::vec3(0.0f, 0.0f, max.z - min.z);
+		hit.MaterialID = m_MaterialID;
+		hit.PrimitiveID = m_PrimitiveID;
 
-	sides->Add(std::make_shared<Quad>(glm::vec3(min.x, min.y, max.z), dx, dy, material));
-	sides->Add(std::make_shared<Quad>(glm::vec3(max.x, min.y, max.z), -dz, dy, material));
-	sides->Add(std::make_shared<Quad>(glm::vec3(max.x, min.y, min.z), -dx, dy, material));
-	sides->Add(std::make_shared<Quad>(glm::vec3(min.x, min.y, min.z), dz, dy, material));
-	sides->Add(std::make_shared<Quad>(glm::vec3(min.x, max.y, max.z), dx, -dz, material));
-	sides->Add(std::make_shared<Quad>(glm::vec3(min.x, min.y, min.z), dx, dz, material));
+		return true;
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		SlabHit slabs = Slabs(m_Min, m_Max, ray);
+
+		return (slabs.NearAxis >= 0 && rayT.Constains(slabs.Near)) || (slabs.FarAxis >= 0 && rayT.Constains(slabs.Far));
+	}
 
-	return sides;
+	bool IsConvex() const override { return true; }
+
+	bool ConvexSpan(const Ray& ray, Interval& span) const override
+	{
+		SlabHit slabs = Slabs(m_Min, m_Max, ray);
+
+		if (slabs.NearAxis < 0 || slabs.FarAxis < 0)
+			return false;
+
+		span = Interval(slabs.Near, slabs.Far);
+
+		return true;
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		if (MaterialTable::Get(m_MaterialID).IsEmissive() && m_Area > 0.0f)
+			lights.push_back(this);
+	}
+
+	// Picks a face proportional to its area and a uniform point on it
+	bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const override
+	{
+		glm::vec3 size = m_Max - m_Min;
+		float faceAreas[3] = { size.y * size.z, size.x * size.z, size.x * size.y };
+		float pick = RandomFloat() * 0.5f * m_Area;
+
+		int axis = pick < faceAreas[0] ? 0 : pick < faceAreas[0] + faceAreas[1] ? 1 : 2;
+		bool onMax = RandomFloat() < 0.5f;
+
+		glm::vec3 point = m_Min + glm::vec3(RandomFloat(), RandomFloat(), RandomFloat()) * size;
+		point[axis] = onMax ? m_Max[axis] : m_Min[axis];
+
+		HitRecord face;
+		SetHit(m_Min, m_Max, axis, onMax, Ray(origin, point - origin, time), 1.0f, face);
+
+		sample.Direction = point - origin;
+		sample.Distance = 1.0f;
+		sample.Emitted = MaterialTable::Get(m_MaterialID).Emitted(face.U, face.V, point);
+		sample.Pdf = LightPdf(origin, sample.Direction, time);
+
+		return sample.Pdf > 0.0f;
+	}
+
+	// Only the first face along the line is visible from origin, a point sampled on the face behind it is always
+	// shadowed by the box itself and contributes nothing, like a hidden triangle of an emissive mesh
+	float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const override
+	{
+		SlabHit slabs = Slabs(m_Min, m_Max, Ray(origin, direction, time));
+		float t;
+		int axis;
+
+		if (slabs.NearAxis >= 0 && slabs.Near > 0.001f)
+		{
+			t = slabs.Near;
+			axis = slabs.NearAxis;
+		}
+		else if (slabs.FarAxis >= 0 && slabs.Far > 0.001f)
+		{
+			t = slabs.Far;
+			axis = slabs.FarAxis;
+		}
+		else
+			return 0.0f;
+
+		float lengthSquared = glm::length2(direction);
+		float cosine = fabs(direction[axis]) / sqrt(lengthSquared);
+
+		return cosine > 1e-6f ? t * t * lengthSquared / (cosine * m_Area) : 0.0f;
+	}
+
+private:
+	// Copies the corners into its structure of arrays and reuses the face lookup
+	friend class PrimitiveStore;
+
+	struct SlabHit
+	{
+		float Near, Far;
+		int NearAxis, FarAxis;	// -1 when no slab limited the distance
+	};
+
+	glm::vec3 m_Min, m_Max;
+	uint32_t m_MaterialID;
+	uint32_t m_PrimitiveID;
+	AABB m_Bbox;
+	float m_Area;
+
+	// Like AABB::Hit, but remembers which axis set the entry and exit distance. A NaN distance (origin on the slab
+	// of an axis-parallel ray) fails both comparisons and leaves that axis out
+	static SlabHit Slabs(const glm::vec3& min, const glm::vec3& max, const Ray& ray)
+	{
+		SlabHit slabs = { -Infinity, Infinity, -1, -1 };
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			bool negative = ray.Sign(axis);
+			float t0 = ((negative ? max[axis] : min[axis]) - ray.Origin()[axis]) * ray.InverseDirection()[axis];
+			float t1 = ((negative ? min[axis] : max[axis]) - ray.Origin()[axis]) * ray.InverseDirection()[axis];
+
+			if (t0 > slabs.Near)
+			{
+				slabs.Near = t0;
+				slabs.NearAxis = axis;
+			}
+
+			if (t1 < slabs.Far)
+			{
+				slabs.Far = t1;
+				slabs.FarAxis = axis;
+			}
+		}
+
+		if (slabs.Near > slabs.Far)
+			slabs.NearAxis = slabs.FarAxis = -1;
+
+		return slabs;
+	}
+
+	// U and V run along the face the same way as the matching quad's u and v edges
+	static void SetHit(const glm::vec3& min, const glm::vec3& max, int axis, bool onMax, const Ray& ray, float t, HitRecord& hit)
+	{
+		hit.T = t;
+		hit.Point = ray.At(t);
+
+		glm::vec3 size = max - min;
+		glm::vec3 fromMin = hit.Point - min;
+		glm::vec3 fromMax = max - hit.Point;
+		auto ratio = [](float a, float b) { return b > 0.0f ? glm::clamp(a / b, 0.0f, 1.0f) : 0.0f; };
+
+		glm::vec3 outwardNormal(0.0f);
+		outwardNormal[axis] = onMax ? 1.0f : -1.0f;
+
+		if (axis == 0)
+		{
+			hit.U = onMax ? ratio(fromMax.z, size.z) : ratio(fromMin.z, size.z);
+			hit.V = ratio(fromMin.y, size.y);
+		}
+		else if (axis == 1)
+		{
+			hit.U = ratio(fromMin.x, size.x);
+			hit.V = onMax ? ratio(fromMax.z, size.z) : ratio(fromMin.z, size.z);
+		}
+		else
+		{
+			hit.U = onMax ? ratio(fromMin.x, size.x) : ratio(fromMax.x, size.x);
+			hit.V = ratio(fromMin.y, size.y);
+		}
+
+		hit.SetFaceNormal(ray, outwardNormal);
+	}
+};
+
+inline std::shared_ptr<Hittable> Box(const glm::vec3& a, const glm::vec3& b, std::shared_ptr<Material> material)
+{
+	return std::make_shared<BoxPrimitive>(a, b, material);
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <utility>
+
 #include "Utils.h"
 
 class Ray
@@ -7,11 +9,19 @@ class Ray
 public:
 	Ray() {}
 
-	Ray(const glm::vec3& origin, const glm::vec3& direction) : m_Origin(origin), m_Direction(direction), m_Time(0.0f) {}
-	Ray(const glm::vec3& origin, const glm::vec3& direction, float time = 0.0f) : m_Origin(origin), m_Direction(direction), m_Time(time) {}
+	Ray(const glm::vec3& origin, const glm::vec3& direction, float time = 0.0f) : m_Origin(origin), m_Direction(direction), m_Time(time)
+	{
+		// Division by zero gives +-inf, which the slab tests rely on for axis-parallel rays
+		m_InverseDirection = 1.0f / m_Direction;
+		m_Sign[0] = m_InverseDirection.x < 0.0f;
+		m_Sign[1] = m_InverseDirection.y < 0.0f;
+		m_Sign[2] = m_InverseDirection.z < 0.0f;
+	}
 
-	glm::vec3 Origin() const { return m_Origin; }
-	glm::vec3 Direction() const { return m_Direction; }
+	const glm::vec3& Origin() const { return m_Origin; }
+	const glm::vec3& Direction() const { return m_Direction; }
+	const glm::vec3& InverseDirection() const { return m_InverseDirection; }
+	bool Sign(int axis) const { return m_Sign[axis]; }
 	float Time() const { return m_Time; }
 
 	glm::vec3 At(float t) const
@@ -19,8 +29,53 @@ public:
 		return m_Origin + t * m_Direction;
 	}
 
+	// Same direction from a different origin, reuses the precomputed inverse direction
+	Ray WithOrigin(const glm::vec3& origin) const
+	{
+		Ray ray = *this;
+		ray.m_Origin = origin;
+		return ray;
+	}
+
 private:
 	glm::vec3 m_Origin;
 	glm::vec3 m_Direction;
+	glm::vec3 m_InverseDirection;
+	bool m_Sign[3];
 	float m_Time;
 };
+
+// Group of rays traced together, lanes whose bit is cleared in ActiveMask are ignored
+struct RayPacket
+{
+	static constexpr int MaxSize = 16;
+
+	Ray Rays[MaxSize];
+	int Size = 0;
+	uint32_t ActiveMask = 0;
+	PCG32* LaneRNG = nullptr;	// Random stream of every lane, null when the lanes share the thread's stream
+};
+
+// Makes a lane's random stream the thread's stream for the lifetime of the scope, so anything random a lane's hit
+// does (like sampling a medium) draws the numbers it would draw when the ray is traced on its own
+class LaneRandomScope
+{
+public:
+	LaneRandomScope(const RayPacket& packet, int lane) : m_Stream(packet.LaneRNG ? &packet.LaneRNG[lane] : nullptr)
+	{
+		if (m_Stream)
+			std::swap(t_RNG, *m_Stream);
+	}
+
+	~LaneRandomScope()
+	{
+		if (m_Stream)
+			std::swap(t_RNG, *m_Stream);
+	}
+
+	LaneRandomScope(const LaneRandomScope&) = delete;
+	LaneRandomScope& operator=(const LaneRandomScope&) = delete;
+
+private:
+	PCG32* m_Stream;
+};
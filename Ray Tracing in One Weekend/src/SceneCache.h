@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include "Image.h"
+#include "Texture.h"
+#include "TriangleMesh.h"
+#include "MeshLoader.h"
+
+// Read only mapping of a whole file, pages are loaded on first touch instead of being read up front
+class MappedFile
+{
+public:
+	MappedFile(const char* filePath)
+	{
+#ifdef _WIN32
+		m_File = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		if (m_File == INVALID_HANDLE_VALUE)
+			return;
+
+		LARGE_INTEGER size;
+
+		if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0)
+			return;
+
+		m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+		if (!m_Mapping)
+			return;
+
+		m_Data = static_cast<const uint8_t*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+		m_Size = m_Data ? static_cast<size_t>(size.QuadPart) : 0;
+#else
+		int file = open(filePath, O_RDONLY);
+
+		if (file < 0)
+			return;
+
+		struct stat status;
+
+		if (fstat(file, &status) == 0 && status.st_size > 0)
+		{
+			void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+			if (data != MAP_FAILED)
+			{
+				m_Data = static_cast<const uint8_t*>(data);
+				m_Size = static_cast<size_t>(status.st_size);
+			}
+		}
+
+		// The mapping stays valid without the descriptor
+		close(file);
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (m_Data) UnmapViewOfFile(m_Data);
+		if (m_Mapping) CloseHandle(m_Mapping);
+		if (m_File != INVALID_HANDLE_VALUE) CloseHandle(m_File);
+#else
+		if (m_Data) munmap(const_cast<uint8_t*>(m_Data), m_Size);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool IsOpen() const { return m_Data != nullptr; }
+	const uint8_t* Data() const { return m_Data; }
+	size_t Size() const { return m_Size; }
+
+private:
+	const uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+
+#ifdef _WIN32
+	HANDLE m_File = INVALID_HANDLE_VALUE;
+	HANDLE m_Mapping = nullptr;
+#endif
+};
+
+// FNV-1a, only used for cache keys so speed matters more than quality
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+
+	return hash;
+}
+
+template<typename T>
+inline uint64_t HashValue(const T& value, uint64_t hash)
+{
+	return HashBytes(&value, sizeof(T), hash);
+}
+
+// Versioned binary file with what is slow to rebuild: meshes in leaf order together with their BVH, and decoded
+// image textures. The file is mapped and its sections are used in place, nothing is copied or deserialized.
+// The whole file is dropped when the hash of the scene text changes, and every section is keyed by the path, size
+// and write time of its source plus its build options, so editing a referenced file only rebuilds that section
+class SceneCache
+{
+public:
+	static constexpr uint32_t Version = 1;
+
+	SceneCache(std::string filePath, uint64_t sceneHash) : m_Path(std::move(filePath)), m_SceneHash(sceneHash)
+	{
+		std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(m_Path.c_str());
+
+		if (!file->IsOpen() || file->Size() < sizeof(FileHeader))
+			return;
+
+		FileHeader header;
+		memcpy(&header, file->Data(), sizeof(header));
+
+		if (memcmp(header.Magic, FileHeader().Magic, sizeof(header.Magic)) != 0 || header.Version != Version || header.SceneHash != m_SceneHash
+			|| header.Layout != LayoutHash() || header.TableOffset > file->Size() || header.SectionCount > (file->Size() - header.TableOffset) / sizeof(Section))
+			return;
+
+		const Section* sections = reinterpret_cast<const Section*>(file->Data() + header.TableOffset);
+
+		for (uint32_t i = 0; i < header.SectionCount; i++)
+		{
+			if (sections[i].Offset <= file->Size() && sections[i].Size <= file->Size() - sections[i].Offset)
+				m_Sections[sections[i].Key] = sections[i];
+		}
+
+		m_File = file;
+	}
+
+	std::shared_ptr<TriangleMesh> LoadMesh(const char* filePath, std::shared_ptr<Material> material, const BVHBuildOptions& options = BVHBuildOptions())
+	{
+		uint64_t key = SourceKey(SectionType::Mesh, filePath);
+		key = HashValue(options.SplitMethod, HashValue(options.BinCount, HashValue(options.MaxLeafSize, key)));
+		key = HashValue(options.TraversalCost, HashValue(options.IntersectionCost, HashValue(options.TreeletPasses, key)));
+
+		MeshView view;
+		std::shared_ptr<TriangleMesh> mesh;
+
+		if (key != 0 && FindMesh(key, view))
+			mesh = std::make_shared<TriangleMesh>(view, m_File, material);
+		else
+		{
+			mesh = ::LoadMesh(filePath, material, options);
+			m_Dirty = true;
+		}
+
+		if (key != 0 && mesh->TriangleCount() > 0 && !Recorded(m_Meshes, key))
+			m_Meshes.emplace_back(key, mesh);
+
+		return mesh;
+	}
+
+	std::shared_ptr<ImageTexture> LoadImageTexture(const char* filePath)
+	{
+		uint64_t key = SourceKey(SectionType::Image, filePath);
+		std::shared_ptr<ImageTexture> texture;
+		auto it = m_Sections.find(key);
+
+		if (key != 0 && it != m_Sections.end() && it->second.Type == SectionType::Image && it->second.Size >= sizeof(ImageHeader))
+		{
+			const uint8_t* begin = m_File->Data() + it->second.Offset;
+			const uint8_t* pixels = Align(begin + sizeof(ImageHeader));
+			ImageHeader header;
+			memcpy(&header, begin, sizeof(header));
+
+			if (header.Width > 0 && header.Height > 0 && pixels <= begin + it->second.Size
+				&& static_cast<uint64_t>(begin + it->second.Size - pixels) >= 4ull * header.Width * header.Height)
+				texture = std::make_shared<ImageTexture>(Image(pixels, header.Width, header.Height, m_File));
+		}
+
+		if (!texture)
+		{
+			texture = std::make_shared<ImageTexture>(filePath);
+			m_Dirty = true;
+		}
+
+		if (key != 0 && texture->GetImage().Height() > 0 && !Recorded(m_Images, key))
+			m_Images.emplace_back(key, texture);
+
+		return texture;
+	}
+
+	// Writes every section used since construction when one of them had to be rebuilt. The new file replaces the
+	// old one by a rename, so sections still mapped from the old file stay valid
+	bool Save()
+	{
+		if (!m_Dirty)
+			return true;
+
+		std::string temporaryPath = m_Path + ".tmp";
+		FILE* file = fopen(temporaryPath.c_str(), "wb");
+
+		if (!file)
+			return false;
+
+		FileHeader header;
+		header.SceneHash = m_SceneHash;
+		header.Layout = LayoutHash();
+
+		std::vector<Section> sections;
+		uint64_t offset = sizeof(FileHeader);
+		bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+
+		auto write = [&](const void* data, size_t size)
+		{
+			// Every array starts on a cache line so it can be used in place
+			static const uint8_t zeros[SectionAlignment] = {};
+			uint64_t padding = (SectionAlignment - offset % SectionAlignment) % SectionAlignment;
+			written = written && fwrite(zeros, 1, padding, file) == padding && fwrite(data, 1, size, file) == size;
+			offset += padding + size;
+		};
+
+		for (const auto& [key, mesh] : m_Meshes)
+		{
+			const MeshView& view = mesh->View();
+			MeshHeader meshHeader{ view.Positions.size(), view.Normals.size(), view.UVs.size(), view.Indices.size(), view.Nodes.size() };
+
+			write(&meshHeader, sizeof(meshHeader));
+			uint64_t begin = offset - sizeof(meshHeader);
+
+			write(view.Positions.data(), view.Positions.size_bytes());
+			write(view.Normals.data(), view.Normals.size_bytes());
+			write(view.UVs.data(), view.UVs.size_bytes());
+			write(view.Indices.data(), view.Indices.size_bytes());
+			write(view.Nodes.data(), view.Nodes.size_bytes());
+
+			sections.push_back({ key, SectionType::Mesh, 0, begin, offset - begin });
+		}
+
+		for (const auto& [key, texture] : m_Images)
+		{
+			const Image& image = texture->GetImage();
+			ImageHeader imageHeader{ image.Width(), image.Height() };
+
+			write(&imageHeader, sizeof(imageHeader));
+			uint64_t begin = offset - sizeof(imageHeader);
+			write(image.Data(), static_cast<size_t>(image.Width()) * image.Height() * image.BytesPerPixel());
+
+			sections.push_back({ key, SectionType::Image, 0, begin, offset - begin });
+		}
+
+		write(sections.data(), sections.size() * sizeof(Section));
+		header.SectionCount = static_cast<uint32_t>(sections.size());
+		header.TableOffset = offset - sections.size() * sizeof(Section);
+
+		written = written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+		written = fclose(file) == 0 && written;
+
+		std::error_code error;
+
+		if (written)
+			std::filesystem::rename(temporaryPath, m_Path, error);
+
+		if (!written || error)
+		{
+			std::filesystem::remove(temporaryPath, error);
+			return false;
+		}
+
+		m_Dirty = false;
+		return true;
+	}
+
+private:
+	static constexpr uint64_t SectionAlignment = 64;
+
+	enum class SectionType : uint32_t
+	{
+		Mesh,
+		Image
+	};
+
+	struct FileHeader
+	{
+		char Magic[8] = { 'R', 'T', 'C', 'A', 'C', 'H', 'E', '\0' };
+		uint32_t Version = SceneCache::Version;
+		uint32_t SectionCount = 0;
+		uint64_t SceneHash = 0;
+		uint64_t Layout = 0;
+		uint64_t TableOffset = 0;
+	};
+
+	struct Section
+	{
+		uint64_t Key;
+		SectionType Type;
+		uint32_t Padding;
+		uint64_t Offset;
+		uint64_t Size;
+	};
+
+	struct MeshHeader
+	{
+		uint64_t PositionCount;
+		uint64_t NormalCount;
+		uint64_t UVCount;
+		uint64_t IndexCount;
+		uint64_t NodeCount;
+	};
+
+	struct ImageHeader
+	{
+		int32_t Width;
+		int32_t Height;
+	};
+
+	std::string m_Path;
+	uint64_t m_SceneHash;
+	std::shared_ptr<MappedFile> m_File;
+	std::unordered_map<uint64_t, Section> m_Sections;
+
+	// Everything handed out, Save writes all of it so the new file is complete
+	std::vector<std::pair<uint64_t, std::shared_ptr<const TriangleMesh>>> m_Meshes;
+	std::vector<std::pair<uint64_t, std::shared_ptr<const ImageTexture>>> m_Images;
+	bool m_Dirty = false;
+
+	template<typename T>
+	static bool Recorded(const std::vector<std::pair<uint64_t, T>>& records, uint64_t key)
+	{
+		return std::any_of(records.begin(), records.end(), [key](const auto& record) { return record.first == key; });
+	}
+
+	// Sections are used in place, so a build with different type sizes must not read them
+	static uint64_t LayoutHash()
+	{
+		uint64_t hash = HashValue(sizeof(glm::vec3), 0);
+		hash = HashValue(sizeof(glm::vec2), hash);
+		hash = HashValue(sizeof(LinearBVHNode), hash);
+		return HashValue(sizeof(void*), hash);
+	}
+
+	// 0 when the source can not be found, it is then loaded without the cache and its error reported as usual
+	static uint64_t SourceKey(SectionType type, const char* filePath)
+	{
+		std::error_code error;
+		uint64_t size = std::filesystem::file_size(filePath, error);
+
+		if (error)
+			return 0;
+
+		auto writeTime = std::filesystem::last_write_time(filePath, error).time_since_epoch().count();
+
+		if (error)
+			return 0;
+
+		uint64_t hash = HashBytes(filePath, strlen(filePath), HashValue(type, 0));
+		return HashValue(writeTime, HashValue(size, hash));
+	}
+
+	// Where write in Save put the next array
+	const uint8_t* Align(const uint8_t* p) const
+	{
+		uint64_t position = static_cast<uint64_t>(p - m_File->Data());
+		return p + (SectionAlignment - position % SectionAlignment) % SectionAlignment;
+	}
+
+	// Takes the arrays in place after checking that they fit in the section
+	bool FindMesh(uint64_t key, MeshView& view) const
+	{
+		auto it = m_Sections.find(key);
+
+		if (it == m_Sections.end() || it->second.Type != SectionType::Mesh || it->second.Size < sizeof(MeshHeader))
+			return false;
+
+		const uint8_t* begin = m_File->Data() + it->second.Offset;
+		const uint8_t* end = begin + it->second.Size;
+		const uint8_t* p = begin + sizeof(MeshHeader);
+
+		MeshHeader header;
+		memcpy(&header, begin, sizeof(header));
+
+		auto take = [&](auto& span, uint64_t count)
+		{
+			using Element = typename std::remove_reference_t<decltype(span)>::element_type;
+			p = Align(p);
+
+			if (p > end || count > static_cast<uint64_t>(end - p) / sizeof(Element))
+				return false;
+
+			span = { reinterpret_cast<Element*>(p), static_cast<size_t>(count) };
+			p += count * sizeof(Element);
+			return true;
+		};
+
+		return take(view.Positions, header.PositionCount) && take(view.Normals, header.NormalCount) && take(view.UVs, header.UVCount)
+			&& take(view.Indices, header.IndexCount) && take(view.Nodes, header.NodeCount);
+	}
+};
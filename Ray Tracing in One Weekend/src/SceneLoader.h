@@ -0,0 +1,541 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Utils.h"
+#include "Camera.h"
+#include "HittableList.h"
+#include "Sphere.h"
+#include "Quad.h"
+#include "Material.h"
+#include "Texture.h"
+#include "ConstantMedium.h"
+#include "GridMedium.h"
+#include "Accelerator.h"
+#include "Instance.h"
+#include "Transform.h"
+#include "MeshLoader.h"
+#include "SceneCache.h"
+
+// Text scene description, one statement per line and '#' starts a comment. Colors are three floats, a texture
+// argument is either a color or the name of a texture, a material argument is the name of a material.
+//
+//   resolution <width> <height>          samples <count>          bounces <count>          background <color>
+//   lookfrom <x y z>   lookat <x y z>    up <x y z>               fov <degrees>            defocus <angle> <distance>
+//   frames <count> <frames per second>
+//   adaptive <threshold>   adaptive sampling up to the sample count, until the relative error is below threshold
+//   packets <size>         camera rays traced in packets of 4, 8 or 16, 0 traces them one by one
+//   wavefront              trace paths in batches one bounce at a time
+//
+//   texture <name> solid <color> | checker <scale> <texture> <texture> | image <path> | noise <scale>
+//   material <name> lambertian <texture> | metal <color> <fuzz> | dielectric <ior> | light <texture> | isotropic <texture>
+//
+//   sphere <material> <center> <radius>
+//   movingsphere <material> <center0> <center1> <radius>
+//   quad <material> <corner> <u> <v>
+//   box <material> <corner> <corner>
+//   mesh <material> <path>
+//   medium <density> <texture> <shape statement without the material>
+//   noisemedium <density> <texture> <noise scale> <corner> <corner> <resolution>   turbulence up to density in a box
+//   fog <density> <color> <center> <radius>   homogeneous medium around the whole scene, a radius of 0 fills all of space
+//
+//   translate <x y z> | rotatey <degrees> | scale <x y z>    compose onto the current transform, like pbrt the last
+//   push | pop                                               one is applied to the shapes first
+//   group <name> ... end                                     collects the shapes in between under one acceleration
+//   instance <name>                                          structure and places it with the current transform
+//   keyframe <seconds> <translation> <rotatey> <scale>       animates the shapes after it: the keyframes are
+//                                                            interpolated and applied after the current transform
+class SceneLoader
+{
+public:
+	// Meshes and image textures come from the cache when one is given. The scene and its groups are built into the
+	// acceleration structure accelerator asks for
+	SceneLoader(Camera& camera, SceneCache* cache = nullptr, const AcceleratorOptions& accelerator = AcceleratorOptions())
+		: m_Camera(camera), m_Cache(cache), m_Accelerator(accelerator) {}
+
+	// Reports the first error with its line and leaves world untouched on failure
+	bool Load(const char* filePath, HittableList& world)
+	{
+		FileReader reader(filePath);
+
+		if (!reader.IsOpen())
+		{
+			std::cout << "Failed to open scene " << filePath << std::endl;
+			return false;
+		}
+
+		m_Lists.assign(1, HittableList());
+		m_States.assign(1, State());
+		m_FogDensity = 0.0f;
+
+		std::string_view line;
+		int lineNumber = 0;
+
+		while (reader.NextLine(line))
+		{
+			lineNumber++;
+
+			m_P = line.data();
+			m_End = line.data() + line.size();
+			m_Error.clear();
+
+			std::string_view keyword = Token();
+
+			if (!keyword.empty() && keyword[0] != '#')
+			{
+				Statement(keyword);
+
+				std::string_view trailing = Token();
+
+				if (m_Error.empty() && !trailing.empty() && trailing[0] != '#')
+					m_Error = "unexpected trailing arguments";
+			}
+
+			if (!m_Error.empty())
+			{
+				std::cout << filePath << ":" << lineNumber << ": " << m_Error << std::endl;
+				return false;
+			}
+		}
+
+		if (m_Lists.size() != 1)
+		{
+			std::cout << filePath << ": group without end" << std::endl;
+			return false;
+		}
+
+		if (!m_Lists[0].objects.empty())
+			world.Add(BuildAccelerator(m_Lists[0], m_Accelerator));
+
+		if (m_FogDensity > 0.0f)
+		{
+			float radius = m_FogRadius > 0.0f ? m_FogRadius : Infinity;
+			world = HittableList(std::make_shared<GlobalMedium>(std::make_shared<HittableList>(world), m_FogDensity, m_FogAlbedo, m_FogCenter, radius));
+		}
+
+		return true;
+	}
+
+private:
+	struct State
+	{
+		Transform ObjectToWorld;
+		bool IsIdentity = true;
+		KeyframeTrack Animation;
+	};
+
+	Camera& m_Camera;
+	SceneCache* m_Cache;
+	AcceleratorOptions m_Accelerator;
+
+	const char* m_P = nullptr;
+	const char* m_End = nullptr;
+	std::string m_Error;
+
+	std::unordered_map<std::string, std::shared_ptr<Texture>> m_Textures;
+	std::unordered_map<std::string, std::shared_ptr<Material>> m_Materials;
+	std::unordered_map<std::string, std::shared_ptr<Hittable>> m_Groups;
+	std::vector<std::string> m_GroupNames;
+	std::vector<HittableList> m_Lists;
+	std::vector<State> m_States;
+
+	float m_FogDensity = 0.0f;
+	glm::vec4 m_FogAlbedo = glm::vec4(1.0f);
+	glm::vec3 m_FogCenter = glm::vec3(0.0f);
+	float m_FogRadius = 0.0f;
+
+	void Statement(std::string_view keyword)
+	{
+		if (keyword == "resolution")
+		{
+			m_Camera.ImageWidth = Int();
+			m_Camera.ImageHeight = Int();
+		}
+		else if (keyword == "samples") m_Camera.SamplesPerPixel = Int();
+		else if (keyword == "bounces") m_Camera.MaxBounces = Int();
+		else if (keyword == "background") m_Camera.BackgroundColor = Color();
+		else if (keyword == "lookfrom") m_Camera.LookFrom = Vec3();
+		else if (keyword == "lookat") m_Camera.LookAt = Vec3();
+		else if (keyword == "up") m_Camera.ViewUp = Vec3();
+		else if (keyword == "fov") m_Camera.VerticalFOV = Float();
+		else if (keyword == "frames")
+		{
+			m_Camera.FrameCount = Int();
+			m_Camera.FrameRate = Float();
+
+			if (m_Error.empty() && (m_Camera.FrameCount < 1 || m_Camera.FrameRate <= 0.0f))
+				m_Error = "frames needs a positive count and rate";
+		}
+		else if (keyword == "adaptive")
+		{
+			m_Camera.AdaptiveSampling = true;
+			m_Camera.AdaptiveThreshold = Float();
+
+			if (m_Error.empty() && m_Camera.AdaptiveThreshold <= 0.0f)
+				m_Error = "adaptive needs a positive threshold";
+		}
+		else if (keyword == "packets")
+		{
+			m_Camera.PacketSize = Int();
+
+			if (m_Error.empty() && !Camera::IsPacketSize(m_Camera.PacketSize))
+				m_Error = "packets needs a size of 0, 1, 4, 8 or 16";
+		}
+		else if (keyword == "wavefront") m_Camera.Wavefront = true;
+		else if (keyword == "defocus")
+		{
+			m_Camera.DefocusAngle = Float();
+			m_Camera.FocusDistance = Float();
+		}
+		else if (keyword == "texture") TextureStatement();
+		else if (keyword == "material") MaterialStatement();
+		else if (keyword == "medium") MediumStatement();
+		else if (keyword == "noisemedium")
+		{
+			float density = Float();
+			std::shared_ptr<Texture> albedo = TextureReference();
+			float noiseScale = Float();
+			glm::vec3 corner0 = Vec3();
+			glm::vec3 corner1 = Vec3();
+			int resolution = Int();
+
+			if (m_Error.empty() && (density <= 0.0f || resolution < 2))
+				m_Error = "noisemedium needs a positive density and a resolution of at least 2";
+			else if (m_Error.empty())
+				Add(std::make_shared<GridMedium>(DensityGrid::FromNoise(AABB(corner0, corner1), resolution, noiseScale, density), albedo));
+		}
+		else if (keyword == "fog")
+		{
+			m_FogDensity = Float();
+			m_FogAlbedo = Color();
+			m_FogCenter = Vec3();
+			m_FogRadius = Float();
+
+			if (m_Error.empty() && (m_FogDensity <= 0.0f || m_FogRadius < 0.0f))
+				m_Error = "fog needs a positive density and a radius of at least 0";
+		}
+		else if (keyword == "translate") Compose(Transform::Translate(Vec3()));
+		else if (keyword == "rotatey") Compose(Transform::RotateY(Float()));
+		else if (keyword == "scale") Compose(Transform::Scale(Vec3()));
+		else if (keyword == "keyframe")
+		{
+			Keyframe key;
+			key.Time = Float();
+			key.Translation = Vec3();
+			key.RotationY = Float();
+			key.Scale = Vec3();
+			m_States.back().Animation.Add(key);
+		}
+		else if (keyword == "push") m_States.push_back(m_States.back());
+		else if (keyword == "pop")
+		{
+			if (m_States.size() == 1)
+				m_Error = "pop without push";
+			else
+				m_States.pop_back();
+		}
+		else if (keyword == "group")
+		{
+			std::string_view name = Token();
+
+			if (name.empty())
+				m_Error = "missing group name";
+
+			m_GroupNames.emplace_back(name);
+			m_Lists.emplace_back();
+			m_States.emplace_back();
+		}
+		else if (keyword == "end") EndGroup();
+		else if (keyword == "instance")
+		{
+			std::string name(Token());
+			auto it = m_Groups.find(name);
+
+			if (it == m_Groups.end())
+				m_Error = "unknown group '" + name + "'";
+			else
+				Add(it->second);
+		}
+		else if (IsShape(keyword))
+		{
+			std::shared_ptr<Material> material = MaterialReference();
+
+			if (!m_Error.empty())
+				return;
+
+			std::shared_ptr<Hittable> shape = Shape(keyword, material);
+
+			if (m_Error.empty())
+				Add(shape);
+		}
+		else
+			m_Error = "unknown statement '" + std::string(keyword) + "'";
+	}
+
+	static bool IsShape(std::string_view keyword)
+	{
+		return keyword == "sphere" || keyword == "movingsphere" || keyword == "quad" || keyword == "box" || keyword == "mesh";
+	}
+
+	std::shared_ptr<Hittable> Shape(std::string_view keyword, std::shared_ptr<Material> material)
+	{
+		if (keyword == "sphere")
+		{
+			glm::vec3 center = Vec3();
+			return std::make_shared<Sphere>(center, Float(), material);
+		}
+
+		if (keyword == "movingsphere")
+		{
+			glm::vec3 from = Vec3();
+			glm::vec3 to = Vec3();
+			return std::make_shared<Sphere>(from, to, Float(), material);
+		}
+
+		if (keyword == "quad")
+		{
+			glm::vec3 q = Vec3();
+			glm::vec3 u = Vec3();
+			return std::make_shared<Quad>(q, u, Vec3(), material);
+		}
+
+		if (keyword == "box")
+		{
+			glm::vec3 a = Vec3();
+			return Box(a, Vec3(), material);
+		}
+
+		if (keyword == "mesh")
+		{
+			std::string path(Token());
+			BVHBuildOptions options = m_Accelerator.BuildOptions();
+			std::shared_ptr<TriangleMesh> mesh = m_Cache ? m_Cache->LoadMesh(path.c_str(), material, options) : LoadMesh(path.c_str(), material, options);
+
+			if (mesh->TriangleCount() == 0)
+				m_Error = "empty mesh '" + path + "'";
+
+			return mesh;
+		}
+
+		m_Error = "unknown shape '" + std::string(keyword) + "'";
+		return nullptr;
+	}
+
+	void TextureStatement()
+	{
+		std::string name(Token());
+		std::string_view type = Token();
+		std::shared_ptr<Texture> texture;
+
+		if (type == "solid")
+			texture = std::make_shared<SolidColorTexture>(Color());
+		else if (type == "checker")
+		{
+			float scale = Float();
+			std::shared_ptr<Texture> even = TextureReference();
+			std::shared_ptr<Texture> odd = TextureReference();
+
+			if (!m_Error.empty())
+				return;
+
+			texture = std::make_shared<CheckerTexture>(scale, even, odd);
+		}
+		else if (type == "image")
+		{
+			std::string path(Token());
+			texture = m_Cache ? m_Cache->LoadImageTexture(path.c_str()) : std::make_shared<ImageTexture>(path.c_str());
+		}
+		else if (type == "noise")
+			texture = std::make_shared<NoiseTexture>(Float());
+		else
+			m_Error = "unknown texture type '" + std::string(type) + "'";
+
+		m_Textures[name] = texture;
+	}
+
+	void MaterialStatement()
+	{
+		std::string name(Token());
+		std::string_view type = Token();
+		std::shared_ptr<Material> material;
+
+		// Every material that takes a texture reads it first, so an unknown one is reported before anything is built
+		std::shared_ptr<Texture> texture;
+
+		if (type == "lambertian" || type == "light" || type == "isotropic")
+		{
+			texture = TextureReference();
+
+			if (!m_Error.empty())
+				return;
+		}
+
+		if (type == "lambertian")
+			material = std::make_shared<Lambertian>(texture);
+		else if (type == "metal")
+		{
+			glm::vec4 albedo = Color();
+			material = std::make_shared<Metal>(albedo, Float());
+		}
+		else if (type == "dielectric")
+			material = std::make_shared<Dielectric>(Float());
+		else if (type == "light")
+			material = std::make_shared<DiffuseLight>(texture);
+		else if (type == "isotropic")
+			material = std::make_shared<Isotropic>(texture);
+		else
+			m_Error = "unknown material type '" + std::string(type) + "'";
+
+		m_Materials[name] = material;
+	}
+
+	// The boundary is transformed like any shape and the medium fills it in world space
+	void MediumStatement()
+	{
+		float density = Float();
+		std::shared_ptr<Texture> albedo = TextureReference();
+		std::string_view keyword = Token();
+
+		if (!m_Error.empty())
+			return;
+
+		std::shared_ptr<Hittable> boundary = Shape(keyword, std::make_shared<Isotropic>(albedo));
+
+		if (m_Error.empty())
+			m_Lists.back().Add(std::make_shared<ConstantMedium>(Transformed(boundary), density, albedo));
+	}
+
+	void EndGroup()
+	{
+		if (m_Lists.size() == 1)
+		{
+			m_Error = "end without group";
+			return;
+		}
+
+		HittableList list = std::move(m_Lists.back());
+		m_Lists.pop_back();
+		m_States.pop_back();
+
+		if (list.objects.empty())
+			m_Error = "empty group '" + m_GroupNames.back() + "'";
+		else
+			m_Groups[m_GroupNames.back()] = BuildAccelerator(list, m_Accelerator);
+
+		m_GroupNames.pop_back();
+	}
+
+	void Compose(const Transform& transform)
+	{
+		m_States.back().ObjectToWorld = m_States.back().ObjectToWorld * transform;
+		m_States.back().IsIdentity = false;
+	}
+
+	std::shared_ptr<Hittable> Transformed(std::shared_ptr<Hittable> object) const
+	{
+		const State& state = m_States.back();
+
+		if (state.IsIdentity && state.Animation.Empty())
+			return object;
+
+		return std::make_shared<Instance>(object, state.ObjectToWorld, state.Animation);
+	}
+
+	void Add(std::shared_ptr<Hittable> object)
+	{
+		m_Lists.back().Add(Transformed(object));
+	}
+
+	std::shared_ptr<Material> MaterialReference()
+	{
+		std::string name(Token());
+		auto it = m_Materials.find(name);
+
+		if (it != m_Materials.end())
+			return it->second;
+
+		m_Error = "unknown material '" + name + "'";
+		return nullptr;
+	}
+
+	// A number starts an inline color, anything else names a texture
+	std::shared_ptr<Texture> TextureReference()
+	{
+		MeshParsing::SkipSpaces(m_P, m_End);
+
+		if (m_P < m_End && (isdigit(*m_P) || *m_P == '.' || *m_P == '-' || *m_P == '+'))
+			return std::make_shared<SolidColorTexture>(Color());
+
+		std::string name(Token());
+		auto it = m_Textures.find(name);
+
+		if (it != m_Textures.end())
+			return it->second;
+
+		m_Error = "unknown texture '" + name + "'";
+		return nullptr;
+	}
+
+	std::string_view Token()
+	{
+		return MeshParsing::NextToken(m_P, m_End);
+	}
+
+	float Float()
+	{
+		float value = 0.0f;
+
+		if (!MeshParsing::ParseFloat(m_P, m_End, value) && m_Error.empty())
+			m_Error = "expected a number";
+
+		return value;
+	}
+
+	int Int()
+	{
+		long long value = 0;
+		MeshParsing::SkipSpaces(m_P, m_End);
+
+		if (!MeshParsing::ParseInt(m_P, m_End, value) && m_Error.empty())
+			m_Error = "expected an integer";
+
+		return static_cast<int>(value);
+	}
+
+	glm::vec3 Vec3()
+	{
+		float x = Float();
+		float y = Float();
+		return glm::vec3(x, y, Float());
+	}
+
+	glm::vec4 Color() { return glm::vec4(Vec3(), 1.0f); }
+};
+
+// With useCache the meshes and textures are cached in "<filePath>.cache", keyed by a hash of the scene text
+inline bool LoadScene(const char* filePath, Camera& camera, HittableList& world, bool useCache = false, const AcceleratorOptions& accelerator = AcceleratorOptions())
+{
+	if (!useCache)
+		return SceneLoader(camera, nullptr, accelerator).Load(filePath, world);
+
+	FileReader reader(filePath);
+	std::string_view line;
+	uint64_t hash = HashValue(SceneCache::Version, 0);
+
+	while (reader.NextLine(line))
+		hash = HashBytes(line.data(), line.size(), HashValue('\n', hash));
+
+	SceneCache cache(std::string(filePath) + ".cache", hash);
+
+	if (!SceneLoader(camera, &cache, accelerator).Load(filePath, world))
+		return false;
+
+	if (!cache.Save())
+		std::cout << "Failed to write the scene cache of " << filePath << std::endl;
+
+	return true;
+}
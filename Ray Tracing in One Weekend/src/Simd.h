@@ -0,0 +1,92 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <immintrin.h>
+
+// Thin wrapper over the widest float vector the build targets: 8 lanes with AVX, 4 with SSE.
+// Comparisons return lane masks (all bits set where true) that combine with &, | and Select. Min and Max return
+// their second operand when either is NaN
+#if defined(__AVX__)
+
+struct SimdFloat
+{
+	static constexpr int Width = 8;
+
+	__m256 V;
+
+	SimdFloat() = default;
+	SimdFloat(__m256 v) : V(v) {}
+	SimdFloat(float f) : V(_mm256_set1_ps(f)) {}
+
+	static SimdFloat Load(const float* p) { return _mm256_loadu_ps(p); }
+	void Store(float* p) const { _mm256_storeu_ps(p, V); }
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.V, b.V); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.V, b.V); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.V, b.V); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.V, b.V); }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return _mm256_and_ps(a.V, b.V); }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return _mm256_or_ps(a.V, b.V); }
+
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.V, b.V, _CMP_LT_OQ); }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.V, b.V, _CMP_LE_OQ); }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.V, b.V, _CMP_GT_OQ); }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.V, b.V, _CMP_GE_OQ); }
+
+inline SimdFloat Sqrt(SimdFloat a) { return _mm256_sqrt_ps(a.V); }
+inline SimdFloat Min(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.V, b.V); }
+inline SimdFloat Max(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.V, b.V); }
+inline SimdFloat Abs(SimdFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.V); }
+inline SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b.V, a.V, mask.V); }
+inline uint32_t MoveMask(SimdFloat mask) { return static_cast<uint32_t>(_mm256_movemask_ps(mask.V)); }
+
+#else
+
+struct SimdFloat
+{
+	static constexpr int Width = 4;
+
+	__m128 V;
+
+	SimdFloat() = default;
+	SimdFloat(__m128 v) : V(v) {}
+	SimdFloat(float f) : V(_mm_set1_ps(f)) {}
+
+	static SimdFloat Load(const float* p) { return _mm_loadu_ps(p); }
+	void Store(float* p) const { _mm_storeu_ps(p, V); }
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm_add_ps(a.V, b.V); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.V, b.V); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.V, b.V); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm_div_ps(a.V, b.V); }
+inline SimdFloat operator&(SimdFloat a, SimdFloat b) { return _mm_and_ps(a.V, b.V); }
+inline SimdFloat operator|(SimdFloat a, SimdFloat b) { return _mm_or_ps(a.V, b.V); }
+
+inline SimdFloat operator<(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a.V, b.V); }
+inline SimdFloat operator<=(SimdFloat a, SimdFloat b) { return _mm_cmple_ps(a.V, b.V); }
+inline SimdFloat operator>(SimdFloat a, SimdFloat b) { return _mm_cmpgt_ps(a.V, b.V); }
+inline SimdFloat operator>=(SimdFloat a, SimdFloat b) { return _mm_cmpge_ps(a.V, b.V); }
+
+inline SimdFloat Sqrt(SimdFloat a) { return _mm_sqrt_ps(a.V); }
+inline SimdFloat Min(SimdFloat a, SimdFloat b) { return _mm_min_ps(a.V, b.V); }
+inline SimdFloat Max(SimdFloat a, SimdFloat b) { return _mm_max_ps(a.V, b.V); }
+inline SimdFloat Abs(SimdFloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.V); }
+inline SimdFloat Select(SimdFloat mask, SimdFloat a, SimdFloat b) { return _mm_or_ps(_mm_and_ps(mask.V, a.V), _mm_andnot_ps(mask.V, b.V)); }
+inline uint32_t MoveMask(SimdFloat mask) { return static_cast<uint32_t>(_mm_movemask_ps(mask.V)); }
+
+#endif
+
+// Mask with the lowest count lanes set
+inline uint32_t LaneMask(uint32_t count)
+{
+	return count >= SimdFloat::Width ? (1u << SimdFloat::Width) - 1 : (1u << count) - 1;
+}
+
+// Index of the lowest set bit, mask must not be 0
+inline int LowestLane(uint32_t mask)
+{
+	return std::countr_zero(mask);
+}
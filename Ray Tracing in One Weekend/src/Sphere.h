@@ -1,17 +1,18 @@
 #pragma once
 
 #include "Hittable.h"
+#include "Material.h"
 
 class Sphere : public Hittable
 {
 public:
-	Sphere(const glm::vec3& center, float radius, std::shared_ptr<Material> material) : m_Center(center), m_Radius(radius), m_Material(material), m_IsMoving(false)
+	Sphere(const glm::vec3& center, float radius, std::shared_ptr<Material> material) : m_Center(center), m_Radius(radius), m_MaterialID(MaterialTable::Add(material)), m_PrimitiveID(NewPrimitiveID()), m_IsMoving(false)
 	{
 		glm::vec3 rvec = glm::vec3(radius, radius, radius);
 		m_Bbox = AABB(m_Center - rvec, m_Center + rvec);
 	}
 
-	Sphere(const glm::vec3& fromCenter, const glm::vec3& toCenter, float radius, std::shared_ptr<Material> material) : m_Center(fromCenter), m_Radius(radius), m_Material(material), m_IsMoving(true)
+	Sphere(const glm::vec3& fromCenter, const glm::vec3& toCenter, float radius, std::shared_ptr<Material> material) : m_Center(fromCenter), m_Radius(radius), m_MaterialID(MaterialTable::Add(material)), m_PrimitiveID(NewPrimitiveID()), m_IsMoving(true)
 	{
 		glm::vec3 rvec = glm::vec3(radius, radius, radius);
 		AABB box1(fromCenter - rvec, fromCenter + rvec);
@@ -26,6 +27,16 @@ public:
 		return m_Bbox;
 	}
 
+	MotionBounds ShutterBounds() const override
+	{
+		glm::vec3 rvec = glm::vec3(m_Radius, m_Radius, m_Radius);
+
+		if (!m_IsMoving)
+			return MotionBounds(m_Bbox, m_Bbox);
+
+		return MotionBounds(AABB(m_Center - rvec, m_Center + rvec), AABB(Center(1.0f) - rvec, Center(1.0f) + rvec));
+	}
+
 	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
 	{
 		glm::vec3 center = m_IsMoving ? Center(ray.Time()) : m_Center;
@@ -53,19 +64,110 @@ public:
 
 		hit.T = root;
 		hit.Point = ray.At(hit.T);
-		hit.Material = m_Material;
+		hit.MaterialID = m_MaterialID;
+		hit.PrimitiveID = m_PrimitiveID;
 
-		glm::vec3 outwardNormal = (hit.Point - m_Center) / m_Radius;
+		glm::vec3 outwardNormal = (hit.Point - center) / m_Radius;
 		hit.SetFaceNormal(ray, outwardNormal);
 		GetSphereUV(outwardNormal, hit.U, hit.V);
 
 		return true;
 	}
 
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		glm::vec3 center = m_IsMoving ? Center(ray.Time()) : m_Center;
+		glm::vec3 oc = ray.Origin() - center;
+		float a = glm::length2(ray.Direction());
+		float halfB = glm::dot(oc, ray.Direction());
+		float c = glm::length2(oc) - m_Radius * m_Radius;
+		float discriminant = halfB * halfB - a * c;
+
+		if (discriminant < 0)
+			return false;
+
+		float sqrtDiscriminant = sqrt(discriminant);
+
+		return rayT.Surrounds((-halfB - sqrtDiscriminant) / a) || rayT.Surrounds((-halfB + sqrtDiscriminant) / a);
+	}
+
+	bool IsConvex() const override { return true; }
+
+	bool ConvexSpan(const Ray& ray, Interval& span) const override
+	{
+		glm::vec3 center = m_IsMoving ? Center(ray.Time()) : m_Center;
+		glm::vec3 oc = ray.Origin() - center;
+		float a = glm::length2(ray.Direction());
+		float halfB = glm::dot(oc, ray.Direction());
+		float c = glm::length2(oc) - m_Radius * m_Radius;
+		float discriminant = halfB * halfB - a * c;
+
+		if (discriminant < 0)
+			return false;
+
+		float sqrtDiscriminant = sqrt(discriminant);
+		span = Interval((-halfB - sqrtDiscriminant) / a, (-halfB + sqrtDiscriminant) / a);
+
+		return true;
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		if (MaterialTable::Get(m_MaterialID).IsEmissive())
+			lights.push_back(this);
+	}
+
+	// Uniform direction inside the cone the sphere subtends from origin
+	bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const override
+	{
+		glm::vec3 toCenter = (m_IsMoving ? Center(time) : m_Center) - origin;
+		float oneMinusCosThetaMax = ConeSize(glm::length2(toCenter));
+
+		if (oneMinusCosThetaMax <= 0.0f)
+			return false;
+
+		float cosTheta = 1.0f - RandomFloat() * oneMinusCosThetaMax;
+		float sinTheta = sqrt(fmax(0.0f, 1.0f - cosTheta * cosTheta));
+		float phi = 2.0f * Pi * RandomFloat();
+
+		glm::vec3 w = glm::normalize(toCenter);
+		glm::vec3 u, v;
+		OrthonormalBasis(w, u, v);
+
+		glm::vec3 direction = cos(phi) * sinTheta * u + sin(phi) * sinTheta * v + cosTheta * w;
+		HitRecord hit;
+
+		if (!Hit(Ray(origin, direction, time), Interval(0.001f, Infinity), hit))
+			return false;
+
+		sample.Direction = direction;
+		sample.Distance = hit.T;
+		sample.Emitted = MaterialTable::Get(m_MaterialID).Emitted(hit.U, hit.V, hit.Point);
+		sample.Pdf = 1.0f / (2.0f * Pi * oneMinusCosThetaMax);
+
+		return true;
+	}
+
+	float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const override
+	{
+		HitRecord hit;
+
+		if (!Hit(Ray(origin, direction, time), Interval(0.001f, Infinity), hit))
+			return 0.0f;
+
+		float oneMinusCosThetaMax = ConeSize(glm::length2((m_IsMoving ? Center(time) : m_Center) - origin));
+
+		return oneMinusCosThetaMax > 0.0f ? 1.0f / (2.0f * Pi * oneMinusCosThetaMax) : 0.0f;
+	}
+
 private:
+	// Copies the geometry into its structure of arrays
+	friend class PrimitiveStore;
+
 	glm::vec3 m_Center;
 	float m_Radius;
-	std::shared_ptr<Material> m_Material;
+	uint32_t m_MaterialID;
+	uint32_t m_PrimitiveID;
 	bool m_IsMoving;
 	glm::vec3 m_MoveVector;
 	AABB m_Bbox;
@@ -75,6 +177,18 @@ private:
 		return m_Center + time * m_MoveVector;
 	}
 
+	// 1 - cos of the half angle of the cone the sphere subtends at the given squared distance from its center,
+	// written so it stays accurate for small cones. 0 when the point is inside the sphere
+	float ConeSize(float distanceSquared) const
+	{
+		float sinThetaMaxSquared = m_Radius * m_Radius / distanceSquared;
+
+		if (sinThetaMaxSquared >= 1.0f)
+			return 0.0f;
+
+		return sinThetaMaxSquared / (1.0f + sqrt(1.0f - sinThetaMaxSquared));
+	}
+
 	static void GetSphereUV(const glm::vec3& point, float& u, float& v)
 	{
 		float theta = acos(-point.y);
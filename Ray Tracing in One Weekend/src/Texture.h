@@ -1,5 +1,8 @@
 #pragma once
 
+#include <typeinfo>
+#include <variant>
+
 #include "Utils.h"
 #include "Image.h"
 #include "Perlin.h"
@@ -12,7 +15,7 @@ public:
 	virtual glm::vec4 Value(float u, float v, const glm::vec3& point) const = 0;
 };
 
-class SolidColorTexture : public Texture
+class SolidColorTexture final : public Texture
 {
 public:
 	SolidColorTexture(glm::vec4 color) : m_Color(color) {}
@@ -27,11 +30,41 @@ private:
 	glm::vec4 m_Color;
 };
 
-class CheckerTexture : public Texture
+// Texture as materials hold it. Solid colors, which most materials use, are stored inline and read without a virtual
+// call, any other texture is shared
+class TextureHandle
+{
+public:
+	TextureHandle(const glm::vec4& color) : m_Texture(SolidColorTexture(color)) {}
+
+	// A null texture reads as black instead of failing on first use
+	TextureHandle(std::shared_ptr<Texture> texture)
+	{
+		if (!texture)
+			m_Texture = SolidColorTexture(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+		else if (typeid(*texture) == typeid(SolidColorTexture))
+			m_Texture = static_cast<const SolidColorTexture&>(*texture);
+		else
+			m_Texture = std::move(texture);
+	}
+
+	glm::vec4 Value(float u, float v, const glm::vec3& point) const
+	{
+		if (const SolidColorTexture* solid = std::get_if<SolidColorTexture>(&m_Texture))
+			return solid->Value(u, v, point);
+
+		return std::get<std::shared_ptr<Texture>>(m_Texture)->Value(u, v, point);
+	}
+
+private:
+	std::variant<std::shared_ptr<Texture>, SolidColorTexture> m_Texture;
+};
+
+class CheckerTexture final : public Texture
 {
 public:
 	CheckerTexture(float scale, std::shared_ptr<Texture> evenTexture, std::shared_ptr<Texture> oddTexture) : m_InvertedScale(1 / scale), m_EvenTexture(evenTexture), m_OddTexture(oddTexture) {}
-	CheckerTexture(float scale, glm::vec4 evenColor, glm::vec4 oddColor) : m_InvertedScale(1 / scale), m_EvenTexture(std::make_shared<SolidColorTexture>(evenColor)), m_OddTexture(std::make_shared<SolidColorTexture>(oddColor)) {}
+	CheckerTexture(float scale, glm::vec4 evenColor, glm::vec4 oddColor) : m_InvertedScale(1 / scale), m_EvenTexture(evenColor), m_OddTexture(oddColor) {}
 
 	glm::vec4 Value(float u, float v, const glm::vec3& point) const override
 	{
@@ -41,19 +74,22 @@ public:
 
 		bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
 
-		return isEven ? m_EvenTexture->Value(u, v, point) : m_OddTexture->Value(u, v, point);
+		return isEven ? m_EvenTexture.Value(u, v, point) : m_OddTexture.Value(u, v, point);
 	}
 
 private:
 	float m_InvertedScale;
-	std::shared_ptr<Texture> m_EvenTexture;
-	std::shared_ptr<Texture> m_OddTexture;
+	TextureHandle m_EvenTexture;
+	TextureHandle m_OddTexture;
 };
 
-class ImageTexture : public Texture
+class ImageTexture final : public Texture
 {
 public:
 	ImageTexture(const char* filePath) : m_Image(filePath) {}
+	ImageTexture(Image image) : m_Image(std::move(image)) {}
+
+	const Image& GetImage() const { return m_Image; }
 
 	glm::vec4 Value(float u, float v, const glm::vec3& point) const override
 	{
@@ -74,7 +110,7 @@ private:
 	Image m_Image;
 };
 
-class NoiseTexture : public Texture
+class NoiseTexture final : public Texture
 {
 public:
 	NoiseTexture() {}
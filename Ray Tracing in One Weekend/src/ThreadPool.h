@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a queue it pops from the back of,
+// idle workers steal from the front of the other queues.
+class ThreadPool
+{
+public:
+	ThreadPool(uint32_t threadCount = 0)
+	{
+		if (threadCount == 0)
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+		for (uint32_t i = 0; i < threadCount; i++)
+			m_Queues.push_back(std::make_unique<WorkQueue>());
+
+		for (uint32_t i = 0; i < threadCount; i++)
+			m_Workers.emplace_back([this, i]() { WorkerLoop(i); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_SleepMutex);
+			m_Stop = true;
+		}
+
+		m_WakeCondition.notify_all();
+
+		for (std::thread& worker : m_Workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	uint32_t ThreadCount() const { return static_cast<uint32_t>(m_Workers.size()); }
+
+	void Submit(std::function<void()> task)
+	{
+		// Tasks spawned from a worker stay on that worker's queue, everything else is dealt round-robin
+		uint32_t index = s_WorkerIndex < m_Queues.size() && s_WorkerPool == this
+			? s_WorkerIndex
+			: m_NextQueue++ % m_Queues.size();
+
+		m_Pending++;
+
+		{
+			std::lock_guard<std::mutex> lock(m_Queues[index]->Mutex);
+			m_Queues[index]->Tasks.push_back(std::move(task));
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_SleepMutex);
+			m_Queued++;
+		}
+
+		m_WakeCondition.notify_one();
+	}
+
+	// Blocks until every submitted task has finished
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_DoneMutex);
+		m_DoneCondition.wait(lock, [this]() { return m_Pending == 0; });
+	}
+
+private:
+	struct WorkQueue
+	{
+		std::mutex Mutex;
+		std::deque<std::function<void()>> Tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkQueue>> m_Queues;
+	std::vector<std::thread> m_Workers;
+
+	std::atomic<uint32_t> m_NextQueue = 0;
+	std::atomic<uint32_t> m_Pending = 0;
+	std::atomic<uint32_t> m_Queued = 0;
+	bool m_Stop = false;
+
+	std::mutex m_SleepMutex;
+	std::condition_variable m_WakeCondition;
+	std::mutex m_DoneMutex;
+	std::condition_variable m_DoneCondition;
+
+	inline static thread_local uint32_t s_WorkerIndex = ~0u;
+	inline static thread_local ThreadPool* s_WorkerPool = nullptr;
+
+	void WorkerLoop(uint32_t index)
+	{
+		s_WorkerIndex = index;
+		s_WorkerPool = this;
+
+		while (true)
+		{
+			std::function<void()> task;
+
+			if (PopLocal(index, task) || Steal(index, task))
+			{
+				task();
+
+				if (--m_Pending == 0)
+				{
+					std::lock_guard<std::mutex> lock(m_DoneMutex);
+					m_DoneCondition.notify_all();
+				}
+
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(m_SleepMutex);
+			m_WakeCondition.wait(lock, [this]() { return m_Stop || m_Queued > 0; });
+
+			if (m_Stop && m_Queued == 0)
+				return;
+		}
+	}
+
+	bool PopLocal(uint32_t index, std::function<void()>& task)
+	{
+		WorkQueue& queue = *m_Queues[index];
+		std::lock_guard<std::mutex> lock(queue.Mutex);
+
+		if (queue.Tasks.empty())
+			return false;
+
+		task = std::move(queue.Tasks.back());
+		queue.Tasks.pop_back();
+		m_Queued--;
+
+		return true;
+	}
+
+	bool Steal(uint32_t index, std::function<void()>& task)
+	{
+		for (size_t offset = 1; offset < m_Queues.size(); offset++)
+		{
+			WorkQueue& victim = *m_Queues[(index + offset) % m_Queues.size()];
+			std::lock_guard<std::mutex> lock(victim.Mutex);
+
+			if (victim.Tasks.empty())
+				continue;
+
+			task = std::move(victim.Tasks.front());
+			victim.Tasks.pop_front();
+			m_Queued--;
+
+			return true;
+		}
+
+		return false;
+	}
+};
+
+// Number of chunks ParallelFor splits count items into, a few per thread and none below a thousand items
+inline uint32_t ParallelChunkCount(ThreadPool* pool, size_t count)
+{
+	if (!pool)
+		return 1;
+
+	return static_cast<uint32_t>(std::clamp<size_t>(count / 1024, 1, 4 * static_cast<size_t>(pool->ThreadCount())));
+}
+
+// Runs body(chunk, begin, end) over chunks of [0, count) on the pool and waits for them, or as one chunk on the calling
+// thread without a pool. The same count always gives the same chunks. Waits like ThreadPool::Wait, so it must not be
+// called from a worker of the pool
+template<typename Body>
+inline void ParallelFor(ThreadPool* pool, size_t count, const Body& body)
+{
+	uint32_t chunkCount = ParallelChunkCount(pool, count);
+
+	if (chunkCount == 1)
+	{
+		body(0u, static_cast<size_t>(0), count);
+		return;
+	}
+
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+		pool->Submit([&body, chunk, chunkCount, count]() { body(chunk, count * chunk / chunkCount, count * (chunk + 1) / chunkCount); });
+
+	pool->Wait();
+}
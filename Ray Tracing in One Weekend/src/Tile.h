@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Utils.h"
+
+enum class TileOrder
+{
+	Scanline,
+	Spiral,
+	Hilbert
+};
+
+struct Tile
+{
+	int X, Y;
+	int Width, Height;
+};
+
+// Distance of (x, y) along a Hilbert curve filling an n x n grid (n must be a power of two)
+inline uint32_t HilbertIndex(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+
+	for (uint32_t s = n / 2; s > 0; s /= 2)
+	{
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+
+			std::swap(x, y);
+		}
+	}
+
+	return d;
+}
+
+inline std::vector<Tile> GenerateTiles(int imageWidth, int imageHeight, int tileSize, TileOrder order)
+{
+	tileSize = std::max(1, tileSize);
+
+	int tilesX = (imageWidth + tileSize - 1) / tileSize;
+	int tilesY = (imageHeight + tileSize - 1) / tileSize;
+
+	std::vector<Tile> tiles;
+	std::vector<float> keys;
+	tiles.reserve(tilesX * tilesY);
+	keys.reserve(tilesX * tilesY);
+
+	uint32_t hilbertSize = 1;
+	while (hilbertSize < static_cast<uint32_t>(std::max(tilesX, tilesY)))
+		hilbertSize *= 2;
+
+	float centerX = (tilesX - 1) * 0.5f;
+	float centerY = (tilesY - 1) * 0.5f;
+
+	for (int ty = 0; ty < tilesY; ty++)
+	{
+		for (int tx = 0; tx < tilesX; tx++)
+		{
+			Tile tile;
+			tile.X = tx * tileSize;
+			tile.Y = ty * tileSize;
+			tile.Width = std::min(tileSize, imageWidth - tile.X);
+			tile.Height = std::min(tileSize, imageHeight - tile.Y);
+			tiles.push_back(tile);
+
+			float key = 0.0f;
+
+			if (order == TileOrder::Hilbert)
+			{
+				key = static_cast<float>(HilbertIndex(hilbertSize, tx, ty));
+			}
+			else if (order == TileOrder::Spiral)
+			{
+				// Rings of tiles around the image center, walked by angle inside each ring
+				float dx = tx - centerX;
+				float dy = ty - centerY;
+				float ring = std::floor(std::max(std::fabs(dx), std::fabs(dy)));
+				float angle = std::atan2(dy, dx) + Pi;
+				key = ring * 8.0f + angle;
+			}
+			else
+			{
+				key = static_cast<float>(tiles.size());
+			}
+
+			keys.push_back(key);
+		}
+	}
+
+	std::vector<size_t> indices(tiles.size());
+	for (size_t i = 0; i < indices.size(); i++)
+		indices[i] = i;
+
+	std::stable_sort(indices.begin(), indices.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+	std::vector<Tile> sorted;
+	sorted.reserve(tiles.size());
+
+	for (size_t index : indices)
+		sorted.push_back(tiles[index]);
+
+	return sorted;
+}
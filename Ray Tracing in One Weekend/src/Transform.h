@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Utils.h"
+#include "AABB.h"
+
+// Affine 3x4 transform: the linear part is applied first, then the translation
+struct Transform
+{
+	glm::mat3 Linear = glm::mat3(1.0f);
+	glm::vec3 Translation = glm::vec3(0.0f);
+
+	glm::vec3 Point(const glm::vec3& point) const { return Linear * point + Translation; }
+	glm::vec3 Vector(const glm::vec3& vector) const { return Linear * vector; }
+
+	Transform Inverse() const
+	{
+		glm::mat3 inverse = glm::inverse(Linear);
+		return { inverse, -(inverse * Translation) };
+	}
+
+	// Box around the transformed box, each output axis takes the smaller / larger contribution of every input axis
+	AABB Bounds(const AABB& box) const
+	{
+		glm::vec3 min = Translation;
+		glm::vec3 max = Translation;
+
+		for (int column = 0; column < 3; column++)
+		{
+			for (int row = 0; row < 3; row++)
+			{
+				float a = Linear[column][row] * box.Axis(column).Min;
+				float b = Linear[column][row] * box.Axis(column).Max;
+				min[row] += fmin(a, b);
+				max[row] += fmax(a, b);
+			}
+		}
+
+		return AABB(min, max);
+	}
+
+	static Transform Translate(const glm::vec3& offset)
+	{
+		Transform transform;
+		transform.Translation = offset;
+		return transform;
+	}
+
+	// Same rotation as RotateY
+	static Transform RotateY(float angle)
+	{
+		float radians = glm::radians(angle);
+		float sinTheta = sin(radians);
+		float cosTheta = cos(radians);
+
+		Transform transform;
+		transform.Linear = glm::mat3(glm::vec3(cosTheta, 0.0f, -sinTheta), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(sinTheta, 0.0f, cosTheta));
+		return transform;
+	}
+
+	static Transform Scale(const glm::vec3& scale)
+	{
+		Transform transform;
+		transform.Linear = glm::mat3(glm::vec3(scale.x, 0.0f, 0.0f), glm::vec3(0.0f, scale.y, 0.0f), glm::vec3(0.0f, 0.0f, scale.z));
+		return transform;
+	}
+};
+
+// a * b applies b first
+inline Transform operator*(const Transform& a, const Transform& b)
+{
+	return { a.Linear * b.Linear, a.Linear * b.Translation + a.Translation };
+}
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <span>
+#include <vector>
+
+#include "Utils.h"
+#include "Hittable.h"
+#include "Material.h"
+#include "BVH.h"
+
+// Shared vertex and index buffers of a mesh, normals and UVs are optional and indexed like the positions
+struct MeshData
+{
+	std::vector<glm::vec3> Positions;
+	std::vector<glm::vec3> Normals;
+	std::vector<glm::vec2> UVs;
+	std::vector<uint32_t> Indices;	// Three per triangle
+};
+
+// A mesh already in leaf order with its BVH built, viewed in place wherever it is stored
+struct MeshView
+{
+	std::span<const glm::vec3> Positions;
+	std::span<const glm::vec3> Normals;
+	std::span<const glm::vec2> UVs;
+	std::span<const uint32_t> Indices;	// In leaf order
+	std::span<const LinearBVHNode> Nodes;
+};
+
+// Indexed triangle mesh with its own BVH over the triangles. Triangles are stored in leaf order, so a leaf is a
+// contiguous range of the index buffer and costs no memory beyond the buffers and the nodes
+class TriangleMesh : public Hittable
+{
+public:
+	TriangleMesh(MeshData data, std::shared_ptr<Material> material, const BVHBuildOptions& options = BVHBuildOptions())
+	{
+		std::shared_ptr<BuiltMesh> built = std::make_shared<BuiltMesh>();
+		built->Data.Positions = std::move(data.Positions);
+
+		if (data.Normals.size() == built->Data.Positions.size())
+			built->Data.Normals = std::move(data.Normals);
+
+		if (data.UVs.size() == built->Data.Positions.size())
+			built->Data.UVs = std::move(data.UVs);
+
+		uint32_t triangleCount = static_cast<uint32_t>(data.Indices.size() / 3);
+
+		if (triangleCount > 0)
+		{
+			const std::vector<glm::vec3>& positions = built->Data.Positions;
+			std::vector<AABB> bounds(triangleCount);
+
+			for (uint32_t i = 0; i < triangleCount; i++)
+			{
+				const glm::vec3& p0 = positions[data.Indices[3 * i]];
+				const glm::vec3& p1 = positions[data.Indices[3 * i + 1]];
+				const glm::vec3& p2 = positions[data.Indices[3 * i + 2]];
+
+				bounds[i] = AABB(AABB(p0, p1), AABB(p2, p2)).Pad();
+			}
+
+			std::vector<uint32_t> order(triangleCount);
+			std::iota(order.begin(), order.end(), 0);
+			built->Nodes = BVHBuilder(bounds, options).Build(order);
+
+			built->Data.Indices.resize(3 * static_cast<size_t>(triangleCount));
+
+			for (uint32_t i = 0; i < triangleCount; i++)
+			{
+				for (int k = 0; k < 3; k++)
+					built->Data.Indices[3 * i + k] = data.Indices[3 * order[i] + k];
+			}
+		}
+
+		MeshView view{ built->Data.Positions, built->Data.Normals, built->Data.UVs, built->Data.Indices, built->Nodes };
+		Initialize(view, std::move(built), material);
+	}
+
+	// Uses buffers that were built before, storage keeps the memory they point into alive
+	TriangleMesh(const MeshView& view, std::shared_ptr<const void> storage, std::shared_ptr<Material> material)
+	{
+		Initialize(view, std::move(storage), material);
+	}
+
+	const MeshView& View() const { return m_Mesh; }
+
+	AABB BoundingBox() const override { return m_Bbox; }
+
+	uint32_t TriangleCount() const { return static_cast<uint32_t>(m_Mesh.Indices.size() / 3); }
+
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		if (m_Mesh.Nodes.empty())
+			return false;
+
+		uint32_t stack[64];
+		int stackSize = 0;
+		uint32_t current = 0;
+
+		ShearedRay sheared(ray);
+		uint32_t closest = UINT32_MAX;
+		float closestU = 0.0f, closestV = 0.0f;
+
+		while (true)
+		{
+			const LinearBVHNode& node = m_Mesh.Nodes[current];
+
+			if (node.Bbox.Hit(ray, rayT))
+			{
+				if (node.PrimitiveCount > 0)
+				{
+					for (uint32_t i = node.Offset; i < node.Offset + node.PrimitiveCount; i++)
+					{
+						float t, u, v;
+
+						if (IntersectTriangle(i, sheared, rayT, t, u, v))
+						{
+							closest = i;
+							closestU = u;
+							closestV = v;
+							rayT.Max = t;
+						}
+					}
+				}
+				else
+				{
+					if (ray.Sign(node.Axis))
+					{
+						stack[stackSize++] = current + 1;
+						current = node.Offset;
+					}
+					else
+					{
+						stack[stackSize++] = node.Offset;
+						current = current + 1;
+					}
+
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+				break;
+
+			current = stack[--stackSize];
+		}
+
+		if (closest == UINT32_MAX)
+			return false;
+
+		// Only the closest triangle pays for the hit record
+		FillHit(closest, closestU, closestV, ray, rayT.Max, hit);
+
+		return true;
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		if (m_Mesh.Nodes.empty())
+			return false;
+
+		ShearedRay sheared(ray);
+		uint32_t stack[64];
+		int stackSize = 0;
+		uint32_t current = 0;
+
+		while (true)
+		{
+			const LinearBVHNode& node = m_Mesh.Nodes[current];
+
+			if (node.Bbox.Hit(ray, rayT))
+			{
+				if (node.PrimitiveCount > 0)
+				{
+					for (uint32_t i = node.Offset; i < node.Offset + node.PrimitiveCount; i++)
+					{
+						float t, u, v;
+
+						if (IntersectTriangle(i, sheared, rayT, t, u, v))
+							return true;
+					}
+				}
+				else
+				{
+					stack[stackSize++] = node.Offset;
+					current = current + 1;
+
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+				break;
+
+			current = stack[--stackSize];
+		}
+
+		return false;
+	}
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		if (!m_AreaCdf.empty())
+			lights.push_back(this);
+	}
+
+	bool SampleLight(const glm::vec3& origin, float time, LightSample& sample) const override
+	{
+		float totalArea = m_AreaCdf.back();
+
+		// Pick a triangle proportional to its area, then a uniform point on it
+		uint32_t triangle = static_cast<uint32_t>(std::upper_bound(m_AreaCdf.begin(), m_AreaCdf.end(), RandomFloat() * totalArea) - m_AreaCdf.begin());
+		triangle = std::min(triangle, TriangleCount() - 1);
+
+		float root = sqrt(RandomFloat());
+		float u = 1.0f - root;
+		float v = RandomFloat() * root;
+
+		const glm::vec3& p0 = Vertex(triangle, 0);
+		glm::vec3 e1 = Vertex(triangle, 1) - p0;
+		glm::vec3 e2 = Vertex(triangle, 2) - p0;
+		glm::vec3 point = p0 + u * e1 + v * e2;
+		glm::vec3 direction = point - origin;
+
+		float distanceSquared = glm::length2(direction);
+		float cosine = fabs(glm::dot(direction, glm::normalize(glm::cross(e1, e2)))) / sqrt(distanceSquared);
+
+		if (cosine < 1e-6f)
+			return false;
+
+		glm::vec2 uv = TextureCoordinates(triangle, u, v);
+
+		sample.Direction = direction;
+		sample.Distance = 1.0f;
+		sample.Emitted = MaterialTable::Get(m_MaterialID).Emitted(uv.x, uv.y, point);
+		sample.Pdf = distanceSquared / (cosine * totalArea);
+
+		return true;
+	}
+
+	float LightPdf(const glm::vec3& origin, const glm::vec3& direction, float time) const override
+	{
+		HitRecord hit;
+
+		if (m_AreaCdf.empty() || !Hit(Ray(origin, direction, time), Interval(0.001f, Infinity), hit))
+			return 0.0f;
+
+		uint32_t triangle = hit.PrimitiveID - m_FirstPrimitiveID;
+		const glm::vec3& p0 = Vertex(triangle, 0);
+		glm::vec3 normal = glm::normalize(glm::cross(Vertex(triangle, 1) - p0, Vertex(triangle, 2) - p0));
+
+		float distanceSquared = hit.T * hit.T * glm::length2(direction);
+		float cosine = fabs(glm::dot(direction, normal)) / glm::length(direction);
+
+		return distanceSquared / (cosine * m_AreaCdf.back());
+	}
+
+private:
+	struct BuiltMesh
+	{
+		MeshData Data;
+		std::vector<LinearBVHNode> Nodes;
+	};
+
+	MeshView m_Mesh;
+	std::shared_ptr<const void> m_Storage;
+	std::vector<float> m_AreaCdf;		// Running sum of triangle areas, only kept for emissive meshes
+	uint32_t m_MaterialID;
+	uint32_t m_FirstPrimitiveID;
+	AABB m_Bbox;
+
+	const glm::vec3& Vertex(uint32_t triangle, int corner) const
+	{
+		return m_Mesh.Positions[m_Mesh.Indices[3 * triangle + corner]];
+	}
+
+	void Initialize(const MeshView& view, std::shared_ptr<const void> storage, std::shared_ptr<Material> material)
+	{
+		m_Mesh = view;
+		m_Storage = std::move(storage);
+		m_MaterialID = MaterialTable::Add(material);
+		m_FirstPrimitiveID = NewPrimitiveID(TriangleCount());
+
+		if (!m_Mesh.Nodes.empty())
+			m_Bbox = m_Mesh.Nodes[0].Bbox;
+
+		if (MaterialTable::Get(m_MaterialID).IsEmissive())
+			BuildAreaDistribution();
+	}
+
+	// Ray transformed so that it points along +z from the origin, shared by every triangle test of one query
+	struct ShearedRay
+	{
+		glm::vec3 Origin;
+		int Kx, Ky, Kz;
+		float Sx, Sy, Sz;
+
+		ShearedRay(const Ray& ray) : Origin(ray.Origin())
+		{
+			glm::vec3 d = glm::abs(ray.Direction());
+			Kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+			Kx = (Kz + 1) % 3;
+			Ky = (Kx + 1) % 3;
+
+			// Swapping keeps the winding, so U, V and W below keep their sign convention
+			if (ray.Direction()[Kz] < 0.0f)
+				std::swap(Kx, Ky);
+
+			Sx = ray.Direction()[Kx] / ray.Direction()[Kz];
+			Sy = ray.Direction()[Ky] / ray.Direction()[Kz];
+			Sz = 1.0f / ray.Direction()[Kz];
+		}
+	};
+
+	// Watertight test of Woop et al.: a ray through a shared edge or vertex hits at least one of the triangles
+	// instead of slipping between them. u and v are the barycentric weights of the second and third vertex
+	bool IntersectTriangle(uint32_t triangle, const ShearedRay& ray, const Interval& rayT, float& t, float& u, float& v) const
+	{
+		glm::vec3 a = Vertex(triangle, 0) - ray.Origin;
+		glm::vec3 b = Vertex(triangle, 1) - ray.Origin;
+		glm::vec3 c = Vertex(triangle, 2) - ray.Origin;
+
+		float ax = a[ray.Kx] - ray.Sx * a[ray.Kz];
+		float ay = a[ray.Ky] - ray.Sy * a[ray.Kz];
+		float bx = b[ray.Kx] - ray.Sx * b[ray.Kz];
+		float by = b[ray.Ky] - ray.Sy * b[ray.Kz];
+		float cx = c[ray.Kx] - ray.Sx * c[ray.Kz];
+		float cy = c[ray.Ky] - ray.Sy * c[ray.Kz];
+
+		float edgeU = cx * by - cy * bx;
+		float edgeV = ax * cy - ay * cx;
+		float edgeW = bx * ay - by * ax;
+
+		// Exactly on an edge in single precision, decide it in double so neighbours agree
+		if (edgeU == 0.0f || edgeV == 0.0f || edgeW == 0.0f)
+		{
+			edgeU = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+			edgeV = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+			edgeW = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+		}
+
+		if ((edgeU < 0.0f || edgeV < 0.0f || edgeW < 0.0f) && (edgeU > 0.0f || edgeV > 0.0f || edgeW > 0.0f))
+			return false;
+
+		float determinant = edgeU + edgeV + edgeW;
+
+		if (determinant == 0.0f)
+			return false;
+
+		float scaledT = edgeU * ray.Sz * a[ray.Kz] + edgeV * ray.Sz * b[ray.Kz] + edgeW * ray.Sz * c[ray.Kz];
+		t = scaledT / determinant;
+
+		if (!rayT.Constains(t))
+			return false;
+
+		u = edgeV / determinant;
+		v = edgeW / determinant;
+
+		return true;
+	}
+
+	void FillHit(uint32_t triangle, float u, float v, const Ray& ray, float t, HitRecord& hit) const
+	{
+		const glm::vec3& p0 = Vertex(triangle, 0);
+		glm::vec3 geometricNormal = glm::normalize(glm::cross(Vertex(triangle, 1) - p0, Vertex(triangle, 2) - p0));
+
+		hit.T = t;
+		hit.Point = ray.At(t);
+		hit.MaterialID = m_MaterialID;
+		hit.PrimitiveID = m_FirstPrimitiveID + triangle;
+		hit.SetFaceNormal(ray, geometricNormal);
+
+		if (!m_Mesh.Normals.empty())
+		{
+			// The side is decided by the geometric normal, the interpolated one only bends the shading
+			const uint32_t* index = &m_Mesh.Indices[3 * triangle];
+			glm::vec3 shadingNormal = (1.0f - u - v) * m_Mesh.Normals[index[0]] + u * m_Mesh.Normals[index[1]] + v * m_Mesh.Normals[index[2]];
+
+			if (glm::dot(shadingNormal, geometricNormal) < 0.0f)
+				shadingNormal = -shadingNormal;
+
+			hit.Normal = glm::normalize(hit.FrontFace ? shadingNormal : -shadingNormal);
+		}
+
+		glm::vec2 uv = TextureCoordinates(triangle, u, v);
+		hit.U = uv.x;
+		hit.V = uv.y;
+	}
+
+	glm::vec2 TextureCoordinates(uint32_t triangle, float u, float v) const
+	{
+		if (m_Mesh.UVs.empty())
+			return glm::vec2(u, v);
+
+		const uint32_t* index = &m_Mesh.Indices[3 * triangle];
+		return (1.0f - u - v) * m_Mesh.UVs[index[0]] + u * m_Mesh.UVs[index[1]] + v * m_Mesh.UVs[index[2]];
+	}
+
+	void BuildAreaDistribution()
+	{
+		m_AreaCdf.resize(TriangleCount());
+		float totalArea = 0.0f;
+
+		for (uint32_t i = 0; i < TriangleCount(); i++)
+		{
+			const glm::vec3& p0 = Vertex(i, 0);
+			totalArea += 0.5f * glm::length(glm::cross(Vertex(i, 1) - p0, Vertex(i, 2) - p0));
+			m_AreaCdf[i] = totalArea;
+		}
+
+		if (totalArea <= 0.0f)
+			m_AreaCdf.clear();
+	}
+};
@@ -1,16 +1,62 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
-#include <cstdlib>
 #include <glm/glm.hpp>
 #include <glm/gtx/norm.hpp>
 
 const float Infinity = std::numeric_limits<float>::infinity();
 const float Pi = 3.1415926535897932385f;
 
-inline double RandomFloat() { return rand() / (RAND_MAX + 1.0f); }
+// PCG32 (XSH RR) generator, small enough to keep one per thread
+struct PCG32
+{
+	uint64_t State;
+	uint64_t Increment;
+
+	void Seed(uint64_t seed, uint64_t stream)
+	{
+		State = 0;
+		Increment = (stream << 1u) | 1u;
+		Next();
+		State += seed;
+		Next();
+	}
+
+	uint32_t Next()
+	{
+		uint64_t oldState = State;
+		State = oldState * 6364136223846793005ULL + Increment;
+
+		uint32_t xorShifted = static_cast<uint32_t>(((oldState >> 18u) ^ oldState) >> 27u);
+		uint32_t rotation = static_cast<uint32_t>(oldState >> 59u);
+
+		return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+	}
+};
+
+inline uint64_t HashCombine(uint64_t a, uint64_t b)
+{
+	// SplitMix64 finalizer over the combined key
+	uint64_t x = a ^ (b + 0x9E3779B97F4A7C15ULL + (a << 6) + (a >> 2));
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Every thread draws from its own generator so sampling never contends on a shared lock
+inline thread_local PCG32 t_RNG = { 0x853C49E6748FEA9BULL, 0xDA3E39CB94B95BDBULL };
+
+// Keys the calling thread's generator to (seed, pixel, sample) so a sample is reproducible no matter
+// which thread renders it or how many threads are used
+inline void SeedRandom(uint64_t seed, uint64_t pixel, uint64_t sample)
+{
+	t_RNG.Seed(HashCombine(HashCombine(seed, pixel), sample), pixel);
+}
+
+inline double RandomFloat() { return t_RNG.Next() * (1.0 / 4294967296.0); }
 inline double RandomFloat(float min, float max) { return min + (max - min) * RandomFloat(); }
 
 // Random Color with the alpha channel set to always be 1
@@ -71,5 +117,16 @@ inline glm::vec3 RandomOnHemisphere(const glm::vec3& normal)
 	return -onUnitSphere;
 }
 
+// Builds tangent and bitangent completing the unit vector n to an orthonormal basis
+inline void OrthonormalBasis(const glm::vec3& n, glm::vec3& tangent, glm::vec3& bitangent)
+{
+	float sign = std::copysign(1.0f, n.z);
+	float a = -1.0f / (sign + n.z);
+	float b = n.x * n.y * a;
+
+	tangent = glm::vec3(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+	bitangent = glm::vec3(b, sign + n.y * n.y * a, -n.y);
+}
+
 #include "Interval.h"
 #include "Ray.h"
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64)
+	#include <immintrin.h>
+	#define WIDE_BVH_SSE 1
+#endif
+
+#include "Utils.h"
+#include "Hittable.h"
+#include "HittableList.h"
+#include "BVH.h"
+
+// Node with Width children whose bounds are stored as structure of arrays, so one ray can be tested
+// against all of them with a few SIMD instructions
+template<int Width>
+struct alignas(32) WideBVHNode
+{
+	float Bounds[6][Width];				// MinX, MinY, MinZ, MaxX, MaxY, MaxZ
+	uint32_t Child[Width];				// Node index for interior children, first primitive for leaves
+	uint16_t PrimitiveCount[Width];		// 0 for interior children
+	uint32_t ValidMask;					// Bit i is set when child slot i is used
+};
+
+// BVH4 / BVH8 collapsed from the binary SAH build
+template<int Width>
+class WideBVH : public Hittable
+{
+	static_assert(Width == 4 || Width == 8, "WideBVH supports 4 or 8 children per node");
+
+public:
+	WideBVH(const HittableList& list, const BVHBuildOptions& options = BVHBuildOptions())
+		: WideBVH(BVHNode(list, options)) {}
+
+	WideBVH(const BVHNode& binary)
+		: m_Primitives(binary.Primitives()), m_LeafPrimitives(binary.LeafPrimitives()), m_Bbox(binary.BoundingBox())
+	{
+		const std::vector<LinearBVHNode>& nodes = binary.Nodes();
+
+		if (nodes.empty())
+			return;
+
+		Collapse(nodes, 0);
+	}
+
+	bool Hit(const Ray& ray, Interval rayT, HitRecord& hit) const override
+	{
+		if (m_Nodes.empty())
+			return false;
+
+		const glm::vec3& origin = ray.Origin();
+		const glm::vec3& invDirection = ray.InverseDirection();
+
+		StackEntry stack[StackSize];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, 0, rayT.Min };
+		bool hitAnything = false;
+
+		while (stackSize > 0)
+		{
+			StackEntry entry = stack[--stackSize];
+
+			// The ray may have been shortened since this entry was pushed
+			if (entry.TNear > rayT.Max)
+				continue;
+
+			if (entry.PrimitiveCount > 0)
+			{
+				for (uint32_t i = 0; i < entry.PrimitiveCount; i++)
+				{
+					if (m_LeafPrimitives[entry.Index + i].Hit(ray, rayT, hit))
+					{
+						hitAnything = true;
+						rayT.Max = hit.T;
+					}
+				}
+
+				continue;
+			}
+
+			const WideBVHNode<Width>& node = m_Nodes[entry.Index];
+			alignas(32) float tNear[Width];
+			uint32_t mask = IntersectChildren(node, origin, invDirection, rayT, tNear);
+
+			// Push the hit children far to near so the nearest one is popped first
+			int order[Width];
+			int count = 0;
+
+			for (int i = 0; i < Width; i++)
+			{
+				if (!(mask & (1u << i)))
+					continue;
+
+				int j = count++;
+
+				while (j > 0 && tNear[order[j - 1]] < tNear[i])
+				{
+					order[j] = order[j - 1];
+					j--;
+				}
+
+				order[j] = i;
+			}
+
+			for (int k = 0; k < count; k++)
+			{
+				int i = order[k];
+				stack[stackSize++] = { node.Child[i], node.PrimitiveCount[i], tNear[i] };
+			}
+		}
+
+		return hitAnything;
+	}
+
+	bool Occluded(const Ray& ray, Interval rayT) const override
+	{
+		if (m_Nodes.empty())
+			return false;
+
+		// Any hit ends the query, so children are pushed unsorted
+		StackEntry stack[StackSize];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, 0, rayT.Min };
+
+		while (stackSize > 0)
+		{
+			StackEntry entry = stack[--stackSize];
+
+			if (entry.PrimitiveCount > 0)
+			{
+				for (uint32_t i = 0; i < entry.PrimitiveCount; i++)
+				{
+					if (m_LeafPrimitives[entry.Index + i].Occluded(ray, rayT))
+						return true;
+				}
+
+				continue;
+			}
+
+			const WideBVHNode<Width>& node = m_Nodes[entry.Index];
+			alignas(32) float tNear[Width];
+			uint32_t mask = IntersectChildren(node, ray.Origin(), ray.InverseDirection(), rayT, tNear);
+
+			for (int i = 0; i < Width; i++)
+			{
+				if (mask & (1u << i))
+					stack[stackSize++] = { node.Child[i], node.PrimitiveCount[i], tNear[i] };
+			}
+		}
+
+		return false;
+	}
+
+	AABB BoundingBox() const override { return m_Bbox; }
+
+	void GatherLights(std::vector<const Hittable*>& lights) const override
+	{
+		for (const std::shared_ptr<Hittable>& primitive : m_Primitives)
+			primitive->GatherLights(lights);
+	}
+
+	// Only refits, the collapsed topology is kept however far the primitives move
+	bool Animate(float time) override
+	{
+		bool moved = false;
+
+		for (const std::shared_ptr<Hittable>& primitive : m_Primitives)
+			moved |= primitive->Animate(time);
+
+		if (!moved || m_Nodes.empty())
+			return moved;
+
+		// Collapse appends children after their parent, so a backwards pass sees them first
+		for (size_t n = m_Nodes.size(); n-- > 0;)
+		{
+			WideBVHNode<Width>& node = m_Nodes[n];
+
+			for (int i = 0; i < Width; i++)
+			{
+				if (!(node.ValidMask & (1u << i)))
+					continue;
+
+				AABB box;
+
+				if (node.PrimitiveCount[i] > 0)
+				{
+					for (uint32_t k = node.Child[i]; k < node.Child[i] + node.PrimitiveCount[i]; k++)
+						box = AABB(box, m_Primitives[k]->BoundingBox());
+				}
+				else
+				{
+					box = NodeBounds(m_Nodes[node.Child[i]]);
+				}
+
+				for (int k = 0; k < 3; k++)
+				{
+					node.Bounds[k][i] = box.Axis(k).Min;
+					node.Bounds[k + 3][i] = box.Axis(k).Max;
+				}
+			}
+		}
+
+		m_Bbox = NodeBounds(m_Nodes[0]);
+
+		return true;
+	}
+
+private:
+	struct StackEntry
+	{
+		uint32_t Index;
+		uint32_t PrimitiveCount;
+		float TNear;
+	};
+
+	static constexpr int StackSize = 64 * Width;
+
+	std::vector<WideBVHNode<Width>> m_Nodes;
+	std::vector<std::shared_ptr<Hittable>> m_Primitives;
+	std::vector<LeafPrimitive> m_LeafPrimitives;
+	AABB m_Bbox;
+
+	static AABB NodeBounds(const WideBVHNode<Width>& node)
+	{
+		AABB box;
+
+		for (int i = 0; i < Width; i++)
+		{
+			if (node.ValidMask & (1u << i))
+				box = AABB(box, AABB(glm::vec3(node.Bounds[0][i], node.Bounds[1][i], node.Bounds[2][i]), glm::vec3(node.Bounds[3][i], node.Bounds[4][i], node.Bounds[5][i])));
+		}
+
+		return box;
+	}
+
+	uint32_t Collapse(const std::vector<LinearBVHNode>& nodes, uint32_t binaryIndex)
+	{
+		// Open up the largest interior child until the node has Width children
+		std::vector<uint32_t> children;
+
+		if (nodes[binaryIndex].PrimitiveCount > 0)
+		{
+			children.push_back(binaryIndex);
+		}
+		else
+		{
+			children.push_back(binaryIndex + 1);
+			children.push_back(nodes[binaryIndex].Offset);
+		}
+
+		while (children.size() < Width)
+		{
+			int largest = -1;
+			float largestArea = -1.0f;
+
+			for (size_t i = 0; i < children.size(); i++)
+			{
+				const LinearBVHNode& child = nodes[children[i]];
+
+				if (child.PrimitiveCount == 0 && child.Bbox.SurfaceArea() > largestArea)
+				{
+					largest = static_cast<int>(i);
+					largestArea = child.Bbox.SurfaceArea();
+				}
+			}
+
+			if (largest == -1)
+				break;
+
+			uint32_t opened = children[largest];
+			children[largest] = opened + 1;
+			children.push_back(nodes[opened].Offset);
+		}
+
+		uint32_t index = static_cast<uint32_t>(m_Nodes.size());
+		m_Nodes.emplace_back();
+
+		WideBVHNode<Width> wide;
+		wide.ValidMask = 0;
+
+		for (int i = 0; i < Width; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				wide.Bounds[k][i] = Infinity;
+				wide.Bounds[k + 3][i] = -Infinity;
+			}
+
+			wide.Child[i] = 0;
+			wide.PrimitiveCount[i] = 0;
+		}
+
+		for (size_t i = 0; i < children.size(); i++)
+		{
+			const LinearBVHNode& child = nodes[children[i]];
+
+			for (int k = 0; k < 3; k++)
+			{
+				wide.Bounds[k][i] = child.Bbox.Axis(k).Min;
+				wide.Bounds[k + 3][i] = child.Bbox.Axis(k).Max;
+			}
+
+			wide.ValidMask |= 1u << i;
+
+			if (child.PrimitiveCount > 0)
+			{
+				wide.Child[i] = child.Offset;
+				wide.PrimitiveCount[i] = child.PrimitiveCount;
+			}
+			else
+			{
+				wide.Child[i] = Collapse(nodes, children[i]);
+			}
+		}
+
+		m_Nodes[index] = wide;
+
+		return index;
+	}
+
+	static uint32_t IntersectChildren(const WideBVHNode<Width>& node, const glm::vec3& origin, const glm::vec3& invDirection, const Interval& rayT, float* tNear)
+	{
+#if WIDE_BVH_SSE
+	#if defined(__AVX__)
+		if constexpr (Width == 8)
+			return IntersectAVX(node, origin, invDirection, rayT, tNear);
+	#endif
+
+		uint32_t mask = 0;
+
+		for (int offset = 0; offset < Width; offset += 4)
+			mask |= IntersectSSE(node, offset, origin, invDirection, rayT, tNear + offset) << offset;
+
+		return mask & node.ValidMask;
+#else
+		uint32_t mask = 0;
+
+		for (int i = 0; i < Width; i++)
+		{
+			float tMin = rayT.Min;
+			float tMax = rayT.Max;
+
+			// Slabs ordered by the direction's sign and NaN distances left out, like AABB::Hit
+			for (int k = 0; k < 3; k++)
+			{
+				bool negative = invDirection[k] < 0.0f;
+				float t0 = (node.Bounds[negative ? k + 3 : k][i] - origin[k]) * invDirection[k];
+				float t1 = (node.Bounds[negative ? k : k + 3][i] - origin[k]) * invDirection[k];
+
+				tMin = t0 > tMin ? t0 : tMin;
+				tMax = t1 < tMax ? t1 : tMax;
+			}
+
+			tNear[i] = tMin;
+
+			if (tMin <= tMax * 1.00000036f)
+				mask |= 1u << i;
+		}
+
+		return mask & node.ValidMask;
+#endif
+	}
+
+#if WIDE_BVH_SSE
+	// Lanes [offset, offset + 4) of the node. Like AABB::Hit the slabs are ordered by the direction's sign, so no
+	// min / max of the two distances is needed. The running tMin / tMax are the second operand of max / min, which
+	// SSE returns when the distance is NaN (0 * inf, the origin of an axis-parallel ray on the slab), so that axis
+	// is left out instead of culling the child
+	static uint32_t IntersectSSE(const WideBVHNode<Width>& node, int offset, const glm::vec3& origin, const glm::vec3& invDirection, const Interval& rayT, float* tNear)
+	{
+		__m128 tMin = _mm_set1_ps(rayT.Min);
+		__m128 tMax = _mm_set1_ps(rayT.Max);
+
+		for (int k = 0; k < 3; k++)
+		{
+			__m128 o = _mm_set1_ps(origin[k]);
+			__m128 inv = _mm_set1_ps(invDirection[k]);
+			bool negative = invDirection[k] < 0.0f;
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.Bounds[negative ? k + 3 : k][offset]), o), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.Bounds[negative ? k : k + 3][offset]), o), inv);
+
+			tMin = _mm_max_ps(t0, tMin);
+			tMax = _mm_min_ps(t1, tMax);
+		}
+
+		_mm_storeu_ps(tNear, tMin);
+
+		// Far distance widened by 1 + 2 gamma(3) like AABB::Hit, for the thin padded boxes of axis-aligned quads
+		tMax = _mm_mul_ps(tMax, _mm_set1_ps(1.00000036f));
+
+		return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tMin, tMax)));
+	}
+#endif
+
+#if WIDE_BVH_SSE && defined(__AVX__)
+	static uint32_t IntersectAVX(const WideBVHNode<Width>& node, const glm::vec3& origin, const glm::vec3& invDirection, const Interval& rayT, float* tNear)
+	{
+		__m256 tMin = _mm256_set1_ps(rayT.Min);
+		__m256 tMax = _mm256_set1_ps(rayT.Max);
+
+		for (int k = 0; k < 3; k++)
+		{
+			__m256 o = _mm256_set1_ps(origin[k]);
+			__m256 inv = _mm256_set1_ps(invDirection[k]);
+			bool negative = invDirection[k] < 0.0f;
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.Bounds[negative ? k + 3 : k]), o), inv);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.Bounds[negative ? k : k + 3]), o), inv);
+
+			tMin = _mm256_max_ps(t0, tMin);
+			tMax = _mm256_min_ps(t1, tMax);
+		}
+
+		_mm256_store_ps(tNear, tMin);
+
+		tMax = _mm256_mul_ps(tMax, _mm256_set1_ps(1.00000036f));
+
+		return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ))) & node.ValidMask;
+	}
+#endif
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;